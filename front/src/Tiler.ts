@@ -30,37 +30,54 @@ const CheckTileExistence = (formatStr, coord) => {
     });
 };
 
-const GenerateManifest = (formatStr, beginCoord, endCoord, maxInFlight, remaining) => {
-    return new Promise((resolve, reject) => {
-        let list = [];
-        let toCheck = [];
+// Resolves to the coordinates of every tile in [beginCoord, endCoord) that exists, the server checks them all
+// and sends each level as it is done as ranges of tiles, counted from beginCoord with x fastest
+const GenerateManifest = async (formatStr, beginCoord, endCoord, remaining) => {
+    const width = endCoord[0] - beginCoord[0];
+    const height = endCoord[1] - beginCoord[1];
+    let list = [];
 
-        for(let z = beginCoord[2]; z < endCoord[2]; ++z) {
-            for(let y = beginCoord[1]; y < endCoord[1]; ++y) {
-                for(let x = beginCoord[0]; x < endCoord[0]; ++x) {
-                    toCheck.push([x, y, z]);
-                }
-            }
-        }
+    remaining.value = width * height * (endCoord[2] - beginCoord[2]);
+
+    const response = await fetch("/api/manifest", {
+        method: "POST",
+        headers: { "Content-Type": "application/json;charset=UTF-8" },
+        body: JSON.stringify({
+            "formatStr": formatStr,
+            "beginCoord": beginCoord,
+            "endCoord": endCoord
+        })
+    });
+    if (!response.ok) throw new Error(await response.text());
 
-        remaining.value = toCheck.length;
+    const HandleLine = (line) => {
+        if (line.length === 0) return;
+        const val = JSON.parse(line);
+        if (val.error !== undefined) throw new Error(val.error);
+        if (val.z === undefined) return;
 
-        const CheckThenContinue = () => {
-            if (toCheck.length === 0) return;
+        const ranges = val.ranges;
+        for (let i = 0; i < ranges.length; i += 2) {
+            for (let index = ranges[i]; index < ranges[i] + ranges[i + 1]; ++index) {
+                list.push([beginCoord[0] + index % width, beginCoord[1] + Math.floor(index / width), val.z]);
+            }
+        }
+        remaining.value -= width * height;
+    };
 
-            const coord = toCheck.pop();
+    const reader = response.body.getReader();
+    const decoder = new TextDecoder();
+    let pending = "";
+    while (true) {
+        const { done, value } = await reader.read();
+        if (done) break;
 
-            CheckTileExistence(formatStr, coord)
-            .then(val => {
-                if (val) list.push(coord);
-            })
-            .finally(() => {
-                CheckThenContinue();
-                remaining.value = toCheck.length;
-                if (toCheck.length === 0) resolve(list);
-            });
-        };
+        pending += decoder.decode(value, { stream: true });
+        const lines = pending.split("\n");
+        pending = lines.pop();
+        lines.forEach(HandleLine);
+    }
+    HandleLine(pending);
 
-        for (let i = 0; i < maxInFlight; ++i) CheckThenContinue();
-    });
+    return list;
 };
\ No newline at end of file
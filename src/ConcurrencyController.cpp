@@ -0,0 +1,187 @@
+#include "ConcurrencyController.hpp"
+
+#include <cmath>
+
+namespace HyperTiler {
+    // Latency rises below this are noise on fast connections, not queueing
+    static constexpr std::chrono::milliseconds LatencySlack = std::chrono::milliseconds(5);
+
+    bool ConcurrencyController::HasRoom(Clock::time_point now) const {
+        return now >= m_pausedUntil && m_inFlight < std::max(1, static_cast<int>(m_window));
+    }
+
+    bool ConcurrencyController::Decrease(double factor, Ticket ticket) {
+        if (ticket < m_lastDecrease) return false;
+
+        m_window = std::max(1.0, m_window * factor);
+        m_slowStart = false;
+        m_lastDecrease = Clock::now();
+        return true;
+    }
+
+    bool ConcurrencyController::TryAcquire(Ticket& ticket) {
+        std::lock_guard<std::mutex> lock(m_mut);
+
+        ticket = Clock::now();
+        if (!HasRoom(ticket)) return false;
+
+        ++m_inFlight;
+        return true;
+    }
+
+    bool ConcurrencyController::Acquire(Ticket& ticket, std::atomic_bool const* RunningFlag) {
+        std::unique_lock<std::mutex> lock(m_mut);
+
+        while (true) {
+            if (RunningFlag && !*RunningFlag) return false;
+
+            ticket = Clock::now();
+            if (HasRoom(ticket)) break;
+
+            // Releases notify, pauses just run out, and the running flag is polled
+            Clock::time_point wakeup = ticket + std::chrono::milliseconds(100);
+            if (m_pausedUntil > ticket) wakeup = std::min(wakeup, m_pausedUntil);
+            m_changed.wait_until(lock, wakeup);
+        }
+
+        ++m_inFlight;
+        return true;
+    }
+
+    void ConcurrencyController::Release(Ticket ticket, Outcome const& outcome) {
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+
+            // Checked before this request leaves, growing only makes sense while the window is in use
+            const bool windowFull = m_inFlight >= static_cast<int>(m_window);
+            --m_inFlight;
+
+            Clock::time_point const now = Clock::now();
+            ++m_completed;
+
+            m_periodBytes += outcome.Bytes;
+            if (now - m_periodStart >= std::chrono::seconds(1)) {
+                const double seconds = std::chrono::duration<double>(now - m_periodStart).count();
+                const double rate = static_cast<double>(m_periodBytes) / seconds;
+                m_throughput = m_throughput == 0.0 ? rate : m_throughput * 0.7 + rate * 0.3;
+                m_periodBytes = 0;
+                m_periodStart = now;
+            }
+
+            if (IsThrottled(outcome.Status)) {
+                ++m_throttled;
+
+                Clock::duration pause = outcome.RetryAfter > Clock::duration::zero() ? outcome.RetryAfter : Clock::duration(DefaultPause);
+                pause = std::min(pause, Clock::duration(MaxPause));
+                m_pausedUntil = std::max(m_pausedUntil, now + pause);
+
+                const double throttledWindow = std::floor(m_window);
+                if (Decrease(0.5, ticket)) {
+                    m_ceiling = throttledWindow;
+                    m_ceilingUntil = now + CeilingLifetime;
+                }
+            } else if (outcome.Status == 0 || outcome.Status >= 500) {
+                ++m_failed;
+                Decrease(0.5, ticket);
+            } else {
+                m_baseline = std::min(m_baseline, outcome.Latency);
+                m_periodMin = std::min(m_periodMin, outcome.Latency);
+                if (++m_periodSamples >= BaselineSamples) {
+                    m_baseline = m_periodMin;
+                    m_periodMin = Clock::duration::max();
+                    m_periodSamples = 0;
+                }
+
+                if (outcome.Latency > m_baseline * LatencyTolerance + LatencySlack) {
+                    Decrease(0.8, ticket);
+                } else if (windowFull) {
+                    double maxWindow = static_cast<double>(m_limit);
+                    if (m_ceiling > 0.0 && now < m_ceilingUntil) maxWindow = std::min(maxWindow, std::max(1.0, m_ceiling - 1.0));
+
+                    m_window = std::min(m_window + (m_slowStart ? 1.0 : 1.0 / m_window), std::max(m_window, maxWindow));
+                }
+            }
+        }
+        m_changed.notify_all();
+    }
+
+    void ConcurrencyController::Abandon(Ticket /*ticket*/) {
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            --m_inFlight;
+        }
+        m_changed.notify_all();
+    }
+
+    void ConcurrencyController::SetLimit(int limit) {
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            m_limit = std::max(1, limit);
+            m_window = std::min(m_window, static_cast<double>(m_limit));
+        }
+        m_changed.notify_all();
+    }
+
+    int ConcurrencyController::Limit() const {
+        std::lock_guard<std::mutex> lock(m_mut);
+        return m_limit;
+    }
+
+    int ConcurrencyController::Window() const {
+        std::lock_guard<std::mutex> lock(m_mut);
+        return std::max(1, static_cast<int>(m_window));
+    }
+
+    int ConcurrencyController::InFlight() const {
+        std::lock_guard<std::mutex> lock(m_mut);
+        return m_inFlight;
+    }
+
+    ConcurrencyController::Clock::duration ConcurrencyController::PauseRemaining() const {
+        std::lock_guard<std::mutex> lock(m_mut);
+        Clock::time_point const now = Clock::now();
+        return m_pausedUntil > now ? m_pausedUntil - now : Clock::duration::zero();
+    }
+
+    json ConcurrencyController::Status() const {
+        std::lock_guard<std::mutex> lock(m_mut);
+        Clock::time_point const now = Clock::now();
+
+        using std::chrono::microseconds;
+        using std::chrono::duration_cast;
+
+        return {
+            {"window", json(std::max(1, static_cast<int>(m_window)))},
+            {"limit", json(m_limit)},
+            {"inFlight", json(m_inFlight)},
+            {"slowStart", json(m_slowStart)},
+            {"ceiling", m_ceiling > 0.0 && now < m_ceilingUntil ? json(static_cast<int>(m_ceiling) - 1) : json(nullptr)},
+            {"pausedMicros", json(m_pausedUntil > now ? duration_cast<microseconds>(m_pausedUntil - now).count() : 0)},
+            {"baselineLatencyMicros", m_baseline == Clock::duration::max() ? json(nullptr) : json(duration_cast<microseconds>(m_baseline).count())},
+            {"bytesPerSecond", json(static_cast<uint64_t>(m_throughput))},
+            {"completed", json(m_completed)},
+            {"throttled", json(m_throttled)},
+            {"failed", json(m_failed)}
+        };
+    }
+
+    ConcurrencyController::ConcurrencyController(int limit)
+    : m_limit(std::max(1, limit))
+    , m_window(std::min(InitialWindow, std::max(1, limit)))
+    , m_slowStart(true)
+    , m_inFlight(0)
+    , m_pausedUntil()
+    , m_lastDecrease()
+    , m_ceiling(0.0)
+    , m_ceilingUntil()
+    , m_baseline(Clock::duration::max())
+    , m_periodMin(Clock::duration::max())
+    , m_periodSamples(0)
+    , m_throughput(0.0)
+    , m_periodBytes(0)
+    , m_periodStart(Clock::now())
+    , m_completed(0)
+    , m_throttled(0)
+    , m_failed(0)
+    { }
+}
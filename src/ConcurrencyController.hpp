@@ -0,0 +1,116 @@
+#pragma once
+
+#include "Util.hpp"
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+
+namespace HyperTiler {
+    // Decides how many requests to remote sources may be in flight at once, additive increase and
+    // multiplicative decrease like TCP congestion control. The window grows by about one request for
+    // every window's worth of responses, is halved when the server throttles or fails a request, and is
+    // cut by a fifth when the time to first byte rises well above the lowest seen recently, which means
+    // requests are queueing at the server. A Retry-After from the server pauses all new requests, and
+    // the window stays below the size that got throttled for a while so the pause isn't provoked again.
+    class ConcurrencyController {
+    public:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Outcome {
+            // HTTP response code, or 0 if no response was received
+            long Status = 0;
+
+            // time until the first byte of the response arrived
+            Clock::duration Latency = Clock::duration::zero();
+            uint64_t Bytes = 0;
+
+            // zero if the server didn't ask for a delay
+            Clock::duration RetryAfter = Clock::duration::zero();
+        };
+
+        // When the request was let through, passed back on release
+        typedef Clock::time_point Ticket;
+
+    private:
+        mutable std::mutex m_mut;
+        std::condition_variable m_changed;
+
+        int m_limit;
+        double m_window;
+        bool m_slowStart;
+        int m_inFlight;
+        Clock::time_point m_pausedUntil;
+        Clock::time_point m_lastDecrease;
+
+        // the window can't grow to this size until m_ceilingUntil, zero if there is no ceiling
+        double m_ceiling;
+        Clock::time_point m_ceilingUntil;
+
+        // lowest time to first byte, restarted every BaselineSamples responses so it follows the server
+        Clock::duration m_baseline;
+        Clock::duration m_periodMin;
+        int m_periodSamples;
+
+        // bytes per second, smoothed over periods of at least a second
+        double m_throughput;
+        uint64_t m_periodBytes;
+        Clock::time_point m_periodStart;
+
+        uint64_t m_completed;
+        uint64_t m_throttled;
+        uint64_t m_failed;
+
+        bool HasRoom(Clock::time_point now) const;
+
+        // Only responses to requests let through after the last decrease can decrease the window again,
+        // so one burst of errors from a full window only counts once. Returns true if it decreased
+        bool Decrease(double factor, Ticket ticket);
+    public:
+        static constexpr int InitialWindow = 4;
+        static constexpr double LatencyTolerance = 2.0;
+        static constexpr int BaselineSamples = 256;
+
+        // Longest pause honoured from a Retry-After, and the pause used when a throttling response has none
+        static constexpr std::chrono::seconds MaxPause = std::chrono::seconds(60);
+        static constexpr std::chrono::seconds DefaultPause = std::chrono::seconds(1);
+
+        // How long the window stays below a size that got throttled before probing past it again
+        static constexpr std::chrono::seconds CeilingLifetime = std::chrono::seconds(30);
+
+        // How often a throttled request is sent before giving up on it
+        static constexpr int MaxAttempts = 5;
+
+        // Responses that mean the server wants us to slow down, the request can be retried after the pause
+        static bool IsThrottled(long status) { return status == 429 || status == 503; }
+
+        // Counts the request as in flight and returns true if the window has room
+        bool TryAcquire(Ticket& ticket);
+
+        // Blocks until the window has room
+        // Returns false without acquiring if RunningFlag is cleared while waiting
+        bool Acquire(Ticket& ticket, std::atomic_bool const* RunningFlag = nullptr);
+
+        void Release(Ticket ticket, Outcome const& outcome);
+
+        // Releases a request that was cancelled before it completed, which says nothing about the server
+        void Abandon(Ticket ticket);
+
+        // The window never grows past the limit
+        void SetLimit(int limit);
+        int Limit() const;
+        int Window() const;
+        int InFlight() const;
+
+        // How long until new requests may start, zero if they may start now
+        Clock::duration PauseRemaining() const;
+
+        json Status() const;
+
+        ConcurrencyController(int limit);
+    private:
+        ConcurrencyController(ConcurrencyController const& other) = delete;
+        ConcurrencyController& operator=(ConcurrencyController const& other) = delete;
+    };
+}
@@ -1,6 +1,8 @@
 #include "Config.hpp"
 #include "jsonUtils.hpp"
 
+#include <bit>
+
 namespace HyperTiler {
     ConversionSpatialConfig::operator json() const {
         js::SaveContex ctx;
@@ -33,29 +35,114 @@ namespace HyperTiler {
         ctx.Destore(EndOutputLevel);
         if (!ctx.er.empty()) throw ctx.er;
     }
+    ConversionOptimizationConfig::operator json() const {
+        js::SaveContex ctx;
+        ctx.Store(cacheOnFilesystem);
+        ctx.Store(persistCache);
+        ctx.M_SaveNamed("cacheBaseDirectory", cacheBaseDirectory.string());
+        ctx.Store(maxCacheSize);
+        ctx.Store(missingTileLifetime);
+        ctx.Store(cacheResponses);
+        ctx.Store(maxResponseCacheSize);
+        ctx.Store(responseMaxAge);
+        ctx.Store(availableMemory);
+        ctx.Store(maxDownloads);
+        ctx.Store(connectTimeout);
+        ctx.Store(requestTimeout);
+        ctx.Store(lowSpeedLimit);
+        ctx.Store(lowSpeedTime);
+        ctx.Store(hedgeRequests);
+        ctx.Store(mapRawInputs);
+        ctx.Store(useIoUring);
+        ctx.Store(indexInputs);
+        ctx.Store(compressCache);
+        ctx.Store(pngCompressionLevel);
+        ctx.Store(pngCompressionStrategy);
+        ctx.Store(pngRowFilter);
+        ctx.Store(pngEncodeThreads);
+        ctx.Store(directOutput);
+        return ctx;
+    }
+    ConversionOptimizationConfig::ConversionOptimizationConfig(json const& j) {
+        js::ParseContext ctx = j;
+        ctx.DestoreOptional(cacheOnFilesystem);
+        ctx.DestoreOptional(persistCache);
+        string cacheDirectory = cacheBaseDirectory.string();
+        ctx.M_LoadNamedOptional("cacheBaseDirectory", cacheDirectory);
+        cacheBaseDirectory = cacheDirectory;
+        ctx.DestoreOptional(maxCacheSize);
+        ctx.DestoreOptional(missingTileLifetime);
+        ctx.DestoreOptional(cacheResponses);
+        ctx.DestoreOptional(maxResponseCacheSize);
+        ctx.DestoreOptional(responseMaxAge);
+        ctx.DestoreOptional(availableMemory);
+        ctx.DestoreOptional(maxDownloads);
+        ctx.DestoreOptional(connectTimeout);
+        ctx.DestoreOptional(requestTimeout);
+        ctx.DestoreOptional(lowSpeedLimit);
+        ctx.DestoreOptional(lowSpeedTime);
+        ctx.DestoreOptional(hedgeRequests);
+        ctx.DestoreOptional(mapRawInputs);
+        ctx.DestoreOptional(useIoUring);
+        ctx.DestoreOptional(indexInputs);
+        ctx.DestoreOptional(compressCache);
+        ctx.DestoreOptional(pngCompressionLevel);
+        ctx.DestoreOptional(pngCompressionStrategy);
+        ctx.DestoreOptional(pngRowFilter);
+        ctx.DestoreOptional(pngEncodeThreads);
+        ctx.DestoreOptional(directOutput);
+        if (!ctx.er.empty()) throw ctx.er;
+    }
+    PngWriteOptions ConversionOptimizationConfig::PngOptions() const {
+        PngWriteOptions res;
+        res.Level = pngCompressionLevel;
+        res.Strategy = pngCompressionStrategy;
+        res.Filter = pngRowFilter;
+        res.Threads = pngEncodeThreads;
+        return res;
+    }
+    HyperTiler::DatasetConfig Config::InputDataset() const {
+        HyperTiler::DatasetConfig res;
+        res.Format = DatasetConfig.InputURIFormat;
+        res.Mirror = DatasetConfig.InputMirrorURIFormat;
+        res.Channels = DatasetConfig.Channels;
+        res.Size = SpatialConfig.InputTileSize;
+        res.Encoding = DatasetConfig.InputEncoding;
+        return res;
+    }
     Config::operator json() const {
         js::SaveContex ctx;
         ctx.Store(DatasetConfig);
         ctx.Store(SpatialConfig);
+        ctx.Store(OptimizationConfig);
         return ctx;
     }
     Config::Config(json const& j) {
         js::ParseContext ctx = j;
         ctx.Destore(DatasetConfig);
         ctx.Destore(SpatialConfig);
+        ctx.DestoreOptional(OptimizationConfig);
         if (!ctx.er.empty()) throw ctx.er;
     }
     DatasetConfig::operator json() const {
         js::SaveContex ctx;
         ctx.Store(Channels);
         ctx.Store(Format);
+        if (!Mirror.empty()) ctx.Store(Mirror);
         ctx.Store(Size);
         ctx.Store(Encoding);
         return ctx;
     }
+    string DatasetConfig::CacheKey() const {
+        // The mirror serves the same tiles
+        HyperTiler::DatasetConfig keyed = *this;
+        keyed.Mirror.clear();
+        return HashToString(HashString(static_cast<json>(keyed).dump()));
+    }
     DatasetConfig::DatasetConfig()
     : Channels(1)
     , Format()
+    , Mirror()
     , Size()
     , Encoding()
     { }
@@ -63,6 +150,7 @@ namespace HyperTiler {
         js::ParseContext ctx = j;
         ctx.Destore(Channels);
         ctx.Destore(Format);
+        ctx.DestoreOptional(Mirror);
         ctx.Destore(Size);
         ctx.Destore(Encoding);
         if (!ctx.er.empty()) throw ctx.er;
@@ -71,23 +159,39 @@ namespace HyperTiler {
         js::SaveContex ctx;
         ctx.Store(InputURIFormat);
         ctx.Store(InputEncoding);
+        if (!InputMirrorURIFormat.empty()) ctx.Store(InputMirrorURIFormat);
         ctx.Store(OutputURIFormat);
         ctx.Store(OutputEncoding);
+        ctx.Store(RawOutput);
         return ctx;
     }
+    bool ConversionDatasetConfig::WritesRaw() const {
+        return RawOutput && OutputEncoding.Encoding == FormatEncoding::Raw;
+    }
     ConversionDatasetConfig::ConversionDatasetConfig()
         : InputURIFormat("{x6}_{y6}_{z6}.png")
         , OutputURIFormat("output/{x6}_{y6}_{z6}.png")
     {
+        OutputEncoding.Encoding = FormatEncoding::PNG;
     }
     ConversionDatasetConfig::ConversionDatasetConfig(json const& j) {
         js::ParseContext ctx = j;
         ctx.Destore(InputURIFormat);
         ctx.Destore(InputEncoding);
+        ctx.DestoreOptional(InputMirrorURIFormat);
         ctx.Destore(OutputURIFormat);
         ctx.Destore(OutputEncoding);
+        ctx.DestoreOptional(RawOutput);
         if (!ctx.er.empty()) throw ctx.er;
     }
+    PixelFormat ImageEncoding::DecodedFormat() const {
+        PixelFormat res;
+        res.BitDepth = BitDepth;
+        res.Gamma = Gamma;
+        if (Encoding == FormatEncoding::Raw) res.Swapped = SwapEndian;
+        else if (Encoding == FormatEncoding::PNG) res.Swapped = BitDepth > 8 && (std::endian::native == std::endian::little) != SwapEndian;
+        return res;
+    }
     ImageEncoding::operator json() const {
         js::SaveContex ctx;
         ctx.Store(BitDepth);
@@ -1,11 +1,17 @@
 #pragma once
 
 #include "Util.hpp"
+#include "ImageUtils.hpp"
+#include "PixelFormat.hpp"
 
 namespace HyperTiler {
     enum class FormatEncoding : int {
         Raw = 0,
-        PNG = 1
+        PNG = 1,
+
+        // Single channel 16 bit tiles written by WriteElevationTile, samples are stored the same on any machine
+        // so SwapEndian doesn't apply
+        Elevation = 2
     };
 
     struct ImageEncoding {
@@ -16,6 +22,10 @@ namespace HyperTiler {
 
         inline bool HasGammEncoding() const { return Gamma != 1.0; }
 
+        // Layout of samples as they are decoded, raw samples are as their file has them and PNG samples are
+        // swapped by libpng when SwapEndian is set, so they are only left swapped when it isn't
+        PixelFormat DecodedFormat() const;
+
         operator json() const;
         ImageEncoding() = default;
         ImageEncoding(json const& j);
@@ -23,10 +33,16 @@ namespace HyperTiler {
 
     struct DatasetConfig {
         URI Format;
+
+        // Format string of another source of the same tiles, empty if there is none
+        URI Mirror;
         int Channels;
         ivec2 Size;
         ImageEncoding Encoding;
 
+        // Identifies the decoded contents of this dataset, for naming cached tiles
+        string CacheKey() const;
+
         operator json() const;
         DatasetConfig();
         DatasetConfig(json const& j);
@@ -41,12 +57,26 @@ namespace HyperTiler {
         URI InputURIFormat;
         ImageEncoding InputEncoding;
 
+        /// <summary>
+        /// Optional format string for a mirror of the input tiles, slow requests are hedged to it
+        /// </summary>
+        URI InputMirrorURIFormat;
+
         /// <summary>
         /// Format string for output tiles
         /// </summary>
         URI OutputURIFormat;
         ImageEncoding OutputEncoding;
 
+        /// <summary>
+        /// Write output tiles with the Raw encoding as raw samples, otherwise they are written as PNG
+        /// Configs from before raw output was written have the Raw output encoding and meant PNG by it
+        /// </summary>
+        bool RawOutput = false;
+
+        // Whether output tiles are written as raw samples
+        bool WritesRaw() const;
+
         operator json() const;
         ConversionDatasetConfig();
         ConversionDatasetConfig(json const& j);
@@ -90,15 +120,6 @@ namespace HyperTiler {
         ConversionSpatialConfig(json const& j);
     };
 
-    struct Config {
-        ConversionDatasetConfig DatasetConfig;
-        ConversionSpatialConfig SpatialConfig;
-
-        operator json() const;
-        Config() = default;
-        Config(json const& j);
-    };
-
     struct ConversionOptimizationConfig {
         /// <summary>
         /// Store the input dataset on local filesystem
@@ -115,9 +136,138 @@ namespace HyperTiler {
         /// </summary>
         path cacheBaseDirectory = "./.HyperTilerCache/";
 
+        /// <summary>
+        /// Least recently used tiles are removed from the filesystem cache beyond this size
+        /// </summary>
+        uint64_t maxCacheSize = 16ull * 1024ull * 1024ull * 1024ull; // default of 16 gigs
+
+        /// <summary>
+        /// How long, in seconds, a tile missing from a remote source is remembered between runs
+        /// 0 only remembers it for the current run, negative values remember it forever
+        /// </summary>
+        int64_t missingTileLifetime = 7ll * 24ll * 60ll * 60ll; // default of a week
+
+        /// <summary>
+        /// Keep the bodies of responses from remote sources under the base directory, so later
+        /// runs only download tiles that changed
+        /// </summary>
+        bool cacheResponses = true;
+
+        /// <summary>
+        /// Least recently used responses are removed beyond this size
+        /// </summary>
+        uint64_t maxResponseCacheSize = 4ull * 1024ull * 1024ull * 1024ull; // default of 4 gigs
+
+        /// <summary>
+        /// How long, in seconds, a stored response is used without checking with the server
+        /// when the server doesn't say, 0 always checks
+        /// </summary>
+        int64_t responseMaxAge = 0;
+
         /// <summary>
         /// How much memory to use to store images during processing
+        /// Clamped to 3/4 of the memory available to the process, 0 uses half of it
         /// </summary>
         uint64_t availableMemory = 2ull * 1024ull * 1024ull * 1024ull; // default of 2 gigs
+
+        /// <summary>
+        /// The most requests to remote sources kept in flight at once, fewer are used while
+        /// the server is slow to respond or asks for requests to slow down
+        /// </summary>
+        int maxDownloads = 16;
+
+        /// <summary>
+        /// Give up connecting to a remote source after this many milliseconds, 0 for no limit
+        /// </summary>
+        int connectTimeout = 10000;
+
+        /// <summary>
+        /// Give up on a request to a remote source after this many milliseconds, 0 for no limit
+        /// </summary>
+        int requestTimeout = 60000;
+
+        /// <summary>
+        /// Abort requests to a remote source that transfer less than lowSpeedLimit bytes
+        /// per second for lowSpeedTime seconds
+        /// </summary>
+        int lowSpeedLimit = 1024;
+        int lowSpeedTime = 10;
+
+        /// <summary>
+        /// Send a second copy of requests that take longer than most, to the mirror if
+        /// the dataset has one, and use whichever answers first
+        /// </summary>
+        bool hedgeRequests = true;
+
+        /// <summary>
+        /// Sample raw 16 bit tiles on the local filesystem straight from the memory mapped
+        /// file instead of copying them into the cache
+        /// </summary>
+        bool mapRawInputs = true;
+
+        /// <summary>
+        /// Read and write batches of local files with io_uring where the system supports it,
+        /// otherwise they are read and written by a pool of threads
+        /// </summary>
+        bool useIoUring = true;
+
+        /// <summary>
+        /// Find which tiles of a local dataset exist by listing its directories once, instead
+        /// of looking for each tile on its own
+        /// </summary>
+        bool indexInputs = true;
+
+        /// <summary>
+        /// Store single channel 16 bit tiles in the filesystem cache with the elevation codec
+        /// Takes less space and fewer reads for a little more work on each spilled tile
+        /// </summary>
+        bool compressCache = false;
+
+        /// <summary>
+        /// zlib level of PNG output from 0 to 9, -1 for the zlib default
+        /// Lower levels encode faster and make larger tiles
+        /// </summary>
+        int pngCompressionLevel = -1;
+
+        /// <summary>
+        /// zlib strategy of PNG output, Auto leaves it to libpng
+        /// </summary>
+        PngStrategy pngCompressionStrategy = PngStrategy::Auto;
+
+        /// <summary>
+        /// Filter applied to every row of PNG output, Adaptive tries each one on each row
+        /// </summary>
+        PngFilter pngRowFilter = PngFilter::Adaptive;
+
+        /// <summary>
+        /// Threads deflating each large PNG tile, each one compresses a strip of rows
+        /// 0 uses one per core, 1 encodes every tile on one thread
+        /// </summary>
+        int pngEncodeThreads = 0;
+
+        /// <summary>
+        /// Write raw output tiles with O_DIRECT, past the page cache, where the filesystem allows it
+        /// Keeps large conversions from filling memory with output nobody reads back
+        /// </summary>
+        bool directOutput = false;
+
+        PngWriteOptions PngOptions() const;
+
+        operator json() const;
+        ConversionOptimizationConfig() = default;
+        ConversionOptimizationConfig(json const& j);
+    };
+
+    struct Config {
+        ConversionDatasetConfig DatasetConfig;
+        ConversionSpatialConfig SpatialConfig;
+        ConversionOptimizationConfig OptimizationConfig;
+
+        // Description of the input dataset
+        HyperTiler::DatasetConfig InputDataset() const;
+
+        operator json() const;
+        Config() = default;
+        Config(json const& j);
     };
 }
\ No newline at end of file
@@ -1,148 +1,553 @@
 #include "DatasetCache.hpp"
 
 #include "ImageUtils.hpp"
+#include "ElevationCodec.hpp"
+#include "FileBatcher.hpp"
+
+#include <iostream>
+#include <chrono>
 
 namespace HyperTiler {
-    size_t ImageMemoryAllocator::IndexOf(uint8_t const* loc) const {
-        htAssert(loc);
-        size_t diff = loc - m_data.data();
-        htAssert(diff % m_elementSize == 0);
-        diff /= m_elementSize;
-        htAssert(diff < m_data.size());
-        return diff;
-    }
-    uint8_t const* ImageMemoryAllocator::Begin() const {
-        return m_data.data();
-    }
-    uint64_t ImageMemoryAllocator::ElementSize() const {
-        return m_elementSize;
-    }
-    void ImageMemoryAllocator::SetAccessed(uint8_t* loc, int64_t time) {
-        htAssert(time >= 0);
-        m_lastUsed[IndexOf(loc)] = time;
-    }
-    uint8_t* ImageMemoryAllocator::Alloc(int64_t time, bool& evicted) {
-        htAssert(time >= 0);
-        int64_t lruValue = std::numeric_limits<int64_t>::max();
-        uint8_t* res = m_data.data();
-        size_t index = 0;
-        for (size_t i = 0; i < m_lastUsed.size(); ++i) {
-            int64_t lastUsed = m_lastUsed[i];
-            if (lastUsed < 0) {
-                evicted = false;
-                --m_remaining;
-                m_lastUsed[i] = time;
-                return &m_data[i * m_elementSize];
-            }
-            else if (lastUsed < lruValue) {
-                res = &m_data[i * m_elementSize];
-                index = i;
+    // Slabs are at least this big so small size classes don't need a mapping per slot
+    constexpr uint64_t MinSlabSize = 64ull * 1024ull * 1024ull;
+
+    uint64_t SlabAllocator::SizeClassOf(uint64_t size) {
+        const uint64_t pageSize = MemoryArena::PageSize();
+        const uint64_t pages = (std::max<uint64_t>(size, 1) + pageSize - 1) / pageSize * pageSize;
+        if (pages <= 4 * pageSize) return pages;
+
+        uint64_t powerOfTwo = pageSize;
+        while (powerOfTwo * 2 <= pages) powerOfTwo *= 2;
+
+        const uint64_t step = powerOfTwo / 4;
+        return (pages + step - 1) / step * step;
+    }
+    MemoryArena& SlabAllocator::SlabOf(SizeClass& sizeClass, uint8_t* loc) {
+        for (auto& slab : sizeClass.Slabs) {
+            if (loc >= slab->Data() && loc < slab->Data() + slab->Size()) return *slab;
+        }
+        throw std::runtime_error("Slot does not belong to its size class");
+    }
+    uint8_t* SlabAllocator::Alloc(uint64_t size, bool allowOverBudget) {
+        const uint64_t slotSize = SizeClassOf(size);
+        if (!allowOverBudget && !Fits(size)) return nullptr;
+
+        SizeClass& sizeClass = m_classes[slotSize];
+        if (sizeClass.SlotSize == 0) {
+            sizeClass.SlotSize = slotSize;
+            sizeClass.SlotsPerSlab = std::max<uint64_t>(1, MinSlabSize / slotSize);
+        }
+
+        if (sizeClass.Free.empty()) {
+            sizeClass.Slabs.push_back(std::make_unique<MemoryArena>(sizeClass.SlotsPerSlab * slotSize));
+            uint8_t* const slabBegin = sizeClass.Slabs.back()->Data();
+
+            // Hand out low slots first
+            for (uint64_t i = sizeClass.SlotsPerSlab; i > 0; --i) {
+                sizeClass.Free.push_back(slabBegin + (i - 1) * slotSize);
             }
         }
 
-        m_lastUsed[index] = time;
-        evicted = true;
+        uint8_t* const res = sizeClass.Free.back();
+        sizeClass.Free.pop_back();
+        SlabOf(sizeClass, res).Commit(res, slotSize);
+        m_used += slotSize;
         return res;
     }
-    void ImageMemoryAllocator::Free(uint8_t* loc) {
-        //std::lock_guard<std::mutex> locK(m_mut);
-        size_t index = IndexOf(loc);
-        htAssert(m_lastUsed[index] >= 0);
-        m_lastUsed[index] = -1;
-        ++m_remaining;
+    void SlabAllocator::Free(uint8_t* loc, uint64_t size) {
+        const uint64_t slotSize = SizeClassOf(size);
+        auto found = m_classes.find(slotSize);
+        htAssert(found != m_classes.end());
+        htAssert(m_used >= slotSize);
+
+        SlabOf(found->second, loc).Decommit(loc, slotSize);
+        found->second.Free.push_back(loc);
+        m_used -= slotSize;
+    }
+    bool SlabAllocator::Fits(uint64_t size) const {
+        return m_used == 0 || m_used + SizeClassOf(size) <= m_budget;
+    }
+    uint64_t SlabAllocator::Used() const {
+        return m_used;
+    }
+    uint64_t SlabAllocator::Budget() const {
+        return m_budget;
+    }
+    void SlabAllocator::SetBudget(uint64_t budget) {
+        m_budget = budget;
+    }
+    SlabAllocator::SlabAllocator(uint64_t budget)
+    : m_budget(budget)
+    , m_used(0)
+    { }
+
+    static int64_t SecondsSinceEpoch() {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    bool DatasetCache::Compresses(Dataset const& dataset) const {
+        return m_compressTiles && dataset.Config.Channels == 1 && dataset.Config.Encoding.BitDepth == 16;
+    }
+    uint8_t const* DatasetCache::ForFilesystem(Dataset const& dataset, uint8_t const* data, vector<uint8_t>& encoded, uint64_t& size) const {
+        size = dataset.ElementSize;
+        if (!Compresses(dataset)) return data;
+
+        // Stored uncompressed otherwise, so the size of a file tells an uncompressed tile apart
+        WriteElevationTile(encoded, reinterpret_cast<uint16_t const*>(data), dataset.Config.Size.x, dataset.Config.Size.y);
+        if (encoded.size() >= dataset.ElementSize) return data;
+
+        size = encoded.size();
+        return encoded.data();
+    }
+    bool DatasetCache::StoredInFilesystem(path const& name, Dataset const& dataset) const {
+        if (!FileExists(name)) return false;
+
+        // Files are removed when their source changes, so a compressed tile is only checked as it's read
+        const uint64_t size = FileSize(name);
+        return size == dataset.ElementSize || (Compresses(dataset) && size < dataset.ElementSize);
+    }
+    uint64_t DatasetCache::StoreInFilesystem(path const& name, Dataset const& dataset, uint8_t const* data) const {
+        if (StoredInFilesystem(name, dataset)) return FileSize(name);
+        if (FileExists(name)) RemoveFile(name);
+
+        vector<uint8_t> encoded;
+        uint64_t size;
+        uint8_t const* const stored = ForFilesystem(dataset, data, encoded, size);
+        WriteEntireFileBinary(name, stored, size);
+        return size;
+    }
+    bool DatasetCache::LoadFromFilesystem(path const& name, Dataset const& dataset, uint8_t* data) const {
+        if (!FileExists(name)) return false;
+
+        const uint64_t size = FileSize(name);
+        if (size == dataset.ElementSize) {
+            ReadEntireFileBinary(name, data, size);
+            return true;
+        }
+
+        if (dataset.Config.Channels != 1 || dataset.Config.Encoding.BitDepth != 16 || size > dataset.ElementSize) return false;
+        vector<uint8_t> const encoded = ReadEntireFileBinary(name);
+        return ReadElevationTileInto(encoded.data(), encoded.size(), reinterpret_cast<uint16_t*>(data), dataset.Config.Size.x, dataset.Config.Size.y);
+    }
+    path DatasetCache::DatasetDirectory(Dataset const& dataset) const {
+        return m_cacheBaseDirectory / dataset.Key;
+    }
+    path DatasetCache::PathFromKey(string const& key) const {
+        return m_cacheBaseDirectory / (key + ".tile");
     }
-    uint64_t ImageMemoryAllocator::SlotsRemaining() const {
-        return m_remaining;
+    string DatasetCache::IndexKey(Dataset const& dataset, ivec3 const& coord) {
+        return dataset.Key + "/" + TileName(coord);
     }
-    ImageMemoryAllocator::ImageMemoryAllocator(uint32_t elementSize, int maxElements) {
-        m_elementSize = elementSize;
-        m_data.resize(m_elementSize * maxElements, 0);
-        m_lastUsed.resize(maxElements, -1);
-        m_remaining = maxElements;
+    path DatasetCache::IndexPath() const {
+        return m_cacheBaseDirectory / "index.json";
     }
+    void DatasetCache::LoadIndex() {
+        if (m_indexLoaded) return;
+        m_indexLoaded = true;
 
-    set<pair<string, uint8_t*>>::iterator DatasetCache::FindInMemoryByName(string const& name) const {
-        for (auto it = m_inMemory.begin(); it != m_inMemory.end(); ++it) {
-            if (it->first == name) return it;
+        // Without persistence the index only tracks tiles spilled during this run
+        if (!m_persist || !FileExists(IndexPath())) return;
+
+        json j;
+        try {
+            j = json::parse(ReadEntireFileText(IndexPath()));
+            for (auto const& [key, value] : j.at("Entries").items()) {
+                IndexEntry entry;
+                entry.Stamp.Size = value.at("SourceSize").get<uint64_t>();
+                entry.Stamp.ModifiedTime = value.at("SourceModifiedTime").get<int64_t>();
+                entry.Stamp.ETag = value.at("ETag").get<string>();
+                entry.Size = value.at("Size").get<uint64_t>();
+                entry.LastUsed = value.at("LastUsed").get<int64_t>();
+                entry.Missing = value.value("Missing", false);
+                m_index[key] = entry;
+            }
+        } catch (json::exception const& ex) {
+            std::cout << "Cache index is unreadable, starting with an empty cache: " << ex.what() << "\n";
+            m_index.clear();
         }
-        return m_inMemory.end();
     }
-    set<pair<string, uint8_t*>>::iterator DatasetCache::FindInMemoryByPointer(uint8_t* const ptr) {
-        for (auto it = m_inMemory.begin(); it != m_inMemory.end(); ++it) {
-            if (it->second == ptr) return it;
+    void DatasetCache::SaveIndex() const {
+        json entries = json::object();
+        for (auto const& [key, entry] : m_index) {
+            if (entry.Missing) {
+                // Entries of datasets that weren't used this run are kept as they were loaded
+                const auto dataset = m_datasets.find(key.substr(0, key.find('/')));
+                if (dataset != m_datasets.end() && !IsMissingEntryCurrent(entry, dataset->second.MissingLifetime)) continue;
+                entries[key] = {
+                    {"SourceSize", 0},
+                    {"SourceModifiedTime", -1},
+                    {"ETag", ""},
+                    {"Size", 0},
+                    {"LastUsed", entry.LastUsed},
+                    {"Missing", true}
+                };
+                continue;
+            }
+            entries[key] = {
+                {"SourceSize", entry.Stamp.Size},
+                {"SourceModifiedTime", entry.Stamp.ModifiedTime},
+                {"ETag", entry.Stamp.ETag},
+                {"Size", entry.Size},
+                {"LastUsed", entry.LastUsed}
+            };
         }
-        return m_inMemory.end();
+        // Renamed over the old index, so a process killed while saving leaves that one
+        path const temp = path(IndexPath()).concat(".tmp");
+        WriteEntireFileText(temp, json{ {"Entries", entries} }.dump());
+        std::error_code ec;
+        std::filesystem::rename(temp, IndexPath(), ec);
+        if (ec) std::cout << "Failed to save the cache index: " << ec.message() << "\n";
+    }
+    bool DatasetCache::IsMissingEntryCurrent(IndexEntry const& entry, int64_t lifetime) const {
+        if (lifetime == 0) return false;
+        if (lifetime < 0) return true;
+        return SecondsSinceEpoch() - entry.LastUsed <= lifetime;
     }
-    void DatasetCache::StoreInFilesystem(path const& name, uint8_t const* data) const {
-        if (FileExists(name)) {
-            if (FileSize(name) == m_memoryCache.ElementSize()) return;
-            else RemoveFile(name);
+    void DatasetCache::CollectGarbage() {
+        uint64_t totalSize = 0;
+        vector<pair<int64_t, string>> byAge;
+        for (auto const& [key, entry] : m_index) {
+            if (entry.Missing) continue;
+            totalSize += entry.Size;
+            byAge.emplace_back(entry.LastUsed, key);
+        }
+        if (totalSize <= m_maxFilesystemSize) return;
+
+        std::sort(byAge.begin(), byAge.end());
+        for (auto const& [lastUsed, key] : byAge) {
+            if (totalSize <= m_maxFilesystemSize) break;
+            if (m_inMemory.find(key) != m_inMemory.end()) continue;
+            totalSize -= m_index[key].Size;
+            std::error_code ec;
+            std::filesystem::remove(PathFromKey(key), ec);
+            m_index.erase(key);
         }
-        WriteEntireFileBinary(name, data, m_memoryCache.ElementSize());
     }
-    bool DatasetCache::LoadFromFilesystem(path const& name, uint8_t* data) const {
-        if (!FileExists(name)) return false;
-        if (FileSize(name) != m_memoryCache.ElementSize()) return false;
-        ReadEntireFileBinary(name, data, static_cast<uint64_t>(m_memoryCache.ElementSize()));
+    bool DatasetCache::EvictOne() {
+        auto victim = m_lru.rbegin();
+        while (victim != m_lru.rend() && m_inMemory.at(*victim).Pins > 0) ++victim;
+        if (victim == m_lru.rend()) return false;
+
+        string const key = *victim;
+        MemoryEntry const& entry = m_inMemory.at(key);
+
+        if (m_cacheOnFilesystem) {
+            const uint64_t stored = StoreInFilesystem(PathFromKey(key), *entry.Owner, entry.Data);
+            auto const indexed = m_index.find(key);
+            if (indexed != m_index.end()) indexed->second.Size = stored;
+        } else {
+            m_index.erase(key);
+        }
+
+        FreeSlot(key);
         return true;
     }
-    path DatasetCache::PathFromName(string const& name) const {
-        return m_cacheBaseDirectory / name;
+    uint8_t* DatasetCache::AllocSlot(Dataset const& dataset, string const& key) {
+        htAssert(m_inMemory.find(key) == m_inMemory.end());
+
+        while (!m_memoryCache.Fits(dataset.ElementSize) && EvictOne()) { }
+
+        uint8_t* const res = m_memoryCache.Alloc(dataset.ElementSize, true);
+
+        m_lru.push_front(key);
+        m_inMemory[key] = MemoryEntry{ res, &dataset, m_lru.begin() };
+
+        return res;
     }
-    bool DatasetCache::IsInCache(string const& name) const {
-        return FindInMemoryByName(name) != m_inMemory.end();
+    void DatasetCache::FreeSlot(string const& key) {
+        const auto found = m_inMemory.find(key);
+        htAssert(found != m_inMemory.end());
+
+        m_memoryCache.Free(found->second.Data, found->second.Owner->ElementSize);
+        m_lru.erase(found->second.LruPosition);
+        m_inMemory.erase(found);
     }
-    DatasetCache::CacheResult DatasetCache::operator[](string const& name) {
-        const auto it = FindInMemoryByName(name);
-        if (it != m_inMemory.end()) {
-            m_memoryCache.SetAccessed(it->second, ++m_currentTime);
-            return { true, it->second };
-        } else {
-            path const cachedPath = PathFromName(name);
+    string DatasetCache::TileName(ivec3 const& coord) {
+        return std::to_string(coord.x) + "_" + std::to_string(coord.y) + "_" + std::to_string(coord.z);
+    }
+    DatasetCache::Dataset const& DatasetCache::AddDataset(DatasetConfig const& dataset, uint64_t elementSize) {
+        string const key = dataset.CacheKey();
 
-            bool evicted;
-            uint8_t* const res = m_memoryCache.Alloc(++m_currentTime, evicted);
+        const auto existing = m_datasets.find(key);
+        if (existing != m_datasets.end()) {
+            htAssert(existing->second.ElementSize == elementSize);
+            return existing->second;
+        }
 
-            if (evicted) {
-                auto found = FindInMemoryByPointer(res);
+        // Parsed first, a bad format string throws before the dataset is added
+        TileFormat format(dataset.Format);
+        TileFormat mirror = dataset.Mirror.empty() ? TileFormat() : TileFormat(dataset.Mirror);
 
-                htAssert(found != m_inMemory.end());
+        const PixelFormat decoded = dataset.Encoding.DecodedFormat();
+        PixelFormat cached;
+        cached.BitDepth = decoded.BitDepth;
+        cached.Swapped = dataset.Encoding.Encoding == FormatEncoding::PNG && decoded.Swapped;
+        PixelConverter converter(decoded, cached);
 
-                path const evictedPath = PathFromName(found->first);
+        Dataset& res = m_datasets[key];
+        res.Key = key;
+        res.Config = dataset;
+        res.ElementSize = elementSize;
+        res.Format = std::move(format);
+        res.Mirror = std::move(mirror);
+        res.Converter = std::move(converter);
+        Prepare(res);
 
-                StoreInFilesystem(evictedPath, res);
+        return res;
+    }
+    void DatasetCache::Prepare(Dataset& dataset) const {
+        // Checking a local file is as cheap as checking the index, so those are only remembered for this run
+        dataset.MissingLifetime = dataset.Config.Format.IsNetworkResource() ? m_remoteMissingLifetime : 0;
 
-                m_inMemory.erase(found);
+        if (m_cacheOnFilesystem) {
+            if (!m_persist) {
+                std::filesystem::remove_all(DatasetDirectory(dataset));
             }
+            std::filesystem::create_directories(DatasetDirectory(dataset));
+        }
+    }
+    bool DatasetCache::NeedsCheck(Dataset const& dataset, ivec3 const& coord, ResourceStamp& stamp) {
+        LoadIndex();
 
-            bool present = LoadFromFilesystem(cachedPath, res);
+        const auto entry = m_index.find(IndexKey(dataset, coord));
+        if (entry == m_index.end() || entry->second.Missing || entry->second.Verified || entry->second.Stale) return false;
 
-            htAssert(FindInMemoryByName(name) == m_inMemory.end());
-            htAssert(FindInMemoryByPointer(res) == m_inMemory.end());
+        const auto it = m_inMemory.find(entry->first);
+        if (it != m_inMemory.end() && it->second.Reserved) return false;
 
-            m_inMemory.insert(pair<string, uint8_t*>(name, res));
+        stamp = entry->second.Stamp;
+        return true;
+    }
+    void DatasetCache::Check(Dataset const& dataset, ivec3 const& coord, ResourceStamp const& stamp, bool current) {
+        const auto entry = m_index.find(IndexKey(dataset, coord));
+        if (entry == m_index.end() || entry->second.Missing || entry->second.Verified || entry->second.Stale) return;
 
-            return { present, res };
+        ResourceStamp const& stored = entry->second.Stamp;
+        if (stored.Size != stamp.Size || stored.ModifiedTime != stamp.ModifiedTime || stored.ETag != stamp.ETag) return;
+
+        if (current) {
+            entry->second.Verified = true;
+            return;
+        }
+
+        // A tile that is still in use can't be replaced, Find drops it once it is released
+        const auto it = m_inMemory.find(entry->first);
+        if (it != m_inMemory.end() && it->second.Pins > 0) {
+            entry->second.Stale = true;
+            return;
+        }
+
+        if (it != m_inMemory.end()) FreeSlot(entry->first);
+        std::error_code ec;
+        std::filesystem::remove(PathFromKey(entry->first), ec);
+        m_index.erase(entry);
+    }
+    uint8_t* DatasetCache::Find(Dataset const& dataset, ivec3 const& coord) {
+        string const key = IndexKey(dataset, coord);
+
+        LoadIndex();
+
+        const auto entry = m_index.find(key);
+        if (entry == m_index.end() || entry->second.Missing) return nullptr;
+
+        const auto it = m_inMemory.find(key);
+        if (it != m_inMemory.end() && it->second.Reserved) return nullptr;
+
+        if (entry->second.Stale) {
+            if (it != m_inMemory.end() && it->second.Pins > 0) return it->second.Data;
+
+            if (it != m_inMemory.end()) FreeSlot(key);
+            std::error_code ec;
+            std::filesystem::remove(PathFromKey(key), ec);
+            m_index.erase(entry);
+            return nullptr;
+        }
+        if (!entry->second.Verified) return nullptr;
+
+        if (it != m_inMemory.end()) {
+            m_lru.splice(m_lru.begin(), m_lru, it->second.LruPosition);
+            return it->second.Data;
+        }
+
+        if (!m_cacheOnFilesystem) return nullptr;
+
+        uint8_t* const res = AllocSlot(dataset, key);
+
+        if (!LoadFromFilesystem(PathFromKey(key), dataset, res)) {
+            FreeSlot(key);
+            m_index.erase(key);
+            return nullptr;
         }
+
+        // Eviction only removes entries when not caching on the filesystem, so this is still valid
+        entry->second.LastUsed = SecondsSinceEpoch();
+
+        return res;
+    }
+    ResourceStamp DatasetCache::StampOf(Dataset const& dataset, ivec3 const& coord) const {
+        const auto entry = m_index.find(IndexKey(dataset, coord));
+        if (entry == m_index.end() || entry->second.Missing) return ResourceStamp();
+        return entry->second.Stamp;
+    }
+
+    uint8_t* DatasetCache::Reserve(Dataset const& dataset, ivec3 const& coord) {
+        string const key = IndexKey(dataset, coord);
+
+        uint8_t* const res = AllocSlot(dataset, key);
+
+        MemoryEntry& entry = m_inMemory.at(key);
+        entry.Pins = 1;
+        entry.Reserved = true;
+        return res;
     }
-    DatasetCache::DatasetCache(path cacheBaseDirectory, uint32_t elementSize, int maxElements, bool persist)
-    : m_cacheBaseDirectory(cacheBaseDirectory)
-    , m_memoryCache(elementSize, maxElements)
-    , m_persist(persist)
-    , m_currentTime(0)
-    {
-        if (!persist) {
-            std::filesystem::remove_all(m_cacheBaseDirectory);
+    void DatasetCache::Commit(Dataset const& dataset, ivec3 const& coord, ResourceStamp const& stamp) {
+        string const key = IndexKey(dataset, coord);
+
+        LoadIndex();
+
+        // Whatever was stored under this name came from a different version of the source
+        if (m_cacheOnFilesystem) {
+            std::error_code ec;
+            std::filesystem::remove(PathFromKey(key), ec);
         }
-        std::filesystem::create_directory(m_cacheBaseDirectory);
+
+        // The index also holds the stamps of tiles that are only in memory, so they can be revalidated
+        IndexEntry& entry = m_index[key];
+        entry.Missing = false;
+        entry.Stamp = stamp;
+        entry.Size = dataset.ElementSize;
+        entry.LastUsed = SecondsSinceEpoch();
+        entry.Verified = true;
+
+        MemoryEntry& slot = m_inMemory.at(key);
+        htAssert(slot.Reserved);
+        slot.Reserved = false;
+        --slot.Pins;
+        m_lru.splice(m_lru.begin(), m_lru, slot.LruPosition);
+    }
+    void DatasetCache::Discard(Dataset const& dataset, ivec3 const& coord) {
+        string const key = IndexKey(dataset, coord);
+        htAssert(m_inMemory.at(key).Reserved);
+        FreeSlot(key);
     }
+    bool DatasetCache::IsKnownMissing(Dataset const& dataset, ivec3 const& coord) {
+        LoadIndex();
+
+        const auto entry = m_index.find(IndexKey(dataset, coord));
+        if (entry == m_index.end() || !entry->second.Missing) return false;
+        if (entry->second.Verified) return true;
+
+        if (!IsMissingEntryCurrent(entry->second, dataset.MissingLifetime)) {
+            m_index.erase(entry);
+            return false;
+        }
+
+        entry->second.Verified = true;
+        return true;
+    }
+    void DatasetCache::MarkMissing(Dataset const& dataset, ivec3 const& coord) {
+        LoadIndex();
+
+        IndexEntry& entry = m_index[IndexKey(dataset, coord)];
+        entry = IndexEntry();
+        entry.Missing = true;
+        entry.LastUsed = SecondsSinceEpoch();
+        entry.Verified = true;
+    }
+    void DatasetCache::Pin(Dataset const& dataset, ivec3 const& coord) {
+        ++m_inMemory.at(IndexKey(dataset, coord)).Pins;
+    }
+    void DatasetCache::Unpin(Dataset const& dataset, ivec3 const& coord) {
+        MemoryEntry& entry = m_inMemory.at(IndexKey(dataset, coord));
+        htAssert(entry.Pins > 0);
+        --entry.Pins;
+    }
+    void DatasetCache::Revalidate() {
+        for (auto& [key, entry] : m_index) entry.Verified = false;
+    }
+    uint64_t DatasetCache::MemoryUsed() const {
+        return m_memoryCache.Used();
+    }
+    uint64_t DatasetCache::MemoryBudget() const {
+        return m_memoryCache.Budget();
+    }
+    void DatasetCache::SetMemoryBudget(uint64_t budget) {
+        m_memoryCache.SetBudget(budget);
+        while (m_memoryCache.Used() > budget && EvictOne()) { }
+    }
+    DatasetCache::DatasetCache(ConversionOptimizationConfig const& conf, uint64_t memoryBudget)
+    : m_cacheBaseDirectory(conf.cacheBaseDirectory)
+    , m_cacheOnFilesystem(conf.cacheOnFilesystem)
+    , m_persist(conf.cacheOnFilesystem && conf.persistCache)
+    , m_maxFilesystemSize(conf.maxCacheSize)
+    , m_remoteMissingLifetime(conf.missingTileLifetime)
+    , m_compressTiles(conf.compressCache)
+    , m_memoryCache(memoryBudget)
+    , m_indexLoaded(false)
+    { }
+    void DatasetCache::Flush() {
+        if (!m_cacheOnFilesystem) return;
+
+        LoadIndex();
+        CollectGarbage();
+        if (m_persist) SaveIndex();
+    }
+
+    void DatasetCache::Reconfigure(ConversionOptimizationConfig const& conf, uint64_t memoryBudget) {
+        Close();
+
+        while (!m_inMemory.empty()) {
+            htAssert(m_inMemory.begin()->second.Pins == 0);
+            FreeSlot(m_inMemory.begin()->first);
+        }
+        m_index.clear();
+        m_indexLoaded = false;
+
+        m_cacheBaseDirectory = conf.cacheBaseDirectory;
+        m_cacheOnFilesystem = conf.cacheOnFilesystem;
+        m_persist = conf.cacheOnFilesystem && conf.persistCache;
+        m_maxFilesystemSize = conf.maxCacheSize;
+        m_remoteMissingLifetime = conf.missingTileLifetime;
+        m_compressTiles = conf.compressCache;
+        m_memoryCache.SetBudget(memoryBudget);
+
+        for (auto& [key, dataset] : m_datasets) Prepare(dataset);
+    }
+
     DatasetCache::~DatasetCache() {
+        Close();
+    }
+
+    void DatasetCache::Close() {
+        if (!m_cacheOnFilesystem) return;
+
         if (m_persist) {
-            for (auto kvp : m_inMemory) {
-                StoreInFilesystem(kvp.first, kvp.second);
+            LoadIndex();
+
+            // Written in one batch, tiles stored by an earlier eviction are skipped like StoreInFilesystem does
+            vector<FileWrite> writes;
+            std::list<vector<uint8_t>> encoded;
+            for (auto const& [key, entry] : m_inMemory) {
+                if (entry.Reserved) continue;
+
+                path const name = PathFromKey(key);
+                if (StoredInFilesystem(name, *entry.Owner)) continue;
+
+                encoded.emplace_back();
+                uint64_t size;
+                uint8_t const* const stored = ForFilesystem(*entry.Owner, entry.Data, encoded.back(), size);
+                writes.push_back(FileWrite{ name, stored, size });
+
+                auto const indexed = m_index.find(key);
+                if (indexed != m_index.end()) indexed->second.Size = size;
             }
+            LocalFiles().Write(writes);
+            CollectGarbage();
+            SaveIndex();
         } else {
-            std::filesystem::remove_all(m_cacheBaseDirectory);
+            for (auto const& [key, dataset] : m_datasets) {
+                std::filesystem::remove_all(DatasetDirectory(dataset));
+            }
         }
     }
-}
\ No newline at end of file
+}
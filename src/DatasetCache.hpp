@@ -1,55 +1,233 @@
 #pragma once
 
 #include "TileUtils.hpp"
+#include "MemoryArena.hpp"
+
+#include <list>
+#include <memory>
 
 namespace HyperTiler {
-    class ImageMemoryAllocator {
-        uint64_t m_elementSize;
-        vector<uint8_t> m_data;
-        vector<int64_t> m_lastUsed;
-        uint64_t m_remaining;
+    // Hands out slots of any size within one memory budget. Requests are rounded up to a size class,
+    // and each class carves its slots out of its own slabs of address space. Freed slots give their
+    // memory back to the OS, so the budget is shared between classes rather than split up front.
+    class SlabAllocator {
+        struct SizeClass {
+            uint64_t SlotSize = 0;
+
+            // slabs are reserved as they are needed and never shrink, only their pages are released
+            uint64_t SlotsPerSlab = 0;
+            vector<std::unique_ptr<MemoryArena>> Slabs;
+            vector<uint8_t*> Free;
+        };
+
+        uint64_t m_budget;
+        uint64_t m_used;
+        map<uint64_t, SizeClass> m_classes;
+
+        static MemoryArena& SlabOf(SizeClass& sizeClass, uint8_t* loc);
 
-        size_t IndexOf(uint8_t const* loc) const;
     public:
-        const uint8_t* Begin() const;
-        uint64_t ElementSize() const;
-        void SetAccessed(uint8_t* loc, int64_t time);
-        uint8_t* Alloc(int64_t time, bool& evicted);
-        void Free(uint8_t* loc);
-        uint64_t SlotsRemaining() const;
-        ImageMemoryAllocator(uint32_t elementSize, int maxElements);
+        // Rounds up to pages, then to one of four steps between powers of two
+        static uint64_t SizeClassOf(uint64_t size);
+
+        // returns nullptr if the slot doesn't fit in what is left of the budget, unless allowOverBudget is set
+        // A slot larger than the whole budget is let through when nothing else is allocated
+        uint8_t* Alloc(uint64_t size, bool allowOverBudget = false);
+        void Free(uint8_t* loc, uint64_t size);
+
+        bool Fits(uint64_t size) const;
+        uint64_t Used() const;
+        uint64_t Budget() const;
+        void SetBudget(uint64_t budget);
+
+        SlabAllocator(uint64_t budget);
+    private:
+        SlabAllocator(SlabAllocator const& other) = delete;
+        SlabAllocator& operator=(SlabAllocator const& other) = delete;
     };
 
+    // Decoded tiles of any number of datasets, held in memory within one budget and spilled to the
+    // filesystem when evicted. When persisting, spilled tiles are recorded in an index shared by all
+    // datasets under the base directory, along with the stamp of the source they were decoded from,
+    // so later runs can skip downloading and decoding tiles whose source hasn't changed.
+    // Tiles found to be missing from the source are recorded too, so they are only probed once.
+    // Not thread safe, see TileService for sharing it.
     class DatasetCache {
-        const path m_cacheBaseDirectory;
-        ImageMemoryAllocator m_memoryCache;
-        set<pair<string, uint8_t*>> m_inMemory;
-        const bool m_persist;
-        uint64_t m_currentTime;
+    public:
+        // Settings of a dataset stored in the cache, obtained from AddDataset
+        struct Dataset {
+            string Key;
+            DatasetConfig Config;
+            uint64_t ElementSize = 0;
 
-        set<pair<string, uint8_t*>>::iterator FindInMemoryByName(string const& name) const;
-        set<pair<string, uint8_t*>>::iterator FindInMemoryByPointer(uint8_t*const ptr);
+            // Config.Format and Config.Mirror parsed once, Mirror is empty if there is none
+            TileFormat Format;
+            TileFormat Mirror;
 
-        // stores the image in the filesystem uncompressed if it doesn't already exist
-        // destroys existing file if the size of the file does not match the expected size
-        void StoreInFilesystem(path const& name, uint8_t const* data) const;
+            // Missing tiles from previous runs are only trusted for remote sources within this many seconds
+            int64_t MissingLifetime = 0;
 
-        // returns true if the file is present valid and readable
-        // returns false if it isn't
-        bool LoadFromFilesystem(path const& name, uint8_t* data) const;
+            // Run over samples as they are decoded into the cache, they are made linear and put in the byte order
+            // of this machine, except PNG samples that SwapEndian leaves swapped
+            PixelConverter Converter;
+        };
 
-        path PathFromName(string const& name) const;
+    private:
+        struct IndexEntry {
+            ResourceStamp Stamp;
+            uint64_t Size = 0;
 
-    public:
-        struct CacheResult {
-            bool IsValid;
+            // seconds since epoch, for missing tiles this is when the source was probed
+            int64_t LastUsed = 0;
+
+            // the source doesn't have this tile
+            bool Missing = false;
+
+            // already validated against the source since the last call to Revalidate
+            bool Verified = false;
+
+            // found out of date while pinned, dropped by Find once nothing uses it
+            bool Stale = false;
+        };
+
+        struct MemoryEntry {
             uint8_t* Data;
+            Dataset const* Owner;
+            std::list<string>::iterator LruPosition;
+
+            // pinned tiles are never evicted
+            int Pins = 0;
+
+            // being filled in by a fetch, Find doesn't see it and it is never stored
+            bool Reserved = false;
         };
 
-        bool IsInCache(string const& name) const;
+        path m_cacheBaseDirectory;
+        bool m_cacheOnFilesystem;
+        bool m_persist;
+        uint64_t m_maxFilesystemSize;
+        int64_t m_remoteMissingLifetime;
+        bool m_compressTiles;
+        SlabAllocator m_memoryCache;
+
+        // registered datasets, keyed by their cache key
+        map<string, Dataset> m_datasets;
+        // tiles in memory, keyed by their index key
+        map<string, MemoryEntry> m_inMemory;
+
+        // most recently used at the front
+        std::list<string> m_lru;
+
+        map<string, IndexEntry> m_index;
+        bool m_indexLoaded;
+
+        // Whether tiles of the dataset are stored with the elevation codec, only single channel 16 bit tiles are
+        bool Compresses(Dataset const& dataset) const;
+
+        // The bytes a tile is stored as, either the tile itself or encoded, which is only used if it's smaller
+        uint8_t const* ForFilesystem(Dataset const& dataset, uint8_t const* data, vector<uint8_t>& encoded, uint64_t& size) const;
+
+        // whether the file holds a tile of the dataset, uncompressed or encoded
+        bool StoredInFilesystem(path const& name, Dataset const& dataset) const;
+
+        // stores the image in the filesystem if it doesn't already exist, compressed if the dataset is
+        // destroys existing file if it can't hold a tile of the dataset
+        // returns the size of the file
+        uint64_t StoreInFilesystem(path const& name, Dataset const& dataset, uint8_t const* data) const;
+
+        // returns true if the file is present valid and readable, tiles encoded by an earlier run are read
+        // even if the cache doesn't compress now
+        // returns false if it isn't
+        bool LoadFromFilesystem(path const& name, Dataset const& dataset, uint8_t* data) const;
+
+        // Sets up the directory of a dataset and how long its missing tiles are trusted, under the current settings
+        void Prepare(Dataset& dataset) const;
+
+        // Stores the tiles in memory and saves the index if persisting, otherwise removes what was stored
+        // Tiles stay in memory
+        void Close();
+
+        path DatasetDirectory(Dataset const& dataset) const;
+        path PathFromKey(string const& key) const;
+        path IndexPath() const;
+
+        void LoadIndex();
+        void SaveIndex() const;
+
+        bool IsMissingEntryCurrent(IndexEntry const& entry, int64_t lifetime) const;
+
+        // removes least recently used tiles until the filesystem cache fits in its size limit
+        // Tiles in memory are kept, their entries are how Find returns them
+        void CollectGarbage();
+
+        // spills the least recently used tile that isn't pinned and frees its memory
+        // returns false if every tile in memory is pinned
+        bool EvictOne();
+
+        // takes memory for the tile, evicting tiles of any dataset until it fits
+        // goes over budget rather than failing if the remaining tiles are pinned
+        uint8_t* AllocSlot(Dataset const& dataset, string const& key);
+        void FreeSlot(string const& key);
+
+    public:
+        static string TileName(ivec3 const& coord);
+        static string IndexKey(Dataset const& dataset, ivec3 const& coord);
+
+        // Registers a dataset, or returns the existing registration if it was already added
+        Dataset const& AddDataset(DatasetConfig const& dataset, uint64_t elementSize);
+
+        // returns true if the tile is cached but hasn't been checked against its source since the last call to
+        // Revalidate, stamp receives the stamp it was decoded from
+        // The caller checks it without holding its lock, then passes the verdict to Check
+        bool NeedsCheck(Dataset const& dataset, ivec3 const& coord, ResourceStamp& stamp);
+
+        // records whether the source still has the stamp a tile was decoded from, ignored if the tile was
+        // replaced or checked by someone else since NeedsCheck returned that stamp
+        // An out of date tile is dropped, unless it is pinned since it can't be replaced while in use
+        void Check(Dataset const& dataset, ivec3 const& coord, ResourceStamp const& stamp, bool current);
+
+        // returns the tile if a copy is in memory or stored on the filesystem and it has been checked,
+        // otherwise returns nullptr
+        // A pinned tile is returned even if it is out of date, until it is released
+        uint8_t* Find(Dataset const& dataset, ivec3 const& coord);
+
+        // The stamp of the source a tile in the cache was decoded from, empty if there is no such tile
+        ResourceStamp StampOf(Dataset const& dataset, ivec3 const& coord) const;
+
+        // returns a slot for a tile about to be fetched, to be decoded into by the caller
+        // The tile stays pinned and hidden from Find until it is committed or discarded
+        uint8_t* Reserve(Dataset const& dataset, ivec3 const& coord);
+
+        // makes a reserved tile available, decoded from the source with this stamp
+        void Commit(Dataset const& dataset, ivec3 const& coord, ResourceStamp const& stamp);
+        void Discard(Dataset const& dataset, ivec3 const& coord);
+
+        // returns true if an earlier probe found the tile missing from the source
+        bool IsKnownMissing(Dataset const& dataset, ivec3 const& coord);
+        void MarkMissing(Dataset const& dataset, ivec3 const& coord);
+
+        // Keeps a tile that is in memory from being evicted until it is unpinned, pins are counted
+        void Pin(Dataset const& dataset, ivec3 const& coord);
+        void Unpin(Dataset const& dataset, ivec3 const& coord);
+
+        // Makes every tile get checked against its source again the next time it is used
+        void Revalidate();
+
+        uint64_t MemoryUsed() const;
+        uint64_t MemoryBudget() const;
+
+        // Evicts tiles down to the new budget if it shrank
+        void SetMemoryBudget(uint64_t budget);
+
+        // Trims the filesystem cache to its size limit and saves the index if it persists, so a long running
+        // process stays within the limit and loses nothing recorded so far if it is killed
+        void Flush();
+
+        // Closes the cache under the old settings and starts empty under the new ones, datasets stay registered
+        // so references to them remain valid. No tile may be pinned or reserved.
+        void Reconfigure(ConversionOptimizationConfig const& conf, uint64_t memoryBudget);
 
-        CacheResult operator[](string const& name);
-        DatasetCache(path cacheBaseDirectory, uint32_t elementSize, int maxElements, bool persist);
+        DatasetCache(ConversionOptimizationConfig const& conf, uint64_t memoryBudget);
         ~DatasetCache();
     private:
         DatasetCache(DatasetCache const& other) = delete;
@@ -57,4 +235,4 @@ namespace HyperTiler {
         DatasetCache(DatasetCache&& other) = delete;
         DatasetCache&& operator=(DatasetCache&& other) = delete;
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,245 @@
+#include "ElevationCodec.hpp"
+#include "ImageUtils.hpp"
+
+#include <bit>
+#include <ostream>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HT_ELEVATION_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace HyperTiler {
+    namespace {
+        constexpr uint8_t Magic[4] = { 'H', 'T', 'E', '1' };
+        constexpr size_t HeaderSize = 12;
+
+        // Most blocks of a tile are far narrower than this, the output grows past it if they aren't
+        constexpr size_t ExpectedBitsPerSample = 6;
+
+        void writeU32(uint8_t* out, uint32_t value) {
+            out[0] = static_cast<uint8_t>(value);
+            out[1] = static_cast<uint8_t>(value >> 8);
+            out[2] = static_cast<uint8_t>(value >> 16);
+            out[3] = static_cast<uint8_t>(value >> 24);
+        }
+
+        uint32_t readU32(uint8_t const* in) {
+            return static_cast<uint32_t>(in[0]) | static_cast<uint32_t>(in[1]) << 8 | static_cast<uint32_t>(in[2]) << 16 | static_cast<uint32_t>(in[3]) << 24;
+        }
+
+        uint64_t readU64(uint8_t const* in) {
+            uint64_t value;
+            memcpy(&value, in, sizeof(value));
+            if constexpr (std::endian::native == std::endian::big) {
+                uint64_t swapped = 0;
+                for (int i = 0; i < 8; ++i) swapped |= ((value >> (i * 8)) & 0xFF) << ((7 - i) * 8);
+                value = swapped;
+            }
+            return value;
+        }
+
+        // Small residuals of either sign become small values
+        uint16_t zigzag(uint16_t residual) {
+            return static_cast<uint16_t>((residual << 1) ^ static_cast<uint16_t>(static_cast<int16_t>(residual) >> 15));
+        }
+
+        uint16_t unzigzag(uint16_t value) {
+            return static_cast<uint16_t>((value >> 1) ^ (0u - (value & 1u)));
+        }
+
+        void packBlock(vector<uint8_t>& out, uint16_t const* values) {
+            uint32_t all = 0;
+            for (int i = 0; i < ElevationBlockSize; ++i) all |= values[i];
+
+            const int bits = static_cast<int>(std::bit_width(all));
+            out.push_back(static_cast<uint8_t>(bits));
+            if (bits == 0) return;
+
+            const size_t start = out.size();
+            out.resize(start + ElevationBlockSize / 8 * bits);
+            uint8_t* dst = out.data() + start;
+
+            // Every 32 bits are written at once, a block is always a whole number of them
+            uint64_t pending = 0;
+            int filled = 0;
+            for (int i = 0; i < ElevationBlockSize; ++i) {
+                pending |= static_cast<uint64_t>(values[i]) << filled;
+                filled += bits;
+                if (filled >= 32) {
+                    writeU32(dst, static_cast<uint32_t>(pending));
+                    dst += 4;
+                    pending >>= 32;
+                    filled -= 32;
+                }
+            }
+        }
+
+        // in has to have 8 bytes past the end of the block that can be read
+        void unpackBlock(uint8_t const* in, int bits, uint16_t* out) {
+            const uint64_t mask = (1ull << bits) - 1;
+            for (int i = 0; i < ElevationBlockSize; ++i) {
+                const int bit = i * bits;
+                out[i] = static_cast<uint16_t>((readU64(in + (bit >> 3)) >> (bit & 7)) & mask);
+            }
+        }
+
+        // Turns the residuals of a row into samples, a running sum of them is the difference from the row above
+        void reconstructRow(uint16_t* row, uint16_t const* above, int width) {
+            int x = 0;
+            uint16_t difference = 0;
+
+#ifdef HT_ELEVATION_SSE2
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i one = _mm_set1_epi16(1);
+            __m128i carry = zero;
+            for (; x + 8 <= width; x += 8) {
+                const __m128i values = _mm_loadu_si128(reinterpret_cast<__m128i const*>(row + x));
+                __m128i sum = _mm_xor_si128(_mm_srli_epi16(values, 1), _mm_sub_epi16(zero, _mm_and_si128(values, one)));
+
+                // Prefix sum of the eight residuals, then what came before them
+                sum = _mm_add_epi16(sum, _mm_slli_si128(sum, 2));
+                sum = _mm_add_epi16(sum, _mm_slli_si128(sum, 4));
+                sum = _mm_add_epi16(sum, _mm_slli_si128(sum, 8));
+                sum = _mm_add_epi16(sum, carry);
+
+                // The last difference in every lane
+                carry = _mm_shufflehi_epi16(sum, 0xFF);
+                carry = _mm_unpackhi_epi64(carry, carry);
+
+                const __m128i up = above ? _mm_loadu_si128(reinterpret_cast<__m128i const*>(above + x)) : zero;
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(row + x), _mm_add_epi16(sum, up));
+            }
+            difference = static_cast<uint16_t>(_mm_extract_epi16(carry, 7));
+#endif
+
+            for (; x < width; ++x) {
+                difference = static_cast<uint16_t>(difference + unzigzag(row[x]));
+                row[x] = static_cast<uint16_t>(difference + (above ? above[x] : 0));
+            }
+        }
+    }
+
+    void WriteElevationTile(vector<uint8_t>& outputData, uint16_t const* samples, int width, int height) {
+        outputData.clear();
+        if (outputData.capacity() == 0) outputData.reserve(HeaderSize + static_cast<size_t>(width) * height * ExpectedBitsPerSample / 8);
+
+        outputData.resize(HeaderSize);
+        memcpy(outputData.data(), Magic, sizeof(Magic));
+        writeU32(outputData.data() + 4, static_cast<uint32_t>(width));
+        writeU32(outputData.data() + 8, static_cast<uint32_t>(height));
+
+        uint16_t block[ElevationBlockSize];
+        int filled = 0;
+        for (int y = 0; y < height; ++y) {
+            uint16_t const* row = samples + static_cast<size_t>(y) * width;
+            uint16_t const* above = y > 0 ? row - width : nullptr;
+
+            uint16_t previous = 0;
+            for (int x = 0; x < width; ++x) {
+                const uint16_t difference = static_cast<uint16_t>(row[x] - (above ? above[x] : 0));
+                block[filled++] = zigzag(static_cast<uint16_t>(difference - previous));
+                previous = difference;
+
+                if (filled == ElevationBlockSize) {
+                    packBlock(outputData, block);
+                    filled = 0;
+                }
+            }
+        }
+
+        if (filled > 0) {
+            std::fill(block + filled, block + ElevationBlockSize, static_cast<uint16_t>(0));
+            packBlock(outputData, block);
+        }
+    }
+
+    bool ReadElevationTileInto(uint8_t const* data, size_t size, uint16_t* destination, int width, int height, PixelConverter const* convert) {
+        if (!IsElevationTile(data, size)) return false;
+        if (convert && (convert->From().BitDepth != 16 || convert->To().BitDepth != 16)) return false;
+        if (readU32(data + 4) != static_cast<uint32_t>(width) || readU32(data + 8) != static_cast<uint32_t>(height)) return false;
+
+        const uint64_t count = static_cast<uint64_t>(width) * height;
+        uint8_t const* in = data + HeaderSize;
+        uint8_t const* const end = data + size;
+
+        for (uint64_t first = 0; first < count; first += ElevationBlockSize) {
+            if (in == end) return false;
+
+            const int bits = *in++;
+            const size_t bytes = ElevationBlockSize / 8 * static_cast<size_t>(bits);
+            if (bits > 16 || static_cast<size_t>(end - in) < bytes) return false;
+
+            // The last block of the tile may be partly padding, and blocks at the end of the data can't be read past
+            const bool whole = count - first >= ElevationBlockSize;
+            uint16_t padding[ElevationBlockSize];
+            uint16_t* const out = whole ? destination + first : padding;
+
+            if (bits == 0) {
+                std::fill(out, out + ElevationBlockSize, static_cast<uint16_t>(0));
+            } else if (static_cast<size_t>(end - in) >= bytes + 8) {
+                unpackBlock(in, bits, out);
+            } else {
+                uint8_t copy[ElevationBlockSize / 8 * 16 + 8] = { };
+                memcpy(copy, in, bytes);
+                unpackBlock(copy, bits, out);
+            }
+            if (!whole) std::copy(padding, padding + (count - first), destination + first);
+
+            in += bytes;
+        }
+        if (in != end) return false;
+
+        // Each row is predicted from the one above as it was decoded, so it's converted once the next one is done
+        for (int y = 0; y < height; ++y) {
+            uint16_t* row = destination + static_cast<size_t>(y) * width;
+            reconstructRow(row, y > 0 ? row - width : nullptr, width);
+            if (convert && y > 0) convert->Convert(reinterpret_cast<uint8_t const*>(row - width), reinterpret_cast<uint8_t*>(row - width), width);
+        }
+        if (convert && height > 0) {
+            uint8_t* const last = reinterpret_cast<uint8_t*>(destination + static_cast<size_t>(height - 1) * width);
+            convert->Convert(last, last, width);
+        }
+        return true;
+    }
+
+    bool IsElevationTile(uint8_t const* data, size_t size) {
+        return size >= HeaderSize && memcmp(data, Magic, sizeof(Magic)) == 0;
+    }
+
+    void BenchmarkElevationCodec(uint16_t const* samples, int width, int height, std::ostream& out) {
+        const size_t rawSize = static_cast<size_t>(width) * height * 2;
+        const double rawMB = static_cast<double>(rawSize) / (1024.0 * 1024.0);
+        out << "Encoding and decoding a " << width << "x" << height << " 16 bit image, " << rawMB << " MB\n";
+
+        vector<uint16_t> decoded(static_cast<size_t>(width) * height);
+        auto const report = [&](char const* name, vector<uint8_t> const& encoded, double encodeSeconds, double decodeSeconds, bool matches) {
+            out << name << ": encode " << rawMB / encodeSeconds << " MB/s, decode " << rawMB / decodeSeconds << " MB/s, "
+                << encoded.size() << " bytes, " << 100.0 * encoded.size() / rawSize << "% of raw"
+                << (matches ? "" : ", DOES NOT MATCH") << "\n";
+        };
+
+        vector<uint8_t> png;
+        const double pngEncode = FastestRun([&]() {
+            WritePng(png, reinterpret_cast<uint8_t const*>(samples), width, height, false);
+        });
+        bool pngMatches = true;
+        const double pngDecode = FastestRun([&]() {
+            pngMatches = ReadPngInto(png.data(), png.size(), reinterpret_cast<uint8_t*>(decoded.data()), rawSize, static_cast<size_t>(width) * 2,
+                std::endian::native == std::endian::little);
+        });
+        pngMatches = pngMatches && memcmp(decoded.data(), samples, rawSize) == 0;
+        report("PNG", png, pngEncode, pngDecode, pngMatches);
+
+        vector<uint8_t> elevation;
+        const double elevationEncode = FastestRun([&]() {
+            WriteElevationTile(elevation, samples, width, height);
+        });
+        bool elevationMatches = true;
+        const double elevationDecode = FastestRun([&]() {
+            elevationMatches = ReadElevationTileInto(elevation.data(), elevation.size(), decoded.data(), width, height);
+        });
+        elevationMatches = elevationMatches && memcmp(decoded.data(), samples, rawSize) == 0;
+        report("Elevation", elevation, elevationEncode, elevationDecode, elevationMatches);
+    }
+}
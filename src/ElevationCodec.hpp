@@ -0,0 +1,35 @@
+#pragma once
+
+#include "Util.hpp"
+#include "PixelFormat.hpp"
+
+#include <iosfwd>
+
+namespace HyperTiler {
+    // Lossless codec for single channel 16 bit tiles, much faster than PNG to encode and decode.
+    // Each sample is predicted from its neighbours to the left, above and above left (a + b - c),
+    // and the residuals are zigzag encoded and bit packed in blocks of ElevationBlockSize, each
+    // block as wide as its largest residual. Prediction is done on the difference from the row above,
+    // so decoding a row is a prefix sum, which is done eight samples at a time where SSE2 is available.
+    //
+    // Layout, little endian:
+    //     "HTE1", width and height as uint32
+    //     for each block: its width in bits (0 to 16), then 32 residuals of that many bits, lowest bits first
+    // The last block is padded with zeros.
+    constexpr int ElevationBlockSize = 32;
+
+    // Samples are in the byte order of this machine, and so are decoded samples, tiles are the same on any machine
+    // outputData is cleared first but keeps its capacity
+    void WriteElevationTile(vector<uint8_t>& outputData, uint16_t const* samples, int width, int height);
+
+    // false if the data isn't a tile of exactly this size or is cut short
+    // convert is run over each row once it has been decoded, it has to take and make 16 bit samples
+    bool ReadElevationTileInto(uint8_t const* data, size_t size, uint16_t* destination, int width, int height, PixelConverter const* convert = nullptr);
+
+    // Whether data starts like a tile written by WriteElevationTile
+    bool IsElevationTile(uint8_t const* data, size_t size);
+
+    // Encodes and decodes a tile with this codec and with PNG, and writes how fast each was and how large
+    // its output, samples are in the byte order of this machine
+    void BenchmarkElevationCodec(uint16_t const* samples, int width, int height, std::ostream& out);
+}
@@ -0,0 +1,634 @@
+#include "FileBatcher.hpp"
+
+#include <iostream>
+#include <algorithm>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HT_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#define HT_DIRECT_IO
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+namespace HyperTiler {
+#ifdef HT_IO_URING
+    // A submission and completion queue shared with the kernel, set up with the system calls directly
+    class Ring {
+        int m_fd;
+        uint8_t* m_sqRing;
+        size_t m_sqRingSize;
+        uint8_t* m_cqRing;
+        size_t m_cqRingSize;
+        io_uring_sqe* m_sqes;
+        size_t m_sqesSize;
+
+        unsigned* m_sqTail;
+        unsigned m_sqMask;
+        unsigned* m_sqArray;
+        unsigned* m_cqHead;
+        unsigned* m_cqTail;
+        unsigned m_cqMask;
+        io_uring_cqe* m_cqes;
+
+        // filled in but not submitted yet
+        unsigned m_queued;
+
+        // submitted but not completed yet
+        unsigned m_inFlight;
+
+        void Release() {
+            if (m_sqes) munmap(m_sqes, m_sqesSize);
+            if (m_cqRing && m_cqRing != m_sqRing) munmap(m_cqRing, m_cqRingSize);
+            if (m_sqRing) munmap(m_sqRing, m_sqRingSize);
+            if (m_fd >= 0) close(m_fd);
+            m_sqes = nullptr;
+            m_cqRing = nullptr;
+            m_sqRing = nullptr;
+            m_fd = -1;
+        }
+
+        // Every operation used here is supported by kernels since 5.6
+        bool SupportsOperations() {
+            constexpr unsigned numOps = 256;
+            vector<uint8_t> buffer(sizeof(io_uring_probe) + numOps * sizeof(io_uring_probe_op), 0);
+            io_uring_probe* const probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+            if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, probe, numOps) < 0) return false;
+
+            for (uint8_t op : { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE }) {
+                if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+            }
+            return true;
+        }
+    public:
+        static constexpr unsigned Entries = 256;
+
+        bool Valid() const { return m_fd >= 0; }
+
+        io_uring_sqe& Queue(uint8_t opcode, uint64_t userData) {
+            htAssert(m_queued + m_inFlight < Entries);
+
+            const unsigned index = (*m_sqTail + m_queued) & m_sqMask;
+            io_uring_sqe& sqe = m_sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = opcode;
+            sqe.user_data = userData;
+            m_sqArray[index] = index;
+            ++m_queued;
+            return sqe;
+        }
+
+        // Submits everything queued and waits for everything in flight, calling done(userData, result) for each
+        // done may queue more, which is submitted by the next call
+        // Returns false if the kernel refused, the ring can't be used after that
+        template<typename F>
+        bool Complete(F const& done) {
+            __atomic_store_n(m_sqTail, *m_sqTail + m_queued, __ATOMIC_RELEASE);
+            unsigned toSubmit = m_queued;
+            m_inFlight += m_queued;
+            m_queued = 0;
+
+            while (m_inFlight > 0) {
+                const int submitted = static_cast<int>(syscall(__NR_io_uring_enter, m_fd, toSubmit, m_inFlight, IORING_ENTER_GETEVENTS, nullptr, 0));
+                if (submitted < 0) {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                toSubmit -= std::min(toSubmit, static_cast<unsigned>(submitted));
+
+                unsigned head = *m_cqHead;
+                const unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+                for (; head != tail; ++head) {
+                    io_uring_cqe const& cqe = m_cqes[head & m_cqMask];
+                    --m_inFlight;
+                    done(cqe.user_data, cqe.res);
+                }
+                __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+            }
+
+            return true;
+        }
+
+        bool HasQueued() const { return m_queued > 0; }
+
+        Ring()
+        : m_fd(-1)
+        , m_sqRing(nullptr)
+        , m_sqRingSize(0)
+        , m_cqRing(nullptr)
+        , m_cqRingSize(0)
+        , m_sqes(nullptr)
+        , m_sqesSize(0)
+        , m_sqTail(nullptr)
+        , m_sqMask(0)
+        , m_sqArray(nullptr)
+        , m_cqHead(nullptr)
+        , m_cqTail(nullptr)
+        , m_cqMask(0)
+        , m_cqes(nullptr)
+        , m_queued(0)
+        , m_inFlight(0)
+        {
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            m_fd = static_cast<int>(syscall(__NR_io_uring_setup, Entries, &params));
+            if (m_fd < 0) return;
+
+            m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            if (params.features & IORING_FEAT_SINGLE_MMAP) m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+
+            void* const sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+            if (sqRing == MAP_FAILED) {
+                Release();
+                return;
+            }
+            m_sqRing = reinterpret_cast<uint8_t*>(sqRing);
+
+            if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                m_cqRing = m_sqRing;
+            } else {
+                void* const cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+                if (cqRing == MAP_FAILED) {
+                    Release();
+                    return;
+                }
+                m_cqRing = reinterpret_cast<uint8_t*>(cqRing);
+            }
+
+            m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+            void* const sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+            if (sqes == MAP_FAILED) {
+                Release();
+                return;
+            }
+            m_sqes = reinterpret_cast<io_uring_sqe*>(sqes);
+
+            m_sqTail = reinterpret_cast<unsigned*>(m_sqRing + params.sq_off.tail);
+            m_sqMask = *reinterpret_cast<unsigned*>(m_sqRing + params.sq_off.ring_mask);
+            m_sqArray = reinterpret_cast<unsigned*>(m_sqRing + params.sq_off.array);
+            m_cqHead = reinterpret_cast<unsigned*>(m_cqRing + params.cq_off.head);
+            m_cqTail = reinterpret_cast<unsigned*>(m_cqRing + params.cq_off.tail);
+            m_cqMask = *reinterpret_cast<unsigned*>(m_cqRing + params.cq_off.ring_mask);
+            m_cqes = reinterpret_cast<io_uring_cqe*>(m_cqRing + params.cq_off.cqes);
+
+            if (!SupportsOperations()) Release();
+        }
+        ~Ring() {
+            Release();
+        }
+    private:
+        Ring(Ring const& other) = delete;
+        Ring& operator=(Ring const& other) = delete;
+    };
+
+    // nullptr if io_uring can't be used on this system
+    static Ring* ThreadRing() {
+        thread_local std::unique_ptr<Ring> ring = std::make_unique<Ring>();
+        return ring->Valid() ? ring.get() : nullptr;
+    }
+
+    enum class Operation : uint64_t {
+        Open,
+        Stat,
+        Transfer,
+        Close
+    };
+
+    static uint64_t Tag(size_t index, Operation operation) {
+        return static_cast<uint64_t>(index) * 4 + static_cast<uint64_t>(operation);
+    }
+
+    // Same as std::filesystem::last_write_time gives, which is what GetFileStamp stores
+    static int64_t FileTimeOf(statx_timestamp const& time) {
+        const std::chrono::sys_time<std::chrono::nanoseconds> sysTime(std::chrono::seconds(time.tv_sec) + std::chrono::nanoseconds(time.tv_nsec));
+        return std::chrono::time_point_cast<std::filesystem::file_time_type::duration>(std::chrono::file_clock::from_sys(sysTime)).time_since_epoch().count();
+    }
+
+    // Reads and writes are limited to this many bytes at once by the kernel
+    constexpr uint64_t MaxTransfer = 1ull << 30;
+
+    // Files opened by a ring are closed along with the opens of the next part of the batch
+    static void QueueClose(Ring& ring, int fd) {
+        io_uring_sqe& sqe = ring.Queue(IORING_OP_CLOSE, Tag(0, Operation::Close));
+        sqe.fd = fd;
+    }
+#endif
+
+    static void ReadFile(FileRead& read) {
+        read.Data.clear();
+        read.Ok = false;
+        read.Missing = false;
+
+        if (!GetFileStamp(read.Path, read.Stamp)) {
+            read.Missing = true;
+            return;
+        }
+
+        try {
+            read.Data = ReadEntireFileBinary(read.Path);
+            read.Ok = true;
+        } catch (std::exception const&) {
+            read.Data.clear();
+        }
+    }
+
+#ifdef HT_DIRECT_IO
+    static uint64_t DirectSize(FileWrite const& write) {
+        return (write.Size + FileBatcher::DirectAlignment - 1) / FileBatcher::DirectAlignment * FileBatcher::DirectAlignment;
+    }
+
+    // False with errno set to EINVAL if the filesystem doesn't take direct writes, nothing is written then
+    static bool WriteFileDirect(FileWrite const& write) {
+        const int fd = open(write.Path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0666);
+        if (fd < 0) return false;
+
+        const uint64_t size = DirectSize(write);
+        uint64_t done = 0;
+        while (done < size) {
+            const ssize_t written = pwrite(fd, write.Data + done, static_cast<size_t>(std::min<uint64_t>(size - done, 1ull << 30)), static_cast<off_t>(done));
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) {
+                const int error = written < 0 ? errno : EIO;
+                close(fd);
+                errno = error;
+                return false;
+            }
+            done += static_cast<uint64_t>(written);
+        }
+
+        const bool ok = size == write.Size || ftruncate(fd, static_cast<off_t>(write.Size)) == 0;
+        return close(fd) == 0 && ok;
+    }
+#endif
+
+    static void WriteFile(FileWrite& write) {
+#ifdef HT_DIRECT_IO
+        if (write.Direct) {
+            write.Ok = WriteFileDirect(write);
+            if (write.Ok || errno != EINVAL) return;
+        }
+#endif
+
+        std::ofstream f(write.Path, std::ios::binary | std::ios::trunc);
+        f.write(reinterpret_cast<char const*>(write.Data), write.Size);
+        f.close();
+        write.Ok = !f.fail();
+    }
+
+    bool FileBatcher::ReadWithIoUring(vector<FileRead>& reads) {
+#ifdef HT_IO_URING
+        if (!m_useIoUring || m_ioUringBroken) return false;
+
+        Ring* const ring = ThreadRing();
+        if (!ring) {
+            if (!m_ioUringBroken.exchange(true)) std::cout << "io_uring is unavailable, local files are read by threads instead\n";
+            return false;
+        }
+
+        struct Pending {
+            int Fd = -1;
+            int OpenResult = 0;
+            int StatResult = 0;
+            struct statx Info;
+            uint64_t Done = 0;
+            bool Failed = false;
+        };
+
+        for (size_t begin = 0; begin < reads.size(); begin += RingBatch) {
+            const size_t count = std::min(RingBatch, reads.size() - begin);
+            vector<Pending> pending(count);
+
+            // Files the ring opened are closed directly once it is broken
+            auto const fail = [&]() {
+                for (Pending const& file : pending) {
+                    if (file.Fd >= 0) close(file.Fd);
+                }
+                m_ioUringBroken = true;
+                return false;
+            };
+
+            // Opened and looked up at the same time, both by path
+            for (size_t i = 0; i < count; ++i) {
+                FileRead& read = reads[begin + i];
+                read.Data.clear();
+                read.Ok = false;
+                read.Missing = false;
+
+                io_uring_sqe& open = ring->Queue(IORING_OP_OPENAT, Tag(i, Operation::Open));
+                open.fd = AT_FDCWD;
+                open.addr = reinterpret_cast<uint64_t>(read.Path.c_str());
+                open.open_flags = O_RDONLY | O_CLOEXEC;
+
+                io_uring_sqe& stat = ring->Queue(IORING_OP_STATX, Tag(i, Operation::Stat));
+                stat.fd = AT_FDCWD;
+                stat.addr = reinterpret_cast<uint64_t>(read.Path.c_str());
+                stat.len = STATX_TYPE | STATX_SIZE | STATX_MTIME;
+                stat.off = reinterpret_cast<uint64_t>(&pending[i].Info);
+            }
+
+            auto const done = [&](uint64_t tag, int result) {
+                const Operation operation = static_cast<Operation>(tag % 4);
+                if (operation == Operation::Close) return;
+
+                Pending& file = pending[tag / 4];
+                if (operation == Operation::Open) {
+                    file.OpenResult = result;
+                    if (result >= 0) file.Fd = result;
+                } else if (operation == Operation::Stat) {
+                    file.StatResult = result;
+                } else {
+                    FileRead& read = reads[begin + tag / 4];
+                    if (result < 0) {
+                        file.Failed = true;
+                    } else if (result == 0) {
+                        // The file got shorter since it was looked up
+                        read.Data.resize(file.Done);
+                    } else {
+                        file.Done += result;
+                        if (file.Done < read.Data.size()) {
+                            io_uring_sqe& more = ring->Queue(IORING_OP_READ, tag);
+                            more.fd = file.Fd;
+                            more.addr = reinterpret_cast<uint64_t>(read.Data.data() + file.Done);
+                            more.len = static_cast<uint32_t>(std::min<uint64_t>(read.Data.size() - file.Done, MaxTransfer));
+                            more.off = file.Done;
+                        }
+                    }
+                }
+            };
+
+            if (!ring->Complete(done)) return fail();
+
+            for (size_t i = 0; i < count; ++i) {
+                FileRead& read = reads[begin + i];
+                Pending& file = pending[i];
+
+                // Not regular files count as missing, as with GetFileStamp
+                if (file.OpenResult == -ENOENT || file.StatResult == -ENOENT || (file.StatResult == 0 && !S_ISREG(file.Info.stx_mode))) {
+                    read.Missing = true;
+                    continue;
+                }
+                if (file.Fd < 0 || file.StatResult != 0) continue;
+
+                read.Stamp.Size = file.Info.stx_size;
+                read.Stamp.ModifiedTime = FileTimeOf(file.Info.stx_mtime);
+                read.Stamp.ETag.clear();
+                read.Data.resize(file.Info.stx_size);
+                if (read.Data.empty()) continue;
+
+                io_uring_sqe& sqe = ring->Queue(IORING_OP_READ, Tag(i, Operation::Transfer));
+                sqe.fd = file.Fd;
+                sqe.addr = reinterpret_cast<uint64_t>(read.Data.data());
+                sqe.len = static_cast<uint32_t>(std::min<uint64_t>(read.Data.size(), MaxTransfer));
+                sqe.off = 0;
+            }
+
+            // Short reads queue the rest of the file
+            while (ring->HasQueued()) {
+                if (!ring->Complete(done)) return fail();
+            }
+
+            for (size_t i = 0; i < count; ++i) {
+                FileRead& read = reads[begin + i];
+                Pending const& file = pending[i];
+                if (file.Fd < 0) continue;
+
+                QueueClose(*ring, file.Fd);
+                read.Ok = !file.Failed && file.StatResult == 0;
+                if (!read.Ok) read.Data.clear();
+            }
+        }
+
+        if (!ring->Complete([](uint64_t, int) { })) m_ioUringBroken = true;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    bool FileBatcher::WriteWithIoUring(vector<FileWrite>& writes) {
+#ifdef HT_IO_URING
+        if (!m_useIoUring || m_ioUringBroken) return false;
+
+        Ring* const ring = ThreadRing();
+        if (!ring) {
+            if (!m_ioUringBroken.exchange(true)) std::cout << "io_uring is unavailable, local files are written by threads instead\n";
+            return false;
+        }
+
+        struct Pending {
+            int Fd = -1;
+            uint64_t Done = 0;
+
+            // Size rounded up for direct writes
+            uint64_t Size = 0;
+            bool Failed = false;
+
+            // the filesystem doesn't take direct writes, the file is written by WriteFile instead
+            bool Retry = false;
+        };
+
+        // Written without O_DIRECT after the batch
+        vector<size_t> retries;
+
+        for (size_t begin = 0; begin < writes.size(); begin += RingBatch) {
+            const size_t count = std::min(RingBatch, writes.size() - begin);
+            vector<Pending> pending(count);
+
+            // Files the ring opened are closed directly once it is broken
+            auto const fail = [&]() {
+                for (Pending const& file : pending) {
+                    if (file.Fd >= 0) close(file.Fd);
+                }
+                m_ioUringBroken = true;
+                return false;
+            };
+
+            for (size_t i = 0; i < count; ++i) {
+                FileWrite& write = writes[begin + i];
+                write.Ok = false;
+                pending[i].Size = write.Direct ? DirectSize(write) : write.Size;
+
+                io_uring_sqe& open = ring->Queue(IORING_OP_OPENAT, Tag(i, Operation::Open));
+                open.fd = AT_FDCWD;
+                open.addr = reinterpret_cast<uint64_t>(write.Path.c_str());
+                open.open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (write.Direct ? O_DIRECT : 0);
+                open.len = 0666;
+            }
+
+            auto const done = [&](uint64_t tag, int result) {
+                const Operation operation = static_cast<Operation>(tag % 4);
+                if (operation == Operation::Close) return;
+
+                Pending& file = pending[tag / 4];
+                FileWrite const& write = writes[begin + tag / 4];
+                if (operation == Operation::Open) {
+                    if (result >= 0) file.Fd = result;
+                    else if (result == -EINVAL && write.Direct) file.Retry = true;
+                    return;
+                }
+
+                if (result <= 0) {
+                    file.Failed = true;
+                    if (result == -EINVAL && write.Direct) file.Retry = true;
+                    return;
+                }
+
+                file.Done += result;
+                if (file.Done < file.Size) {
+                    io_uring_sqe& more = ring->Queue(IORING_OP_WRITE, tag);
+                    more.fd = file.Fd;
+                    more.addr = reinterpret_cast<uint64_t>(write.Data + file.Done);
+                    more.len = static_cast<uint32_t>(std::min<uint64_t>(file.Size - file.Done, MaxTransfer));
+                    more.off = file.Done;
+                }
+            };
+
+            if (!ring->Complete(done)) return fail();
+
+            for (size_t i = 0; i < count; ++i) {
+                FileWrite const& write = writes[begin + i];
+                if (pending[i].Fd < 0 || write.Size == 0) continue;
+
+                io_uring_sqe& sqe = ring->Queue(IORING_OP_WRITE, Tag(i, Operation::Transfer));
+                sqe.fd = pending[i].Fd;
+                sqe.addr = reinterpret_cast<uint64_t>(write.Data);
+                sqe.len = static_cast<uint32_t>(std::min<uint64_t>(pending[i].Size, MaxTransfer));
+                sqe.off = 0;
+            }
+
+            // Short writes queue the rest of the data
+            while (ring->HasQueued()) {
+                if (!ring->Complete(done)) return fail();
+            }
+
+            for (size_t i = 0; i < count; ++i) {
+                if (pending[i].Retry) retries.push_back(begin + i);
+                if (pending[i].Fd < 0) continue;
+
+                // Only recent kernels can truncate through io_uring, it's only needed to cut off the padding of direct writes
+                bool truncated = true;
+                if (!pending[i].Failed && pending[i].Size != writes[begin + i].Size) {
+                    truncated = ftruncate(pending[i].Fd, static_cast<off_t>(writes[begin + i].Size)) == 0;
+                }
+
+                QueueClose(*ring, pending[i].Fd);
+                writes[begin + i].Ok = !pending[i].Failed && truncated;
+            }
+        }
+
+        if (!ring->Complete([](uint64_t, int) { })) m_ioUringBroken = true;
+
+        for (size_t i : retries) {
+            FileWrite& write = writes[i];
+            write.Direct = false;
+            WriteFile(write);
+            write.Direct = true;
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void FileBatcher::Worker() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(m_mut);
+                m_ready.wait(lock, [this] { return m_stopping || !m_tasks.empty(); });
+                if (m_stopping) return;
+
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    void FileBatcher::ParallelFor(size_t count, std::function<void(size_t)> const& func) {
+        if (count == 0) return;
+
+        std::atomic_size_t next = 0;
+        auto const work = [&next, count, &func] {
+            for (size_t i = next++; i < count; i = next++) func(i);
+        };
+
+        size_t helpersLeft = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+
+            // Started on first use, so processes using io_uring never have them
+            if (m_workers.empty()) {
+                const int numWorkers = std::clamp(static_cast<int>(std::thread::hardware_concurrency()), 2, MaxWorkers);
+                for (int i = 0; i < numWorkers; ++i) m_workers.emplace_back([this] { Worker(); });
+            }
+
+            helpersLeft = std::min(m_workers.size(), count - 1);
+            for (size_t i = 0; i < helpersLeft; ++i) {
+                m_tasks.push_back([this, &work, &helpersLeft] {
+                    work();
+                    std::lock_guard<std::mutex> lock(m_mut);
+                    --helpersLeft;
+                    m_done.notify_all();
+                });
+            }
+        }
+        m_ready.notify_all();
+
+        work();
+
+        std::unique_lock<std::mutex> lock(m_mut);
+        m_done.wait(lock, [&helpersLeft] { return helpersLeft == 0; });
+    }
+
+    void FileBatcher::SetUseIoUring(bool useIoUring) {
+        m_useIoUring = useIoUring;
+    }
+
+    bool FileBatcher::UsingIoUring() const {
+#ifdef HT_IO_URING
+        return m_useIoUring && !m_ioUringBroken;
+#else
+        return false;
+#endif
+    }
+
+    void FileBatcher::Read(vector<FileRead>& reads) {
+        if (ReadWithIoUring(reads)) return;
+        ParallelFor(reads.size(), [&reads](size_t i) { ReadFile(reads[i]); });
+    }
+
+    void FileBatcher::Write(vector<FileWrite>& writes) {
+        if (WriteWithIoUring(writes)) return;
+        ParallelFor(writes.size(), [&writes](size_t i) { WriteFile(writes[i]); });
+    }
+
+    FileBatcher::FileBatcher()
+    : m_useIoUring(true)
+    , m_ioUringBroken(false)
+    , m_stopping(false)
+    { }
+
+    FileBatcher::~FileBatcher() {
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            m_stopping = true;
+        }
+        m_ready.notify_all();
+        for (std::thread& worker : m_workers) worker.join();
+    }
+
+    FileBatcher& LocalFiles() {
+        static FileBatcher files;
+        return files;
+    }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "Util.hpp"
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <functional>
+#include <condition_variable>
+
+namespace HyperTiler {
+    struct FileRead {
+        path Path;
+
+        // empty if the file couldn't be read
+        vector<uint8_t> Data;
+
+        // same as GetFileStamp gives for the file
+        ResourceStamp Stamp;
+
+        bool Ok = false;
+
+        // the file doesn't exist
+        bool Missing = false;
+    };
+
+    struct FileWrite {
+        path Path;
+
+        // not owned, must stay valid until the write is done
+        uint8_t const* Data = nullptr;
+        uint64_t Size = 0;
+
+        // Bypass the page cache with O_DIRECT where the system and filesystem support it, otherwise the file is
+        // written normally. Data has to be aligned to DirectAlignment and readable up to Size rounded up to it,
+        // the padding is written and then cut off.
+        bool Direct = false;
+
+        bool Ok = false;
+    };
+
+    // Reads and writes many whole files at once. On Linux the opens, reads, writes and closes of a batch
+    // are submitted to io_uring together, so a batch costs a few system calls instead of several per file.
+    // Elsewhere, or where io_uring is turned off or unavailable, the files of a batch are read and written
+    // by a pool of threads. Thread safe, every thread submits to a ring of its own.
+    class FileBatcher {
+        std::atomic_bool m_useIoUring;
+
+        // set once io_uring failed to start, it is then never tried again
+        std::atomic_bool m_ioUringBroken;
+
+        std::mutex m_mut;
+        std::condition_variable m_ready;
+        std::condition_variable m_done;
+        std::deque<std::function<void()>> m_tasks;
+        vector<std::thread> m_workers;
+        bool m_stopping;
+
+        void Worker();
+
+        // Runs func for every index in [0, count) on the pool, the calling thread helps out
+        void ParallelFor(size_t count, std::function<void(size_t)> const& func);
+
+        // False if io_uring can't be used, the batch is then untouched
+        bool ReadWithIoUring(vector<FileRead>& reads);
+        bool WriteWithIoUring(vector<FileWrite>& writes);
+    public:
+        // Files opened at once by a ring, larger batches are done in parts of this size
+        static constexpr size_t RingBatch = 64;
+
+        static constexpr int MaxWorkers = 8;
+
+        // Alignment of the data, offsets and sizes of direct writes
+        static constexpr uint64_t DirectAlignment = 4096;
+
+        void SetUseIoUring(bool useIoUring);
+
+        // Whether batches currently go through io_uring
+        bool UsingIoUring() const;
+
+        void Read(vector<FileRead>& reads);
+
+        // Files are created or truncated
+        void Write(vector<FileWrite>& writes);
+
+        FileBatcher();
+        ~FileBatcher();
+    private:
+        FileBatcher(FileBatcher const& other) = delete;
+        FileBatcher& operator=(FileBatcher const& other) = delete;
+    };
+
+    // Shared by everything reading or writing local tiles
+    FileBatcher& LocalFiles();
+}
@@ -0,0 +1,842 @@
+#include "Http.hpp"
+
+#include <curl/curl.h>
+
+#include <mutex>
+#include <memory>
+#include <algorithm>
+#include <cctype>
+#include <ctime>
+#include <charconv>
+#include <limits>
+
+namespace HyperTiler {
+    // Caches shared by every handle in the process. Connections themselves aren't shared since libcurl
+    // doesn't support using one connection cache from several threads at once.
+    // Set up on first use and never torn down, handles of other threads may still be using it at exit.
+    class CurlShare {
+        std::mutex m_locks[CURL_LOCK_DATA_LAST];
+        CURLSH* m_share;
+
+        static void Lock(CURL* /*handle*/, curl_lock_data data, curl_lock_access /*access*/, void* userp) {
+            reinterpret_cast<CurlShare*>(userp)->m_locks[data].lock();
+        }
+        static void Unlock(CURL* /*handle*/, curl_lock_data data, void* userp) {
+            reinterpret_cast<CurlShare*>(userp)->m_locks[data].unlock();
+        }
+
+        CurlShare() {
+            curl_global_init(CURL_GLOBAL_ALL);
+
+            m_share = curl_share_init();
+            curl_share_setopt(m_share, CURLSHOPT_LOCKFUNC, Lock);
+            curl_share_setopt(m_share, CURLSHOPT_UNLOCKFUNC, Unlock);
+            curl_share_setopt(m_share, CURLSHOPT_USERDATA, this);
+            curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        }
+    public:
+        static CURLSH* Get() {
+            static CurlShare* const shared = new CurlShare();
+            return shared->m_share;
+        }
+    };
+
+    HttpCache& ResponseCache() {
+        // Disabled until configured
+        static HttpCache cache;
+        return cache;
+    }
+
+    ConcurrencyController& RemoteConcurrency() {
+        // Conversions set the limit from their config
+        static ConcurrencyController controller(16);
+        return controller;
+    }
+
+    static std::mutex DeadlinesMut;
+    static RequestDeadlines Deadlines;
+
+    void SetRequestDeadlines(RequestDeadlines const& deadlines) {
+        std::lock_guard<std::mutex> lock(DeadlinesMut);
+        Deadlines = deadlines;
+    }
+
+    struct CurlHandleDeleter {
+        void operator()(CURL* handle) const { curl_easy_cleanup(handle); }
+    };
+
+    // Sets the options every request uses, resetting the handle keeps its open connections
+    static void SetupHandle(CURL* handle) {
+        curl_easy_reset(handle);
+        curl_easy_setopt(handle, CURLOPT_SHARE, CurlShare::Get());
+        curl_easy_setopt(handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+        curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, false);
+        curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, true);
+        curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+
+        RequestDeadlines deadlines;
+        {
+            std::lock_guard<std::mutex> lock(DeadlinesMut);
+            deadlines = Deadlines;
+        }
+        curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT_MS, deadlines.ConnectTimeoutMs);
+        curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, deadlines.TimeoutMs);
+        curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, deadlines.LowSpeedLimit);
+        curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, deadlines.LowSpeedTime);
+
+        // Empty string offers every encoding this build of libcurl can decode
+        curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "");
+    }
+
+    // Returns this thread's handle, set up with the options every request uses
+    static CURL* ThreadHandle() {
+        CurlShare::Get();
+
+        thread_local std::unique_ptr<CURL, CurlHandleDeleter> handle(curl_easy_init());
+        htAssert(handle != nullptr);
+
+        SetupHandle(handle.get());
+
+        return handle.get();
+    }
+
+    // Runs the transfer, returns the HTTP response code or 0 if no response was received
+    static long Perform(CURL* handle) {
+        const CURLcode res = curl_easy_perform(handle);
+
+        if (res != CURLE_OK) {
+            fprintf(stderr, "curl_easy_perform() failed: %s\n",
+                curl_easy_strerror(res));
+        }
+
+        long http_code = 0;
+        curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &http_code);
+        return http_code;
+    }
+
+    // What the controller learns from a finished transfer
+    static ConcurrencyController::Outcome ReadOutcome(CURL* handle, long status) {
+        ConcurrencyController::Outcome outcome;
+        outcome.Status = status;
+
+        // Measured from the request being sent, so connection setup doesn't count as server latency
+        curl_off_t sent = 0, firstByte = 0;
+        curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME_T, &sent);
+        curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &firstByte);
+        outcome.Latency = std::chrono::microseconds(std::max<curl_off_t>(0, firstByte - sent));
+
+        curl_off_t bytes = 0;
+        curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+        outcome.Bytes = static_cast<uint64_t>(std::max<curl_off_t>(0, bytes));
+
+        // Both the seconds and the date form of the header are parsed by libcurl
+        curl_off_t retryAfter = 0;
+        curl_easy_getinfo(handle, CURLINFO_RETRY_AFTER, &retryAfter);
+        outcome.RetryAfter = std::chrono::seconds(std::max<curl_off_t>(0, retryAfter));
+
+        return outcome;
+    }
+
+    // Runs the transfer once the window has room, and again after a pause while the server throttles it
+    // onRetry should discard whatever the previous attempt received
+    static long PerformControlled(CURL* handle, std::function<void()> const& onRetry) {
+        ConcurrencyController& controller = RemoteConcurrency();
+
+        for (int attempt = 1; ; ++attempt) {
+            ConcurrencyController::Ticket ticket;
+            controller.Acquire(ticket);
+
+            const long http_code = Perform(handle);
+            controller.Release(ticket, ReadOutcome(handle, http_code));
+
+            if (!ConcurrencyController::IsThrottled(http_code) || attempt >= ConcurrencyController::MaxAttempts) return http_code;
+
+            if (onRetry) onRetry();
+        }
+    }
+
+    struct UrlDownload {
+        CURL* Handle;
+        vector<uint8_t> Data;
+
+        // the body is passed on as it arrives if set, once the response turns out to be successful
+        Downloader::StreamFunc const* Stream = nullptr;
+        bool Streaming = false;
+        bool StreamStopped = false;
+    };
+
+    static size_t
+        WriteVectorCallback(char* contents, size_t size, size_t nmemb, void* userp)
+    {
+        size_t realsize = size * nmemb;
+        UrlDownload* download = reinterpret_cast<UrlDownload*>(userp);
+
+        // Sized once from Content-Length, compressed responses can still outgrow it
+        if (download->Data.empty()) {
+            curl_off_t contentLength = -1;
+            curl_easy_getinfo(download->Handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &contentLength);
+            if (contentLength > 0) download->Data.reserve(static_cast<size_t>(contentLength));
+        }
+
+        download->Data.insert(download->Data.end(), contents, contents + realsize);
+
+        if (download->Stream && !download->StreamStopped) {
+            // Decided on the first part of the body, error pages aren't the resource
+            if (!download->Streaming) {
+                long http_code = 0;
+                curl_easy_getinfo(download->Handle, CURLINFO_RESPONSE_CODE, &http_code);
+                download->Streaming = http_code == 200;
+                download->StreamStopped = !download->Streaming;
+            }
+            if (download->Streaming && !(*download->Stream)(reinterpret_cast<uint8_t const*>(contents), realsize)) {
+                download->StreamStopped = true;
+            }
+        }
+
+        return realsize;
+    }
+
+    // What the headers of a response say about the resource, and how long it may be cached
+    struct ResponseHeaders {
+        string ETag;
+        string LastModified;
+
+        // -1 if not given
+        int64_t MaxAge = -1;
+        int64_t Expires = -1;
+
+        bool NoStore = false;
+
+        // size of the whole resource from Content-Range, 0 if not given
+        uint64_t TotalSize = 0;
+    };
+
+    // Headers of redirects are discarded
+    static size_t
+        ResponseHeaderCallback(char* buffer, size_t size, size_t nitems, void* userp)
+    {
+        static const std::regex header(R"(^([A-Za-z0-9-]+):\s*(.*?)\s*$)");
+        static const std::regex maxAge(R"((?:^|[,\s])max-age\s*=\s*"?(\d+))", std::regex::icase);
+
+        size_t realsize = size * nitems;
+        ResponseHeaders* headers = reinterpret_cast<ResponseHeaders*>(userp);
+
+        string const line(buffer, realsize);
+        std::smatch match;
+        if (line.rfind("HTTP/", 0) == 0) {
+            *headers = ResponseHeaders();
+        } else if (std::regex_search(line, match, header)) {
+            string name = match[1];
+            std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+            string const value = match[2];
+
+            if (name == "etag") {
+                headers->ETag = value;
+            } else if (name == "last-modified") {
+                headers->LastModified = value;
+            } else if (name == "cache-control") {
+                string directives = value;
+                std::transform(directives.begin(), directives.end(), directives.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+                if (directives.find("no-store") != string::npos) headers->NoStore = true;
+                if (directives.find("no-cache") != string::npos) headers->MaxAge = 0;
+                // Ages too large to hold are as good as forever
+                std::smatch age;
+                if (headers->MaxAge != 0 && std::regex_search(directives, age, maxAge)) {
+                    string const digits = age[1];
+                    int64_t seconds = 0;
+                    if (std::from_chars(digits.data(), digits.data() + digits.size(), seconds).ec == std::errc::result_out_of_range) {
+                        seconds = std::numeric_limits<int64_t>::max();
+                    }
+                    headers->MaxAge = seconds;
+                }
+            } else if (name == "expires") {
+                // Invalid dates mean already expired
+                const time_t expires = curl_getdate(value.c_str(), nullptr);
+                headers->Expires = expires < 0 ? 0 : static_cast<int64_t>(expires);
+            } else if (name == "content-range") {
+                // bytes <first>-<last>/<total>, the total may be unknown, a total that doesn't parse is taken as unknown
+                const size_t slash = value.rfind('/');
+                uint64_t total = 0;
+                if (slash != string::npos && std::from_chars(value.data() + slash + 1, value.data() + value.size(), total).ec == std::errc()) {
+                    headers->TotalSize = total;
+                }
+            }
+        }
+
+        return realsize;
+    }
+
+    // Fills in the stamp once the transfer is complete
+    // The size is the one the server reports, which is the encoded size for compressed responses
+    static void ReadStampInfo(CURL* curl_handle, ResponseHeaders const& headers, ResourceStamp& stamp) {
+        stamp.ETag = headers.ETag;
+
+        curl_off_t fileTime = -1;
+        curl_easy_getinfo(curl_handle, CURLINFO_FILETIME_T, &fileTime);
+        stamp.ModifiedTime = fileTime;
+
+        curl_off_t contentLength = -1;
+        curl_easy_getinfo(curl_handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &contentLength);
+        stamp.Size = contentLength < 0 ? 0 : static_cast<uint64_t>(contentLength);
+    }
+
+    // Seconds since epoch until which a response with these headers may be used without asking the server
+    // Returns a negative value if the response must not be stored
+    static int64_t FreshUntil(ResponseHeaders const& headers) {
+        if (headers.NoStore) return -1;
+
+        const int64_t now = static_cast<int64_t>(std::time(nullptr));
+        if (headers.MaxAge >= 0) return headers.MaxAge > std::numeric_limits<int64_t>::max() - now ? std::numeric_limits<int64_t>::max() : now + headers.MaxAge;
+        if (headers.Expires >= 0) return headers.Expires;
+        return now + ResponseCache().DefaultMaxAge();
+    }
+
+    struct HeaderListDeleter {
+        void operator()(curl_slist* list) const { curl_slist_free_all(list); }
+    };
+    typedef std::unique_ptr<curl_slist, HeaderListDeleter> HeaderList;
+
+    // Asks the server to only send the body if it changed since the cached response, has to outlive the transfer
+    static HeaderList ConditionalHeaders(HttpCache::Entry const& cached) {
+        curl_slist* list = nullptr;
+        if (!cached.Stamp.ETag.empty()) list = curl_slist_append(list, ("If-None-Match: " + cached.Stamp.ETag).c_str());
+        if (!cached.LastModified.empty()) list = curl_slist_append(list, ("If-Modified-Since: " + cached.LastModified).c_str());
+        return HeaderList(list);
+    }
+
+    // Stores a complete response, or forgets the stored one if the server no longer has it
+    static void UpdateResponseCache(string const& url, long status, ResponseHeaders const& headers, ResourceStamp const& stamp, vector<uint8_t> const& body) {
+        HttpCache& cache = ResponseCache();
+
+        if (status == 404 || status == 410) {
+            cache.Remove(url);
+            return;
+        }
+        if (status != 200) return;
+
+        HttpCache::Entry entry;
+        entry.Stamp = stamp;
+        entry.LastModified = headers.LastModified;
+        entry.FreshUntil = FreshUntil(headers);
+
+        // Responses that can neither be used as they are nor revalidated aren't worth keeping
+        const bool canRevalidate = !entry.Stamp.ETag.empty() || !entry.LastModified.empty();
+        if (entry.FreshUntil < 0 || (!canRevalidate && !entry.IsFresh())) {
+            cache.Remove(url);
+            return;
+        }
+
+        cache.Insert(url, entry, body);
+    }
+
+    vector<uint8_t> ReadEntireUrlBinary(string const& path, ResourceStamp* stamp, long* status) {
+        HttpCache& cache = ResponseCache();
+        HttpCache::Entry cached;
+        const bool isCached = cache.Lookup(path, cached);
+
+        // Fresh responses are used without asking the server
+        vector<uint8_t> body;
+        if (isCached && cached.IsFresh() && cache.ReadBody(path, cached, body)) {
+            if (stamp) *stamp = cached.Stamp;
+            if (status) *status = 200;
+            return body;
+        }
+
+        CURL* const curl_handle = ThreadHandle();
+
+        UrlDownload download{ curl_handle, { } };
+        ResponseHeaders headers;
+        HeaderList const conditions = isCached ? ConditionalHeaders(cached) : HeaderList();
+
+        curl_easy_setopt(curl_handle, CURLOPT_URL, path.c_str());
+        curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteVectorCallback);
+        curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void*)&download);
+        curl_easy_setopt(curl_handle, CURLOPT_FILETIME, 1L);
+        curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, ResponseHeaderCallback);
+        curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void*)&headers);
+        if (conditions) curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, conditions.get());
+
+        const long http_code = PerformControlled(curl_handle, [&download] { download.Data.clear(); });
+
+        if (http_code == 304 && isCached) {
+            if (cache.ReadBody(path, cached, body)) {
+                cache.Refresh(path, cached, std::max<int64_t>(FreshUntil(headers), 0));
+                if (stamp) *stamp = cached.Stamp;
+                if (status) *status = 200;
+                return body;
+            }
+
+            // The stored body went missing, ask again without conditions
+            cache.Remove(path);
+            return ReadEntireUrlBinary(path, stamp, status);
+        }
+
+        if (status) *status = http_code;
+
+        ResourceStamp received;
+        if (http_code == 200) {
+            ReadStampInfo(curl_handle, headers, received);
+            if (received.Size == 0) received.Size = download.Data.size();
+        }
+        UpdateResponseCache(path, http_code, headers, received, download.Data);
+
+        if (http_code != 200) return { };
+
+        if (stamp) *stamp = received;
+
+        return std::move(download.Data);
+    }
+
+    bool CheckUrlExistence(string const& path) {
+        HttpCache::Entry cached;
+        if (ResponseCache().Lookup(path, cached) && cached.IsFresh()) return true;
+
+        CURL* const curl_handle = ThreadHandle();
+
+        curl_easy_setopt(curl_handle, CURLOPT_URL, path.c_str());
+        curl_easy_setopt(curl_handle, CURLOPT_NOBODY, 1L);
+
+        const long http_code = PerformControlled(curl_handle, nullptr);
+
+        return http_code >= 200 && http_code < 300;
+    }
+
+    bool GetUrlStamp(string const& path, ResourceStamp& stamp) {
+        HttpCache& cache = ResponseCache();
+        HttpCache::Entry cached;
+        const bool isCached = cache.Lookup(path, cached);
+
+        if (isCached && cached.IsFresh()) {
+            stamp = cached.Stamp;
+            return true;
+        }
+
+        CURL* const curl_handle = ThreadHandle();
+
+        ResponseHeaders headers;
+        HeaderList const conditions = isCached ? ConditionalHeaders(cached) : HeaderList();
+
+        curl_easy_setopt(curl_handle, CURLOPT_URL, path.c_str());
+        curl_easy_setopt(curl_handle, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl_handle, CURLOPT_FILETIME, 1L);
+        curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, ResponseHeaderCallback);
+        curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void*)&headers);
+        if (conditions) curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, conditions.get());
+
+        const long http_code = PerformControlled(curl_handle, nullptr);
+
+        if (http_code == 304 && isCached) {
+            cache.Refresh(path, cached, std::max<int64_t>(FreshUntil(headers), 0));
+            stamp = cached.Stamp;
+            return true;
+        }
+
+        ReadStampInfo(curl_handle, headers, stamp);
+
+        return http_code >= 200 && http_code < 300;
+    }
+
+    vector<uint8_t> ReadUrlRange(string const& path, uint64_t offset, uint64_t length, ResourceStamp* stamp, long* status) {
+        if (length == 0) return { };
+
+        CURL* const curl_handle = ThreadHandle();
+
+        UrlDownload download{ curl_handle, { } };
+        ResponseHeaders headers;
+        const string range = std::to_string(offset) + "-" + std::to_string(offset + length - 1);
+
+        curl_easy_setopt(curl_handle, CURLOPT_URL, path.c_str());
+        curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteVectorCallback);
+        curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void*)&download);
+        curl_easy_setopt(curl_handle, CURLOPT_FILETIME, 1L);
+        curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, ResponseHeaderCallback);
+        curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void*)&headers);
+        curl_easy_setopt(curl_handle, CURLOPT_RANGE, range.c_str());
+
+        // A range of a compressed response would be a range of the compressed bytes
+        curl_easy_setopt(curl_handle, CURLOPT_ACCEPT_ENCODING, nullptr);
+
+        const long http_code = PerformControlled(curl_handle, [&download] { download.Data.clear(); });
+        if (status) *status = http_code;
+
+        if (http_code != 200 && http_code != 206) return { };
+
+        if (stamp) {
+            ReadStampInfo(curl_handle, headers, *stamp);
+            if (http_code == 206) stamp->Size = headers.TotalSize;
+            else if (stamp->Size == 0) stamp->Size = download.Data.size();
+        }
+
+        // The whole resource, cut down to the range
+        if (http_code == 200) {
+            if (offset >= download.Data.size()) return { };
+            download.Data.erase(download.Data.begin(), download.Data.begin() + offset);
+            if (download.Data.size() > length) download.Data.resize(length);
+        }
+
+        return std::move(download.Data);
+    }
+
+    struct Downloader::Transfer {
+        UrlDownload Download;
+        ResponseHeaders Headers;
+        HeaderList Conditions;
+        ConcurrencyController::Ticket Ticket;
+        std::chrono::steady_clock::time_point Started;
+
+        // shared with the hedge of this request, if there is one
+        std::shared_ptr<Downloader::Request> Source;
+        string Url;
+        bool IsHedge = false;
+        bool HedgeTried = false;
+
+        // the other copy of a hedged request while both are running
+        Transfer* Partner = nullptr;
+    };
+
+    void Downloader::Run() {
+        typedef std::chrono::steady_clock Clock;
+
+        CURLM* const multi = reinterpret_cast<CURLM*>(m_multi);
+
+        // Handles are kept between transfers, connections stay open in the multi handle's cache
+        vector<CURL*> idleHandles;
+        map<CURL*, std::unique_ptr<Transfer>> active;
+
+        // how long recent answered requests took, the hedge delay is their 95th percentile
+        std::deque<Clock::duration> recent;
+        int sinceEstimate = 0;
+
+        auto start = [&](std::unique_ptr<Transfer> transfer) {
+            CURL* handle;
+            if (idleHandles.empty()) {
+                handle = curl_easy_init();
+                htAssert(handle != nullptr);
+            } else {
+                handle = idleHandles.back();
+                idleHandles.pop_back();
+            }
+            SetupHandle(handle);
+
+            transfer->Download.Handle = handle;
+            transfer->Started = Clock::now();
+
+            curl_easy_setopt(handle, CURLOPT_URL, transfer->Url.c_str());
+            curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, WriteVectorCallback);
+            curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void*)&transfer->Download);
+            curl_easy_setopt(handle, CURLOPT_FILETIME, 1L);
+            curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, ResponseHeaderCallback);
+            curl_easy_setopt(handle, CURLOPT_HEADERDATA, (void*)&transfer->Headers);
+
+            // The hedge of a request has a body of its own
+            if (!transfer->IsHedge && transfer->Source->Stream) transfer->Download.Stream = &transfer->Source->Stream;
+
+            // Mirrors have their own ETags
+            if (transfer->Source->IsCached && transfer->Url == transfer->Source->Url) {
+                transfer->Conditions = ConditionalHeaders(transfer->Source->Cached);
+                if (transfer->Conditions) curl_easy_setopt(handle, CURLOPT_HTTPHEADER, transfer->Conditions.get());
+            }
+
+            curl_multi_add_handle(multi, handle);
+            active[handle] = std::move(transfer);
+        };
+
+        auto stop = [&](CURL* handle) {
+            curl_multi_remove_handle(multi, handle);
+            idleHandles.push_back(handle);
+        };
+
+        while (true) {
+            vector<std::unique_ptr<Transfer>> toStart;
+            bool waiting = false;
+            bool hedging;
+            Clock::duration hedgeDelay;
+            {
+                std::lock_guard<std::mutex> lock(m_mut);
+                if (m_stop) break;
+
+                while (!m_pending.empty()) {
+                    auto transfer = std::make_unique<Transfer>();
+                    if (!m_controller.TryAcquire(transfer->Ticket)) {
+                        waiting = true;
+                        break;
+                    }
+                    transfer->Source = std::make_shared<Request>(std::move(m_pending.front()));
+                    transfer->Url = transfer->Source->Url;
+                    ++transfer->Source->Attempts;
+                    m_pending.pop_front();
+                    ++m_started;
+                    toStart.push_back(std::move(transfer));
+                }
+
+                hedging = m_hedging && recent.size() >= MinHedgeSamples;
+                hedgeDelay = m_hedgeDelay;
+            }
+
+            for (std::unique_ptr<Transfer>& transfer : toStart) start(std::move(transfer));
+
+            int running = 0;
+            curl_multi_perform(multi, &running);
+
+            bool completedAny = false;
+            CURLMsg* msg;
+            int remaining = 0;
+            while ((msg = curl_multi_info_read(multi, &remaining))) {
+                if (msg->msg != CURLMSG_DONE) continue;
+
+                CURL* const handle = msg->easy_handle;
+                const CURLcode res = msg->data.result;
+
+                // Cancelled hedges may still have a message queued
+                auto found = active.find(handle);
+                if (found == active.end()) continue;
+                std::unique_ptr<Transfer> transfer = std::move(found->second);
+                active.erase(found);
+
+                if (res != CURLE_OK) {
+                    fprintf(stderr, "Download of %s failed: %s\n",
+                        transfer->Url.c_str(), curl_easy_strerror(res));
+                }
+
+                Result result;
+                result.Url = transfer->Source->Url;
+                curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &result.Status);
+
+                // A response that was cut off isn't an answer, and its body mustn't be used or cached
+                if (res != CURLE_OK) result.Status = 0;
+
+                m_controller.Release(transfer->Ticket, ReadOutcome(handle, result.Status));
+                stop(handle);
+                completedAny = true;
+
+                // Anything but a server error or throttling is the answer, for hedged requests whichever
+                // copy answers first is used and the other is cancelled
+                const bool answered = result.Status != 0 && result.Status < 500 && !ConcurrencyController::IsThrottled(result.Status);
+                if (Transfer* const partner = transfer->Partner) {
+                    partner->Partner = nullptr;
+
+                    // The other copy may still answer
+                    if (!answered) continue;
+
+                    CURL* const partnerHandle = partner->Download.Handle;
+                    m_controller.Abandon(partner->Ticket);
+                    stop(partnerHandle);
+                    active.erase(partnerHandle);
+
+                    if (transfer->IsHedge) {
+                        std::lock_guard<std::mutex> lock(m_mut);
+                        ++m_hedgesWon;
+                    }
+                }
+
+                if (answered) {
+                    recent.push_back(Clock::now() - transfer->Started);
+                    if (recent.size() > HedgeSamples) recent.pop_front();
+
+                    if (++sinceEstimate >= MinHedgeSamples / 2) {
+                        sinceEstimate = 0;
+                        vector<Clock::duration> sorted(recent.begin(), recent.end());
+                        auto const p95 = sorted.begin() + (sorted.size() * 95) / 100;
+                        std::nth_element(sorted.begin(), p95, sorted.end());
+
+                        std::lock_guard<std::mutex> lock(m_mut);
+                        m_hedgeDelay = std::max<Clock::duration>(*p95, MinHedgeDelay);
+                    }
+                }
+
+                if (ConcurrencyController::IsThrottled(result.Status) && transfer->Source->Attempts < ConcurrencyController::MaxAttempts) {
+                    // Goes first once the pause is over, it was asked for before anything still pending
+                    std::lock_guard<std::mutex> lock(m_mut);
+                    m_pending.push_front(std::move(*transfer->Source));
+                    continue;
+                }
+
+                // Reading and writing cached responses is small next to the time spent waiting on the server
+                HttpCache& cache = ResponseCache();
+                Request& source = *transfer->Source;
+                const bool fromMirror = transfer->Url != source.Url;
+                if (result.Status == 304 && source.IsCached && !fromMirror) {
+                    if (!cache.ReadBody(source.Url, source.Cached, result.Data)) {
+                        // The stored body went missing, ask again without conditions
+                        cache.Remove(source.Url);
+                        source.IsCached = false;
+
+                        std::lock_guard<std::mutex> lock(m_mut);
+                        m_pending.push_front(std::move(source));
+                        continue;
+                    }
+                    cache.Refresh(source.Url, source.Cached, std::max<int64_t>(FreshUntil(transfer->Headers), 0));
+                    result.Status = 200;
+                    result.Stamp = source.Cached.Stamp;
+                } else if (result.Status == 200) {
+                    ReadStampInfo(handle, transfer->Headers, result.Stamp);
+                    if (result.Stamp.Size == 0) result.Stamp.Size = transfer->Download.Data.size();
+                    if (fromMirror) {
+                        result.Stamp.ETag.clear();
+                    } else {
+                        UpdateResponseCache(source.Url, result.Status, transfer->Headers, result.Stamp, transfer->Download.Data);
+                    }
+                    result.Data = std::move(transfer->Download.Data);
+                    result.Streamed = transfer->Download.Streaming && !transfer->Download.StreamStopped;
+                } else if (!fromMirror) {
+                    UpdateResponseCache(source.Url, result.Status, transfer->Headers, result.Stamp, transfer->Download.Data);
+                }
+
+                transfer->Source->OnComplete(result);
+            }
+
+            // Requests running for longer than the hedge delay get a second copy, oldest first
+            // Hedges need room in the window too, and are only sent for a share of the requests
+            Clock::time_point const now = Clock::now();
+            Clock::time_point nextHedge = Clock::time_point::max();
+            if (hedging) {
+                vector<Transfer*> candidates;
+                for (auto& [handle, transfer] : active) {
+                    if (transfer->IsHedge || transfer->HedgeTried) continue;
+                    if (now - transfer->Started < hedgeDelay) {
+                        nextHedge = std::min(nextHedge, transfer->Started + hedgeDelay);
+                    } else {
+                        candidates.push_back(transfer.get());
+                    }
+                }
+                std::sort(candidates.begin(), candidates.end(), [](Transfer* a, Transfer* b) { return a->Started < b->Started; });
+
+                for (Transfer* original : candidates) {
+                    {
+                        std::lock_guard<std::mutex> lock(m_mut);
+                        if (m_hedged * HedgeRatio >= m_started) break;
+                    }
+
+                    auto hedge = std::make_unique<Transfer>();
+                    if (!m_controller.TryAcquire(hedge->Ticket)) break;
+
+                    hedge->Source = original->Source;
+                    hedge->Url = original->Source->MirrorUrl.empty() ? original->Source->Url : original->Source->MirrorUrl;
+                    hedge->IsHedge = true;
+                    hedge->Partner = original;
+                    original->Partner = hedge.get();
+                    original->HedgeTried = true;
+                    {
+                        std::lock_guard<std::mutex> lock(m_mut);
+                        ++m_hedged;
+                    }
+                    start(std::move(hedge));
+                }
+            }
+
+            // Completed transfers free up room for pending requests, which are started right away
+            // Otherwise this waits for network activity, or is woken early by Enqueue
+            // Room freed by requests made outside the downloader doesn't wake it, so it checks back soon
+            if (!completedAny) {
+                int64_t timeoutMs = 1000;
+                if (waiting) {
+                    const auto pause = std::chrono::duration_cast<std::chrono::milliseconds>(m_controller.PauseRemaining()).count();
+                    timeoutMs = std::clamp<int64_t>(pause, 10, 1000);
+                }
+                if (nextHedge != Clock::time_point::max()) {
+                    const auto untilHedge = std::chrono::duration_cast<std::chrono::milliseconds>(nextHedge - now).count() + 1;
+                    timeoutMs = std::clamp<int64_t>(untilHedge, 1, timeoutMs);
+                }
+                curl_multi_poll(multi, nullptr, 0, static_cast<int>(timeoutMs), nullptr);
+            }
+        }
+
+        // Nothing may be left waiting on a request that will never finish, hedged requests complete once
+        for (auto& [handle, transfer] : active) {
+            curl_multi_remove_handle(multi, handle);
+            curl_easy_cleanup(handle);
+            m_controller.Abandon(transfer->Ticket);
+
+            if (transfer->IsHedge && transfer->Partner) continue;
+
+            Result result;
+            result.Url = transfer->Source->Url;
+            transfer->Source->OnComplete(result);
+        }
+
+        std::deque<Request> pending;
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            std::swap(pending, m_pending);
+        }
+        for (Request& request : pending) {
+            Result result;
+            result.Url = request.Url;
+            request.OnComplete(result);
+        }
+
+        for (CURL* handle : idleHandles) curl_easy_cleanup(handle);
+    }
+
+    void Downloader::Enqueue(string const& url, CompletionFunc const& onComplete, string const& mirrorUrl, StreamFunc const& stream) {
+        Request request;
+        request.Url = url;
+        request.MirrorUrl = mirrorUrl;
+        request.OnComplete = onComplete;
+        request.Stream = stream;
+
+        // Fresh responses complete right away without asking the server
+        HttpCache& cache = ResponseCache();
+        request.IsCached = cache.Lookup(url, request.Cached);
+        if (request.IsCached && request.Cached.IsFresh()) {
+            Result result;
+            result.Url = url;
+            if (cache.ReadBody(url, request.Cached, result.Data)) {
+                result.Status = 200;
+                result.Stamp = request.Cached.Stamp;
+                onComplete(result);
+                return;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            m_pending.push_back(std::move(request));
+        }
+        curl_multi_wakeup(reinterpret_cast<CURLM*>(m_multi));
+    }
+
+    void Downloader::SetHedging(bool hedging) {
+        std::lock_guard<std::mutex> lock(m_mut);
+        m_hedging = hedging;
+    }
+
+    json Downloader::Status() {
+        std::lock_guard<std::mutex> lock(m_mut);
+        return {
+            {"hedging", json(m_hedging)},
+            {"hedgeDelayMicros", json(std::chrono::duration_cast<std::chrono::microseconds>(m_hedgeDelay).count())},
+            {"started", json(m_started)},
+            {"hedged", json(m_hedged)},
+            {"hedgesWon", json(m_hedgesWon)}
+        };
+    }
+
+    Downloader::Downloader(ConcurrencyController& controller)
+    : m_controller(controller)
+    , m_stop(false)
+    , m_hedging(true)
+    , m_hedgeDelay(MinHedgeDelay)
+    , m_started(0)
+    , m_hedged(0)
+    , m_hedgesWon(0)
+    , m_multi(nullptr)
+    {
+        CurlShare::Get();
+        m_multi = curl_multi_init();
+        htAssert(m_multi != nullptr);
+        m_thread = std::thread([this] { Run(); });
+    }
+
+    Downloader::~Downloader() {
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            m_stop = true;
+        }
+        curl_multi_wakeup(reinterpret_cast<CURLM*>(m_multi));
+        m_thread.join();
+        curl_multi_cleanup(reinterpret_cast<CURLM*>(m_multi));
+    }
+}
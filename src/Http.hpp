@@ -0,0 +1,143 @@
+#pragma once
+
+#include "Util.hpp"
+#include "ConcurrencyController.hpp"
+#include "HttpCache.hpp"
+
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+namespace HyperTiler {
+    // Each thread reuses one libcurl handle for all of its requests, so connections to a server are
+    // kept alive between tiles. DNS results and TLS sessions are shared between all threads, so a new
+    // connection skips the lookup and resumes the TLS session instead of doing a full handshake.
+    // Every request waits for room in the RemoteConcurrency window, and throttled requests are retried
+    // once the pause the server asked for has passed.
+    // Responses are kept in the ResponseCache when it is enabled, requests for a stored response are
+    // conditional and fresh responses are used without a request at all.
+
+    // Shared by all requests to remote sources
+    ConcurrencyController& RemoteConcurrency();
+    HttpCache& ResponseCache();
+
+    // Limits every request to a remote source is held to, 0 disables a limit
+    struct RequestDeadlines {
+        long ConnectTimeoutMs = 10000;
+        long TimeoutMs = 60000;
+
+        // Requests transferring less than LowSpeedLimit bytes per second for LowSpeedTime seconds are aborted
+        long LowSpeedLimit = 1024;
+        long LowSpeedTime = 10;
+    };
+
+    // Applies to requests started after the call
+    void SetRequestDeadlines(RequestDeadlines const& deadlines);
+
+    // status receives the HTTP response code, or 0 if no response was received
+    vector<uint8_t> ReadEntireUrlBinary(string const& path, ResourceStamp* stamp = nullptr, long* status = nullptr);
+    bool            CheckUrlExistence(string const& path);
+    string          ReadEntireUrlText(string const& path);
+
+    // return false if the resource doesn't exist
+    bool GetUrlStamp(string const& path, ResourceStamp& stamp);
+
+    // Reads length bytes starting at offset, fewer if the resource ends first, without the ResponseCache
+    // The stamp describes the whole resource, status is 206 or 200 if the server ignored the range
+    vector<uint8_t> ReadUrlRange(string const& path, uint64_t offset, uint64_t length, ResourceStamp* stamp = nullptr, long* status = nullptr);
+
+    // Keeps many transfers going at once from its own thread with curl_multi, so the time spent waiting
+    // on the server overlaps between requests, as many as the controller allows. Completed transfers
+    // are passed to the callback of their request on the downloader thread, which should hand them off
+    // to be processed elsewhere.
+    // A request still running after most requests (the 95th percentile) have completed is hedged: a
+    // second copy is sent, to a mirror if the request has one, and whichever answers first is used.
+    // A request can also have its body streamed to a callback as it arrives, so it can be processed
+    // while the rest is still on its way.
+    class Downloader {
+    public:
+        struct Result {
+            string Url;
+
+            // empty unless the server responded with 200
+            vector<uint8_t> Data;
+            ResourceStamp Stamp;
+
+            // HTTP response code, or 0 if no response was received or it was cut off
+            long Status = 0;
+
+            // the whole body was passed to the stream of the request as it arrived, and is in Data as well
+            bool Streamed = false;
+        };
+
+        typedef std::function<void(Result&)> CompletionFunc;
+
+        // Called on the downloader thread with each part of the body of a successful response
+        // Returning false stops the stream, the body is still downloaded
+        typedef std::function<bool(uint8_t const* data, size_t size)> StreamFunc;
+
+    private:
+        struct Request {
+            string Url;
+            string MirrorUrl;
+            CompletionFunc OnComplete;
+            StreamFunc Stream;
+            int Attempts = 0;
+
+            // the stored response of the url, sent as conditions of the request
+            bool IsCached = false;
+            HttpCache::Entry Cached;
+        };
+
+        // owned by the downloader thread while it runs
+        struct Transfer;
+
+        std::mutex m_mut;
+        std::deque<Request> m_pending;
+        ConcurrencyController& m_controller;
+        bool m_stop;
+        bool m_hedging;
+
+        // written by the downloader thread, read by Status
+        std::chrono::steady_clock::duration m_hedgeDelay;
+        uint64_t m_started;
+        uint64_t m_hedged;
+        uint64_t m_hedgesWon;
+
+        // CURLM, created before the thread starts
+        void* m_multi;
+        std::thread m_thread;
+
+        void Run();
+    public:
+        // Hedging starts once enough requests have completed to know how long they usually take, and is
+        // held to one hedge for every HedgeRatio requests so a slow server isn't sent twice the load
+        static constexpr int HedgeSamples = 256;
+        static constexpr int MinHedgeSamples = 20;
+        static constexpr int HedgeRatio = 10;
+
+        // Requests faster than this aren't worth hedging
+        static constexpr std::chrono::milliseconds MinHedgeDelay = std::chrono::milliseconds(20);
+
+        // Requests are started in the order they were enqueued, a response fresh in the ResponseCache
+        // completes on the calling thread before this returns
+        // mirrorUrl serves the same resource as url and is only used for hedging, the result has the stamp
+        // of whichever answered, without the ETag if that was the mirror since ETags differ between servers
+        // Only the first copy of a request is streamed, results from the cache or a hedge aren't
+        void Enqueue(string const& url, CompletionFunc const& onComplete, string const& mirrorUrl = "", StreamFunc const& stream = nullptr);
+
+        void SetHedging(bool hedging);
+
+        json Status();
+
+        // Requests that haven't completed when the downloader is destroyed complete without a response
+        Downloader(ConcurrencyController& controller);
+        ~Downloader();
+    private:
+        Downloader(Downloader const& other) = delete;
+        Downloader& operator=(Downloader const& other) = delete;
+    };
+}
@@ -0,0 +1,284 @@
+#include "HttpCache.hpp"
+
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+namespace HyperTiler {
+    static int64_t SecondsSinceEpoch() {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Threads writing the same response don't share a temporary file
+    static path TempPath(path const& file) {
+        return path(file).concat("." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp");
+    }
+
+    // Read to the end of the open file rather than sized from the path, which may be renamed over in between
+    static json readMetadata(path const& metadataPath) {
+        std::ifstream f(metadataPath, std::ios::binary);
+        return json::parse(string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()));
+    }
+
+    bool HttpCache::Entry::IsFresh() const {
+        return SecondsSinceEpoch() < FreshUntil;
+    }
+
+    path HttpCache::MetadataPath(string const& url) const {
+        return m_directory / (HashToString(HashString(url)) + ".json");
+    }
+    path HttpCache::BodyPath(string const& url, uint64_t version) const {
+        if (version == 0) return m_directory / (HashToString(HashString(url)) + ".body");
+        return m_directory / (HashToString(HashString(url)) + "." + HashToString(version) + ".body");
+    }
+
+    // The version in the name of a body file, and the metadata file next to it
+    static uint64_t VersionOfBody(path const& body, path& metadataPath) {
+        const string stem = body.stem().string();
+        const size_t dot = stem.find('.');
+        metadataPath = body.parent_path() / (stem.substr(0, dot) + ".json");
+        if (dot == string::npos) return 0;
+        try {
+            return std::stoull(stem.substr(dot + 1), nullptr, 16);
+        } catch (std::exception const&) {
+            return 0;
+        }
+    }
+
+    bool HttpCache::StoredVersion(path const& metadataPath, uint64_t& version) {
+        if (!FileExists(metadataPath)) return false;
+        try {
+            version = readMetadata(metadataPath).value("Version", uint64_t(0));
+        } catch (std::exception const&) {
+            return false;
+        }
+        return true;
+    }
+
+    void HttpCache::CollectGarbage() {
+        m_writtenSinceCollection = 0;
+
+        std::error_code ec;
+        if (!std::filesystem::is_directory(m_directory, ec)) return;
+
+        // Bodies are touched whenever they are used, so their modification time orders them by use
+        struct Stored {
+            std::filesystem::file_time_type LastUsed;
+            uint64_t Size;
+            path Body;
+        };
+        vector<Stored> stored;
+        uint64_t totalSize = 0;
+        auto const now = std::filesystem::file_time_type::clock::now();
+        for (auto const& file : std::filesystem::directory_iterator(m_directory, ec)) {
+            // Left behind by writes that were interrupted
+            if (file.path().extension() == ".tmp") {
+                if (now - file.last_write_time(ec) > std::chrono::hours(1)) std::filesystem::remove(file.path(), ec);
+                continue;
+            }
+            if (file.path().extension() != ".body") continue;
+            Stored body{ file.last_write_time(ec), file.file_size(ec), file.path() };
+            if (ec) continue;
+            totalSize += body.Size;
+            stored.push_back(body);
+        }
+        if (totalSize <= m_maxSize) return;
+
+        std::sort(stored.begin(), stored.end(), [](Stored const& a, Stored const& b) { return a.LastUsed < b.LastUsed; });
+        for (Stored const& body : stored) {
+            if (totalSize <= m_maxSize) break;
+            totalSize -= body.Size;
+            std::filesystem::remove(body.Body, ec);
+
+            // Bodies replaced by an insert that was interrupted aren't described by the metadata
+            path metadataPath;
+            const uint64_t version = VersionOfBody(body.Body, metadataPath);
+            uint64_t stored;
+            if (StoredVersion(metadataPath, stored) && stored == version) std::filesystem::remove(metadataPath, ec);
+        }
+    }
+
+    void HttpCache::Configure(bool enabled, path const& directory, uint64_t maxSize, int64_t defaultMaxAge) {
+        std::lock_guard<std::mutex> lock(m_mut);
+
+        m_enabled = enabled;
+        m_directory = directory;
+        m_maxSize = maxSize;
+        m_defaultMaxAge = defaultMaxAge;
+        if (!m_enabled) return;
+
+        std::error_code ec;
+        std::filesystem::create_directories(m_directory, ec);
+        CollectGarbage();
+    }
+
+    bool HttpCache::Enabled() {
+        std::lock_guard<std::mutex> lock(m_mut);
+        return m_enabled;
+    }
+
+    int64_t HttpCache::DefaultMaxAge() {
+        std::lock_guard<std::mutex> lock(m_mut);
+        return m_defaultMaxAge;
+    }
+
+    bool HttpCache::Lookup(string const& url, Entry& entry) {
+        path metadataPath;
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            if (!m_enabled) return false;
+            metadataPath = MetadataPath(url);
+        }
+        if (!FileExists(metadataPath)) return false;
+
+        try {
+            json const j = readMetadata(metadataPath);
+
+            // Different urls with the same hash share a name
+            if (j.at("Url").get<string>() != url) return false;
+
+            entry.Stamp.Size = j.at("SourceSize").get<uint64_t>();
+            entry.Stamp.ModifiedTime = j.at("SourceModifiedTime").get<int64_t>();
+            entry.Stamp.ETag = j.at("ETag").get<string>();
+            entry.LastModified = j.at("LastModified").get<string>();
+            entry.FreshUntil = j.at("FreshUntil").get<int64_t>();
+            entry.Version = j.value("Version", uint64_t(0));
+        } catch (std::exception const& ex) {
+            std::cout << "Cached response of " << url << " is unreadable: " << ex.what() << "\n";
+            return false;
+        }
+
+        return true;
+    }
+
+    bool HttpCache::ReadBody(string const& url, Entry const& entry, vector<uint8_t>& body) {
+        path bodyPath;
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            if (!m_enabled) return false;
+            bodyPath = BodyPath(url, entry.Version);
+        }
+        if (!FileExists(bodyPath)) return false;
+
+        try {
+            body = ReadEntireFileBinary(bodyPath);
+        } catch (std::exception const&) {
+            return false;
+        }
+
+        // Compressed responses are stored decoded, so only an empty body is known to be wrong
+        if (body.empty() && entry.Stamp.Size != 0) return false;
+
+        std::error_code ec;
+        std::filesystem::last_write_time(bodyPath, std::filesystem::file_time_type::clock::now(), ec);
+        return true;
+    }
+
+    void HttpCache::Insert(string const& url, Entry const& entry, vector<uint8_t> const& body) {
+        path metadataPath, bodyPath;
+        uint64_t version;
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            if (!m_enabled) return;
+            version = m_nextVersion++;
+            metadataPath = MetadataPath(url);
+            bodyPath = BodyPath(url, version);
+        }
+
+        const json metadata = {
+            {"Url", url},
+            {"SourceSize", entry.Stamp.Size},
+            {"SourceModifiedTime", entry.Stamp.ModifiedTime},
+            {"ETag", entry.Stamp.ETag},
+            {"LastModified", entry.LastModified},
+            {"FreshUntil", entry.FreshUntil},
+            {"Version", version}
+        };
+
+        // Written next to the final names then renamed over them, so readers never see half a file
+        // The body has a name of its own, replacing the metadata is what makes it the stored response
+        path const bodyTemp = TempPath(bodyPath);
+        path const metadataTemp = TempPath(metadataPath);
+        try {
+            WriteEntireFileBinary(bodyTemp, body);
+            WriteEntireFileText(metadataTemp, metadata.dump());
+            std::filesystem::rename(bodyTemp, bodyPath);
+        } catch (std::exception const& ex) {
+            std::cout << "Failed to cache response of " << url << ": " << ex.what() << "\n";
+            std::error_code ec;
+            std::filesystem::remove(bodyTemp, ec);
+            std::filesystem::remove(metadataTemp, ec);
+            return;
+        }
+
+        // Swapped under the lock, so inserts of the same url each remove the body they replaced
+        std::lock_guard<std::mutex> lock(m_mut);
+        std::error_code ec;
+        uint64_t replaced;
+        const bool hadBody = StoredVersion(metadataPath, replaced);
+        std::filesystem::rename(metadataTemp, metadataPath, ec);
+        if (ec) {
+            std::cout << "Failed to cache response of " << url << ": " << ec.message() << "\n";
+            std::filesystem::remove(metadataTemp, ec);
+            std::filesystem::remove(bodyPath, ec);
+            return;
+        }
+        if (hadBody && replaced != version) std::filesystem::remove(BodyPath(url, replaced), ec);
+
+        m_writtenSinceCollection += body.size();
+        if (m_writtenSinceCollection > m_maxSize / CollectionInterval) CollectGarbage();
+    }
+
+    void HttpCache::Refresh(string const& url, Entry& entry, int64_t freshUntil) {
+        path metadataPath;
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            if (!m_enabled) return;
+            metadataPath = MetadataPath(url);
+        }
+
+        entry.FreshUntil = freshUntil;
+
+        try {
+            json metadata = readMetadata(metadataPath);
+            if (metadata.value("Version", uint64_t(0)) != entry.Version) return;
+            metadata["FreshUntil"] = freshUntil;
+
+            path const metadataTemp = TempPath(metadataPath);
+            WriteEntireFileText(metadataTemp, metadata.dump());
+
+            // Not swapped in if an insert replaced the response meanwhile
+            std::lock_guard<std::mutex> lock(m_mut);
+            uint64_t stored;
+            if (StoredVersion(metadataPath, stored) && stored == entry.Version) std::filesystem::rename(metadataTemp, metadataPath);
+            else std::filesystem::remove(metadataTemp);
+        } catch (std::exception const&) {
+            // Only costs a conditional request next time
+        }
+    }
+
+    void HttpCache::Remove(string const& url) {
+        std::lock_guard<std::mutex> lock(m_mut);
+        if (!m_enabled) return;
+
+        path const metadataPath = MetadataPath(url);
+        uint64_t version;
+        if (!StoredVersion(metadataPath, version)) return;
+
+        std::error_code ec;
+        std::filesystem::remove(metadataPath, ec);
+        std::filesystem::remove(BodyPath(url, version), ec);
+    }
+
+    HttpCache::HttpCache()
+    : m_enabled(false)
+    , m_directory()
+    , m_maxSize(0)
+    , m_defaultMaxAge(0)
+    , m_writtenSinceCollection(0)
+    , m_nextVersion(static_cast<uint64_t>(std::chrono::system_clock::now().time_since_epoch().count()) | 1)
+    { }
+}
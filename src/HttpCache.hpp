@@ -0,0 +1,79 @@
+#pragma once
+
+#include "Util.hpp"
+
+#include <mutex>
+
+namespace HyperTiler {
+    // Bodies of responses from remote sources, kept on the filesystem along with what is needed to
+    // revalidate them. Later requests for the same url are sent as conditional requests and answered
+    // from here when the server replies 304, or don't reach the server at all while the response is
+    // still fresh. Each response is stored as a body file and a small metadata file named by the hash of
+    // its url, and the least recently used ones are removed beyond the size limit. Every body that is
+    // stored gets a new version in its name, which the metadata records, so replacing the metadata swaps
+    // both at once and a reader never pairs a body with the validators of another. Thread safe.
+    class HttpCache {
+    public:
+        struct Entry {
+            ResourceStamp Stamp;
+
+            // as sent by the server, for If-Modified-Since
+            string LastModified;
+
+            // seconds since epoch, the response may be used without asking the server until then
+            int64_t FreshUntil = 0;
+
+            // the stored body the entry describes, set by Lookup, 0 for bodies stored before they had versions
+            uint64_t Version = 0;
+
+            bool IsFresh() const;
+        };
+
+    private:
+        std::mutex m_mut;
+        bool m_enabled;
+        path m_directory;
+        uint64_t m_maxSize;
+        int64_t m_defaultMaxAge;
+        uint64_t m_writtenSinceCollection;
+        uint64_t m_nextVersion;
+
+        path MetadataPath(string const& url) const;
+        path BodyPath(string const& url, uint64_t version) const;
+
+        // The version of the body the metadata describes, false if there is no readable metadata
+        static bool StoredVersion(path const& metadataPath, uint64_t& version);
+
+        // Removes the least recently used responses until the cache fits, the lock must be held
+        void CollectGarbage();
+    public:
+        // A response is collected after at most this fraction of the size limit has been written since the last collection
+        static constexpr uint64_t CollectionInterval = 8;
+
+        void Configure(bool enabled, path const& directory, uint64_t maxSize, int64_t defaultMaxAge);
+
+        bool Enabled();
+
+        // How long a response without caching headers stays fresh
+        int64_t DefaultMaxAge();
+
+        // Returns false if there is no stored response for the url
+        bool Lookup(string const& url, Entry& entry);
+
+        // Returns false if the body is gone or doesn't match the entry, counts as a use of the response
+        bool ReadBody(string const& url, Entry const& entry, vector<uint8_t>& body);
+
+        void Insert(string const& url, Entry const& entry, vector<uint8_t> const& body);
+
+        // Records that the server confirmed the stored response is still current, unless it has been
+        // replaced since the entry was looked up
+        void Refresh(string const& url, Entry& entry, int64_t freshUntil);
+
+        void Remove(string const& url);
+
+        HttpCache();
+    private:
+        HttpCache(HttpCache const& other) = delete;
+        HttpCache& operator=(HttpCache const& other) = delete;
+    };
+}
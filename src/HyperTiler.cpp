@@ -1,7 +1,13 @@
 #include "TileUtils.hpp"
 #include "TileConversion.hpp"
+#include "ElevationCodec.hpp"
+#include "PixelFormat.hpp"
+#include "Preview.hpp"
 
+#include <bit>
 #include <string>
+#include <fstream>
+#include <cmath>
 #include "jsonUtils.hpp"
 #include "Config.hpp"
 
@@ -31,6 +37,12 @@ std::thread ConversionThread;
 std::mutex Mut;
 vector<Log> Logs;
 
+// Shared by previews, existence checks and conversions, conversions resize it to their own budget
+TileService Tiles(ConversionOptimizationConfig(), 256ull * 1024ull * 1024ull);
+
+// Previews most recently sent, a client that asks again with their tag gets 304 without them being rendered
+PreviewRenderer Previews(64ull * 1024ull * 1024ull);
+
 #ifdef _WIN32
 BOOL WINAPI CtrlHandler(DWORD fdwCtrlType) {
     bool shouldShutdown = false;
@@ -130,7 +142,7 @@ void HandleWebRequests() {
                 CurrentConfig = state;
                 Running = true;
                 ConversionThread = std::thread([] {
-                    Convert(CurrentConfig, AddLogItem, Running);
+                    Convert(CurrentConfig, Tiles, AddLogItem, Running);
                 });
                 return json("Begun");
             }
@@ -163,7 +175,8 @@ void HandleWebRequests() {
 
             return json {
                 {"time", std::chrono::duration_cast<std::chrono::microseconds>(lockTIme - ProgramStart).count()},
-                {"logs", ar}
+                {"logs", ar},
+                {"downloads", Tiles.DownloadStatus()}
             };
         }
     );
@@ -180,7 +193,47 @@ void HandleWebRequests() {
                 js::LoadNamed(j, er, 0, "coord", state.coord);
             },
             [](CheckExistenceStruct const& state) -> json {
-                return TileExists(state.formatStr, state.coord);
+                return Tiles.Exists(state.formatStr, state.coord);
+            }
+        );
+    }
+
+    {
+        struct ManifestStruct {
+            string formatStr;
+            ivec3 beginCoord;
+            ivec3 endCoord;
+        };
+
+        // One line of json per level as it is finished, with the tiles that exist as pairs of start and length
+        // counted from beginCoord, x fastest, then a line with the total count
+        AddStreamPost<ManifestStruct>(svr, "/api/manifest", "application/x-ndjson",
+            [](json const& j, js::ErrorStack& er, ManifestStruct& state) {
+                js::LoadNamed(j, er, 0, "formatStr", state.formatStr);
+                js::LoadNamed(j, er, 0, "beginCoord", state.beginCoord);
+                js::LoadNamed(j, er, 0, "endCoord", state.endCoord);
+                if (!er.empty()) return;
+
+                if (TileManifest::Volume(state.beginCoord, state.endCoord) == 0) {
+                    er.emplace_back(0, "Manifest range must be non empty and have at most " + std::to_string(TileManifest::MaxTiles) + " tiles");
+                }
+                try {
+                    FormatTileString(state.formatStr, state.beginCoord);
+                } catch (std::runtime_error const& ex) {
+                    er.emplace_back(0, ex.what());
+                }
+            },
+            [](ManifestStruct const& state, StreamWriteFunc const& write) {
+                try {
+                    std::shared_ptr<TileManifest const> const manifest = Tiles.Manifest(state.formatStr, state.beginCoord, state.endCoord,
+                        [&write](int z, TileManifest const& manifest) {
+                            return write(json({ { "z", z }, { "ranges", manifest.Ranges(z) } }).dump() + "\n");
+                        }
+                    );
+                    if (manifest) write(json({ { "count", manifest->Count() } }).dump() + "\n");
+                } catch (std::exception const& ex) {
+                    write(json({ { "error", ex.what() } }).dump() + "\n");
+                }
             }
         );
     }
@@ -191,48 +244,44 @@ void HandleWebRequests() {
             ivec3 coord;
             float minVal;
             float maxVal;
+
+            // Loaded to tag the preview and kept to render it
+            TileService::Handle tile;
         };
         
-        AddDataPost<GenPreviewStruct>(svr, "/api/preview", "image/png",
+        // Tagged with the dataset, tile, range and the stamp of the tile's source, so a client only gets a
+        // preview again once one of them changes. Tiles whose source has nothing that tells versions apart
+        // aren't tagged, and are rendered for every request.
+        AddCachedDataRoute<GenPreviewStruct>(svr, "/api/preview", "image/png",
             [](json const& j, js::ErrorStack& er, GenPreviewStruct& state) {
                 js::LoadNamed(j, er, 0, "Conf", state.Conf);
                 js::LoadNamed(j, er, 0, "coord", state.coord);
                 js::LoadNamed(j, er, 0, "minVal", state.minVal);
                 js::LoadNamed(j, er, 0, "maxVal", state.maxVal);
             },
-            [](GenPreviewStruct const& state) -> vector<uint8_t> {
-                ImageData data = LoadTileData(state.Conf, state.coord);
-
-                if (data.numChannels != 1 || data.bitDepth != 16) return { };
-
-                // Generate an 8 bit 3 channel PNG with scalar colors
-                vector<uint8_t> res;
-                res.resize(data.width * data.height * 3);
-                for (int y = 0; y < data.height; ++y) {
-                    for (int x = 0; x < data.width; ++x) {
-                        const size_t flatIndex = y * data.width + x;
-                        uint16_t val = *reinterpret_cast<uint16_t*>(&data.data[flatIndex * (data.bitDepth / 8) * data.numChannels]);
-                        
-                        float scalar = (val - state.minVal) / (state.maxVal - state.minVal);
-
-                        uvec3 colorized = ToRGBU8(ColorMap(scalar));
-
-                        res[flatIndex * 3 + 0] = static_cast<uint8_t>(colorized.x);
-                        res[flatIndex * 3 + 1] = static_cast<uint8_t>(colorized.y);
-                        res[flatIndex * 3 + 2] = static_cast<uint8_t>(colorized.z);
-                    }
-                }
-
-                data.data = res;
-                data.bitDepth = 8;
-                data.numChannels = 3;
+            [](GenPreviewStruct& state) -> string {
+                if (state.Conf.Channels != 1 || state.Conf.Encoding.BitDepth != 16) return { };
+
+                DatasetCache::Dataset const& dataset = Tiles.AddDataset(state.Conf);
+                state.tile = Tiles.Load(dataset, state.coord);
+                if (!state.tile) return { };
+
+                ResourceStamp const& stamp = state.tile.Stamp();
+                if (!stamp.IdentifiesVersion()) return { };
+
+                const string key = DatasetCache::IndexKey(dataset, state.coord)
+                    + "|" + std::to_string(std::bit_cast<uint32_t>(state.minVal))
+                    + "|" + std::to_string(std::bit_cast<uint32_t>(state.maxVal))
+                    + "|" + std::to_string(stamp.Size)
+                    + "|" + std::to_string(stamp.ModifiedTime)
+                    + "|" + stamp.ETag;
+                return "\"" + HashToString(HashString(key)) + "\"";
+            },
+            [](GenPreviewStruct& state, string const& tag) -> PreviewRenderer::Png {
+                if (!state.tile) return nullptr;
 
-                vector<uint8_t> pres;
-                if(WritePng(pres, data)) {
-                    return pres;
-                } else {
-                    return { };
-                }
+                return Previews.Render(tag, reinterpret_cast<uint16_t const*>(state.tile.Data()), state.Conf.Size.x, state.Conf.Size.y,
+                    state.tile.NeedsSwap(), state.minVal, state.maxVal);
             }
         );
     }
@@ -249,7 +298,61 @@ void HandleWebRequests() {
     svr.listen("127.0.0.1", 5000);
 }
 
-int main(int /*argc*/, char** /*argv*/) {
+// Reads the tile given to a benchmark, a raw tile of 16 bit samples in the byte order of this machine,
+// or makes smooth synthetic terrain without one
+bool LoadBenchmarkTile(int argc, char** argv, vector<uint16_t>& samples, int& width, int& height) {
+    width = 512;
+    height = 512;
+
+    if (argc >= 5) {
+        width = std::atoi(argv[3]);
+        height = std::atoi(argv[4]);
+        if (width <= 0 || height <= 0) {
+            std::cout << "Usage: " << argv[1] << " [tile.raw width height]\n";
+            return false;
+        }
+
+        samples.resize(static_cast<size_t>(width) * height);
+        std::ifstream file(argv[2], std::ios::binary);
+        if (!file.read(reinterpret_cast<char*>(samples.data()), samples.size() * sizeof(uint16_t))) {
+            std::cout << "Failed to read " << width << "x" << height << " samples from " << argv[2] << "\n";
+            return false;
+        }
+    } else {
+        samples.resize(static_cast<size_t>(width) * height);
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                const double h = 20000.0
+                    + 6000.0 * std::sin(x * 0.011) * std::cos(y * 0.013)
+                    + 1500.0 * std::sin(x * 0.047 + y * 0.031)
+                    + 300.0 * std::sin(x * 0.21) * std::sin(y * 0.17);
+                samples[static_cast<size_t>(y) * width + x] = static_cast<uint16_t>(h);
+            }
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+    // Encode one tile with each PNG setting, with PNG and the elevation codec, or render a preview of it, then print how fast and how small each was
+    if (argc >= 2 && (string(argv[1]) == "--bench-png" || string(argv[1]) == "--bench-elevation" || string(argv[1]) == "--bench-preview")) {
+        vector<uint16_t> samples;
+        int width, height;
+        if (!LoadBenchmarkTile(argc, argv, samples, width, height)) return 1;
+
+        if (string(argv[1]) == "--bench-png") BenchmarkPngEncoding(samples.data(), width, height, std::cout);
+        else if (string(argv[1]) == "--bench-preview") BenchmarkPreview(samples.data(), width, height, std::cout);
+        else BenchmarkElevationCodec(samples.data(), width, height, std::cout);
+        return 0;
+    }
+
+    // Swap, widen, narrow and change the gamma of a buffer of samples with and without SIMD
+    if (argc >= 2 && string(argv[1]) == "--bench-pixels") {
+        BenchmarkPixelConversion(std::cout);
+        return 0;
+    }
+
     string str = ((json)DatasetConfig()).dump();
 
     std::cout << str << "\n";
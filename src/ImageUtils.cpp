@@ -1,11 +1,18 @@
 #include "ImageUtils.hpp"
 
 #include <png.h>
+#include <zlib.h>
+
+#include <bit>
+#include <atomic>
+#include <ostream>
+#include <thread>
 
 namespace HyperTiler {
     struct pngMemoryReader {
         uint8_t const* dataStart;
         uint64_t currentPos;
+        uint64_t size;
     };
 
     void pngReadFunc(png_structp png_ptr, png_bytep outBytes, png_size_t byteCountToRead) {
@@ -13,6 +20,7 @@ namespace HyperTiler {
         htAssert(io_ptr);
 
         pngMemoryReader& status = *reinterpret_cast<pngMemoryReader*>(io_ptr);
+        if (byteCountToRead > status.size - status.currentPos) png_error(png_ptr, "read past the end of the image");
 
         memcpy(outBytes, status.dataStart + status.currentPos, byteCountToRead);
 
@@ -43,7 +51,7 @@ namespace HyperTiler {
             return ImageData();
         }
 
-        pngMemoryReader memoryReader{ data.data(), 8 };
+        pngMemoryReader memoryReader{ data.data(), 8, data.size() };
 
         png_set_read_fn(png_ptr, &memoryReader, pngReadFunc);
         png_set_sig_bytes(png_ptr, 8);
@@ -56,7 +64,7 @@ namespace HyperTiler {
 
         ImageData res;
 
-        png_set_interlace_handling(png_ptr);
+        const int passes = png_set_interlace_handling(png_ptr);
         if (expand) png_set_expand(png_ptr);
         png_read_update_info(png_ptr, info_ptr);
 
@@ -78,64 +86,528 @@ namespace HyperTiler {
             return ImageData();
         }
 
-        res.data.resize(res.width * res.height * res.numChannels * res.bitDepth / 8);
+        const size_t rowBytes = static_cast<size_t>(res.width) * res.numChannels * (res.bitDepth / 8);
+        res.data.resize(rowBytes * res.height);
 
-        std::vector<png_bytep> rowPointers;
-        for (int row = 0; row < res.height; ++row) {
-            rowPointers.push_back(res.data.data() + row * res.numChannels * (res.bitDepth / 8) * res.width);
+        // Each pass of an interlaced image reads every row again, adding its pixels to what is already there
+        for (int pass = 0; pass < passes; ++pass) {
+            for (int row = 0; row < res.height; ++row) png_read_row(png_ptr, res.data.data() + row * rowBytes, NULL);
         }
 
-        png_read_image(png_ptr, rowPointers.data());
-
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 
         return res;
     }
 
-    bool WritePng(vector<uint8_t>& outputData, uint8_t* inputData, int width, int height, bool swapEndian) {
-        if (swapEndian) {
-            for (int i = 0; i < width * height; ++i) {
-                uint8_t tmp = inputData[i * 2];
-                inputData[i * 2] = inputData[i * 2 + 1];
-                inputData[i * 2 + 1] = tmp;
-            }
+    bool ReadPngInto(uint8_t const* data, size_t size, uint8_t* destination, uint64_t destinationSize, size_t stride, bool swapBytes, PixelConverter const* convert) {
+        if (size < 8 || png_sig_cmp(data, 0, 8)) return false;
+
+        png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        if (!png_ptr) return false;
+
+        png_infop info_ptr = png_create_info_struct(png_ptr);
+        if (!info_ptr) {
+            png_destroy_read_struct(&png_ptr, NULL, NULL);
+            return false;
         }
 
-        png_image img;
-        img.version = PNG_IMAGE_VERSION;
-        img.format = PNG_FORMAT_LINEAR_Y;
-        img.width = width;
-        img.height = height;
-        //img.flags = PNG_IMAGE_FLAG_16BIT_sRGB;
+        if (setjmp(png_jmpbuf(png_ptr))) {
+            png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+            return false;
+        }
 
-        png_alloc_size_t size = width * height * sizeof(uint16_t);
+        pngMemoryReader memoryReader{ data, 8, size };
+        png_set_read_fn(png_ptr, &memoryReader, pngReadFunc);
+        png_set_sig_bytes(png_ptr, 8);
+
+        png_read_info(png_ptr, info_ptr);
 
-        if (!png_image_write_to_memory(&img, nullptr, &size, 0, inputData, 0, nullptr)) {
+        const int bitDepth = png_get_bit_depth(png_ptr, info_ptr);
+        if (swapBytes && bitDepth == 16) png_set_swap(png_ptr);
+        const int passes = png_set_interlace_handling(png_ptr);
+        png_read_update_info(png_ptr, info_ptr);
+
+        const size_t rowBytes = png_get_rowbytes(png_ptr, info_ptr);
+        const png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
+        if ((bitDepth != 8 && bitDepth != 16) || height == 0 || rowBytes > stride
+            || static_cast<uint64_t>(height - 1) * stride + rowBytes != destinationSize
+            || (convert && (convert->From().BitDepth != bitDepth || convert->To().BitDepth != bitDepth))) {
+            png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
             return false;
         }
 
-        outputData.resize(size);
+        // Rows are converted while they are still in the cache, interlaced rows only once every pass is in
+        const uint64_t rowSamples = rowBytes / (bitDepth / 8);
+        for (int pass = 0; pass < passes; ++pass) {
+            for (png_uint_32 row = 0; row < height; ++row) {
+                uint8_t* const rowData = destination + static_cast<uint64_t>(row) * stride;
+                png_read_row(png_ptr, rowData, NULL);
+                if (convert && pass == passes - 1) convert->Convert(rowData, rowData, rowSamples);
+            }
+        }
 
-        return png_image_write_to_memory(&img, outputData.data(), &size, 0, inputData, 0, nullptr);
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return true;
     }
 
-    bool WritePng(vector<uint8_t>& outputData, ImageData const& img) {
-        png_image pimg;
-        memset(&pimg, 0, sizeof(pimg));
-        pimg.version = PNG_IMAGE_VERSION;
-        pimg.format = PNG_FORMAT_RGB;
-        pimg.width = img.width;
-        pimg.height = img.height;
+    struct PngStreamDecoder::State {
+        png_structp Png = nullptr;
+        png_infop Info = nullptr;
+
+        uint8_t* Destination;
+        uint64_t Size;
+        bool SwapBytes;
+        PixelConverter const* Convert;
+        size_t RowBytes = 0;
+        size_t RowSamples = 0;
+        png_uint_32 Height = 0;
+        bool Interlaced = false;
+
+        bool Failed = false;
+        bool Finished = false;
+
+        static void OnInfo(png_structp png_ptr, png_infop info_ptr) {
+            State& state = *reinterpret_cast<State*>(png_get_progressive_ptr(png_ptr));
+
+            const int bitDepth = png_get_bit_depth(png_ptr, info_ptr);
+            if (state.SwapBytes && bitDepth == 16) png_set_swap(png_ptr);
+
+            // Passes of interlaced images are combined in the destination
+            png_set_interlace_handling(png_ptr);
+            png_read_update_info(png_ptr, info_ptr);
 
-        png_alloc_size_t size = img.width * img.height * (img.bitDepth / 8) * img.numChannels;
-        htAssert(size == img.data.size());
+            state.RowBytes = png_get_rowbytes(png_ptr, info_ptr);
+            state.Height = png_get_image_height(png_ptr, info_ptr);
+            state.RowSamples = state.RowBytes / (bitDepth / 8);
+            state.Interlaced = png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE;
 
-        if (!png_image_write_to_memory(&pimg, nullptr, &size, 0, img.data.data(), 0, nullptr)) {
+            if ((bitDepth != 8 && bitDepth != 16) || static_cast<uint64_t>(state.RowBytes) * state.Height != state.Size
+                || (state.Convert && (state.Convert->From().BitDepth != bitDepth || state.Convert->To().BitDepth != bitDepth))) {
+                png_error(png_ptr, "image does not match the destination");
+            }
+        }
+
+        static void OnRow(png_structp png_ptr, png_bytep newRow, png_uint_32 rowNum, int /*pass*/) {
+            State& state = *reinterpret_cast<State*>(png_get_progressive_ptr(png_ptr));
+            if (!newRow || rowNum >= state.Height) return;
+
+            uint8_t* const row = state.Destination + static_cast<uint64_t>(rowNum) * state.RowBytes;
+            png_progressive_combine_row(png_ptr, row, newRow);
+            if (state.Convert && !state.Interlaced) state.Convert->Convert(row, row, state.RowSamples);
+        }
+
+        static void OnEnd(png_structp png_ptr, png_infop /*info_ptr*/) {
+            State& state = *reinterpret_cast<State*>(png_get_progressive_ptr(png_ptr));
+
+            // Rows of interlaced images are only whole after the last pass
+            if (state.Convert && state.Interlaced) state.Convert->Convert(state.Destination, state.Destination, state.RowSamples * state.Height);
+            state.Finished = true;
+        }
+    };
+
+    bool PngStreamDecoder::Feed(uint8_t const* data, size_t size) {
+        State& state = *m_state;
+        if (state.Failed || state.Finished) return !state.Failed;
+
+        if (setjmp(png_jmpbuf(state.Png))) {
+            state.Failed = true;
             return false;
         }
 
-        outputData.resize(size);
+        png_process_data(state.Png, state.Info, const_cast<png_bytep>(data), size);
+        return true;
+    }
+
+    bool PngStreamDecoder::Finished() const {
+        return m_state->Finished;
+    }
+
+    PngStreamDecoder::PngStreamDecoder(uint8_t* destination, uint64_t size, bool swapBytes, PixelConverter const* convert)
+    : m_state(std::make_unique<State>())
+    {
+        m_state->Destination = destination;
+        m_state->Size = size;
+        m_state->SwapBytes = swapBytes;
+        m_state->Convert = convert;
+
+        m_state->Png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        if (m_state->Png) m_state->Info = png_create_info_struct(m_state->Png);
+        if (!m_state->Info) {
+            m_state->Failed = true;
+            return;
+        }
+
+        png_set_progressive_read_fn(m_state->Png, m_state.get(), State::OnInfo, State::OnRow, State::OnEnd);
+    }
+
+    PngStreamDecoder::~PngStreamDecoder() {
+        if (m_state->Png) png_destroy_read_struct(&m_state->Png, m_state->Info ? &m_state->Info : NULL, NULL);
+    }
+
+    namespace {
+        void pngWriteFunc(png_structp png_ptr, png_bytep data, png_size_t length) {
+            vector<uint8_t>& output = *reinterpret_cast<vector<uint8_t>*>(png_get_io_ptr(png_ptr));
+            output.insert(output.end(), data, data + length);
+        }
+
+        void pngFlushFunc(png_structp /*png_ptr*/) { }
 
-        return png_image_write_to_memory(&pimg, outputData.data(), &size, 0, img.data.data(), 0, nullptr);
+        int pngFilterFlags(PngFilter filter) {
+            switch (filter) {
+            case PngFilter::None: return PNG_FILTER_NONE;
+            case PngFilter::Sub: return PNG_FILTER_SUB;
+            case PngFilter::Up: return PNG_FILTER_UP;
+            case PngFilter::Average: return PNG_FILTER_AVG;
+            case PngFilter::Paeth: return PNG_FILTER_PAETH;
+            default: return PNG_ALL_FILTERS;
+            }
+        }
+
+        int zlibStrategy(PngStrategy strategy) {
+            switch (strategy) {
+            case PngStrategy::Filtered: return Z_FILTERED;
+            case PngStrategy::HuffmanOnly: return Z_HUFFMAN_ONLY;
+            case PngStrategy::Rle: return Z_RLE;
+            case PngStrategy::Fixed: return Z_FIXED;
+            default: return Z_DEFAULT_STRATEGY;
+            }
+        }
+
+        // Filters a row the way PNG defines, out is the filter type followed by the filtered bytes
+        // prev is the row above, all zeros for the first row
+        void filterRow(int type, uint8_t const* row, uint8_t const* prev, size_t rowBytes, size_t bpp, uint8_t* out) {
+            out[0] = static_cast<uint8_t>(type);
+            uint8_t* dst = out + 1;
+
+            // The first pixel has nothing to its left
+            switch (type) {
+            case 1: // Sub
+                memcpy(dst, row, bpp);
+                for (size_t i = bpp; i < rowBytes; ++i) dst[i] = static_cast<uint8_t>(row[i] - row[i - bpp]);
+                break;
+            case 2: // Up
+                for (size_t i = 0; i < rowBytes; ++i) dst[i] = static_cast<uint8_t>(row[i] - prev[i]);
+                break;
+            case 3: // Average
+                for (size_t i = 0; i < bpp; ++i) dst[i] = static_cast<uint8_t>(row[i] - (prev[i] >> 1));
+                for (size_t i = bpp; i < rowBytes; ++i) dst[i] = static_cast<uint8_t>(row[i] - ((row[i - bpp] + prev[i]) >> 1));
+                break;
+            case 4: // Paeth, which is the byte above for the first pixel
+                for (size_t i = 0; i < bpp; ++i) dst[i] = static_cast<uint8_t>(row[i] - prev[i]);
+                for (size_t i = bpp; i < rowBytes; ++i) {
+                    const int a = row[i - bpp];
+                    const int b = prev[i];
+                    const int c = prev[i - bpp];
+                    const int pa = std::abs(b - c);
+                    const int pb = std::abs(a - c);
+                    const int pc = std::abs(a + b - 2 * c);
+                    const int predictor = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                    dst[i] = static_cast<uint8_t>(row[i] - predictor);
+                }
+                break;
+            default:
+                memcpy(dst, row, rowBytes);
+                break;
+            }
+        }
+
+        uint64_t filteredCost(uint8_t const* filtered, size_t rowBytes) {
+            uint64_t sum = 0;
+            for (size_t i = 0; i < rowBytes; ++i) {
+                const int value = static_cast<int8_t>(filtered[i]);
+                sum += static_cast<uint64_t>(value < 0 ? -value : value);
+            }
+            return sum;
+        }
+
+        // Same heuristic as libpng, the filter whose bytes are closest to zero as signed values
+        void filterRowAdaptive(uint8_t const* row, uint8_t const* prev, size_t rowBytes, size_t bpp, uint8_t* out, uint8_t* scratch) {
+            filterRow(0, row, prev, rowBytes, bpp, out);
+            uint64_t bestCost = filteredCost(out + 1, rowBytes);
+
+            for (int type = 1; type < 5; ++type) {
+                filterRow(type, row, prev, rowBytes, bpp, scratch);
+                const uint64_t cost = filteredCost(scratch + 1, rowBytes);
+                if (cost < bestCost) {
+                    memcpy(out, scratch, rowBytes + 1);
+                    bestCost = cost;
+                }
+            }
+        }
+
+        void appendChunk(vector<uint8_t>& output, char const* type, uint8_t const* data, size_t size) {
+            const uint8_t header[8] = {
+                static_cast<uint8_t>(size >> 24), static_cast<uint8_t>(size >> 16), static_cast<uint8_t>(size >> 8), static_cast<uint8_t>(size),
+                static_cast<uint8_t>(type[0]), static_cast<uint8_t>(type[1]), static_cast<uint8_t>(type[2]), static_cast<uint8_t>(type[3])
+            };
+            output.insert(output.end(), header, header + 8);
+            if (size) output.insert(output.end(), data, data + size);
+
+            uLong crc = crc32(0, header + 4, 4);
+            if (size) crc = crc32(crc, data, static_cast<uInt>(size));
+            const uint8_t trailer[4] = { static_cast<uint8_t>(crc >> 24), static_cast<uint8_t>(crc >> 16), static_cast<uint8_t>(crc >> 8), static_cast<uint8_t>(crc) };
+            output.insert(output.end(), trailer, trailer + 4);
+        }
+
+        // Splits the rows into one strip per thread. Each strip is filtered and deflated on its own thread as a
+        // raw deflate stream primed with the end of the strip before it, and ended with a sync flush so the
+        // strips can be put back to back. Each becomes an IDAT chunk, behind the zlib header and in front of
+        // the adler32 of the whole image, which is combined from the adler32 of each strip.
+        bool writePngStrips(vector<uint8_t>& outputData, uint8_t const* inputData, int width, int height, bool sixteenBit, int colorType, int channels, bool swap, PngWriteOptions const& options, size_t numStrips) {
+            const size_t bpp = static_cast<size_t>(channels) * (sixteenBit ? 2 : 1);
+            const size_t rowBytes = static_cast<size_t>(width) * bpp;
+            const size_t filteredRowBytes = rowBytes + 1;
+
+            const int level = options.Level >= 0 ? std::min(options.Level, 9) : Z_DEFAULT_COMPRESSION;
+            int strategy = zlibStrategy(options.Strategy);
+            if (options.Strategy == PngStrategy::Auto) strategy = options.Filter == PngFilter::None ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+
+            struct Strip {
+                int BeginRow;
+                int EndRow;
+                vector<uint8_t> Filtered;
+                vector<uint8_t> Compressed;
+                uLong Adler;
+                bool Ok = true;
+            };
+            vector<Strip> strips(numStrips);
+            for (size_t i = 0; i < numStrips; ++i) {
+                strips[i].BeginRow = static_cast<int>(static_cast<uint64_t>(height) * i / numStrips);
+                strips[i].EndRow = static_cast<int>(static_cast<uint64_t>(height) * (i + 1) / numStrips);
+            }
+
+            auto const runStrips = [&strips](auto const& work) {
+                std::atomic<size_t> next(0);
+                auto const worker = [&strips, &next, &work]() {
+                    for (size_t i = next++; i < strips.size(); i = next++) work(strips[i], i);
+                };
+
+                vector<std::thread> workers;
+                for (size_t i = 1; i < strips.size(); ++i) workers.emplace_back(worker);
+                worker();
+                for (std::thread& thread : workers) thread.join();
+            };
+
+            // Strips are filtered first, deflating one needs the end of the strip before it as its dictionary
+            runStrips([&](Strip& strip, size_t) {
+                const size_t rows = static_cast<size_t>(strip.EndRow - strip.BeginRow);
+                strip.Filtered.resize(rows * filteredRowBytes);
+
+                // Rows in big endian order, the current one and the one above it
+                vector<uint8_t> rowBuffer(swap ? rowBytes * 2 : 0);
+                const vector<uint8_t> zeroRow(strip.BeginRow == 0 ? rowBytes : 0, 0);
+                vector<uint8_t> scratch(options.Filter == PngFilter::Adaptive ? filteredRowBytes : 0);
+                auto const rowAt = [&](int row, uint8_t* buffer) -> uint8_t const* {
+                    uint8_t const* src = inputData + static_cast<size_t>(row) * rowBytes;
+                    if (!swap) return src;
+                    SwapSampleBytes(src, buffer, rowBytes, 2);
+                    return buffer;
+                };
+
+                uint8_t* current = swap ? rowBuffer.data() : nullptr;
+                uint8_t* above = swap ? rowBuffer.data() + rowBytes : nullptr;
+                uint8_t const* prev = strip.BeginRow > 0 ? rowAt(strip.BeginRow - 1, above) : zeroRow.data();
+                for (int row = strip.BeginRow; row < strip.EndRow; ++row) {
+                    uint8_t const* src = rowAt(row, current);
+                    uint8_t* out = strip.Filtered.data() + static_cast<size_t>(row - strip.BeginRow) * filteredRowBytes;
+                    if (options.Filter == PngFilter::Adaptive) {
+                        filterRowAdaptive(src, prev, rowBytes, bpp, out, scratch.data());
+                    } else {
+                        filterRow(static_cast<int>(options.Filter) - 1, src, prev, rowBytes, bpp, out);
+                    }
+
+                    prev = src;
+                    if (swap) std::swap(current, above);
+                }
+
+                strip.Adler = adler32(adler32(0, NULL, 0), strip.Filtered.data(), static_cast<uInt>(strip.Filtered.size()));
+            });
+
+            runStrips([&](Strip& strip, size_t index) {
+                z_stream stream;
+                memset(&stream, 0, sizeof(stream));
+                if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, strategy) != Z_OK) {
+                    strip.Ok = false;
+                    return;
+                }
+
+                if (index > 0) {
+                    vector<uint8_t> const& before = strips[index - 1].Filtered;
+                    const size_t dictionarySize = std::min<size_t>(before.size(), 32768);
+                    deflateSetDictionary(&stream, before.data() + before.size() - dictionarySize, static_cast<uInt>(dictionarySize));
+                }
+
+                // Room for a sync flush on top of the bound
+                strip.Compressed.resize(deflateBound(&stream, static_cast<uLong>(strip.Filtered.size())) + 16);
+                stream.next_in = strip.Filtered.data();
+                stream.avail_in = static_cast<uInt>(strip.Filtered.size());
+                stream.next_out = strip.Compressed.data();
+                stream.avail_out = static_cast<uInt>(strip.Compressed.size());
+
+                const bool last = index + 1 == strips.size();
+                const int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+                strip.Ok = (last ? result == Z_STREAM_END : result == Z_OK) && stream.avail_in == 0 && stream.avail_out > 0;
+                strip.Compressed.resize(stream.total_out);
+                deflateEnd(&stream);
+            });
+
+            uLong adler = strips[0].Adler;
+            for (size_t i = 0; i < strips.size(); ++i) {
+                if (!strips[i].Ok) return false;
+                if (i > 0) adler = adler32_combine(adler, strips[i].Adler, static_cast<z_off_t>(strips[i].Filtered.size()));
+            }
+
+            outputData.clear();
+            const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+            outputData.insert(outputData.end(), signature, signature + 8);
+
+            const uint8_t ihdr[13] = {
+                static_cast<uint8_t>(width >> 24), static_cast<uint8_t>(width >> 16), static_cast<uint8_t>(width >> 8), static_cast<uint8_t>(width),
+                static_cast<uint8_t>(height >> 24), static_cast<uint8_t>(height >> 16), static_cast<uint8_t>(height >> 8), static_cast<uint8_t>(height),
+                static_cast<uint8_t>(sixteenBit ? 16 : 8), static_cast<uint8_t>(colorType), 0, 0, 0
+            };
+            appendChunk(outputData, "IHDR", ihdr, sizeof(ihdr));
+            if (sixteenBit) {
+                // PNG_GAMMA_LINEAR
+                const uint8_t gama[4] = { 0, 1, 134, 160 };
+                appendChunk(outputData, "gAMA", gama, sizeof(gama));
+            } else {
+                const uint8_t srgb[1] = { PNG_sRGB_INTENT_PERCEPTUAL };
+                appendChunk(outputData, "sRGB", srgb, sizeof(srgb));
+            }
+
+            // zlib header for a 32K window, its level field only says how hard the encoder tried
+            const int levelField = strategy >= Z_HUFFMAN_ONLY || (level >= 0 && level < 2) ? 0 : level >= 0 && level < 6 ? 1 : level == 6 || level < 0 ? 2 : 3;
+            uint8_t zlibHeader[2] = { 0x78, static_cast<uint8_t>(levelField << 6) };
+            zlibHeader[1] = static_cast<uint8_t>(zlibHeader[1] + 31 - (zlibHeader[0] * 256 + zlibHeader[1]) % 31);
+
+            const uint8_t adlerBytes[4] = { static_cast<uint8_t>(adler >> 24), static_cast<uint8_t>(adler >> 16), static_cast<uint8_t>(adler >> 8), static_cast<uint8_t>(adler) };
+            for (size_t i = 0; i < strips.size(); ++i) {
+                vector<uint8_t>& data = strips[i].Compressed;
+                if (i == 0) data.insert(data.begin(), zlibHeader, zlibHeader + 2);
+                if (i + 1 == strips.size()) data.insert(data.end(), adlerBytes, adlerBytes + 4);
+                appendChunk(outputData, "IDAT", data.data(), data.size());
+            }
+            appendChunk(outputData, "IEND", nullptr, 0);
+
+            return true;
+        }
+
+        // Writes the same chunks libpng's simplified API wrote for these images, so tiles stay the same
+        bool writePngRows(vector<uint8_t>& outputData, uint8_t const* inputData, int width, int height, bool sixteenBit, int colorType, int channels, bool swap, PngWriteOptions const& options) {
+            const size_t rowBytes = static_cast<size_t>(width) * channels * (sixteenBit ? 2 : 1);
+
+            const size_t threads = options.Threads > 0 ? static_cast<size_t>(options.Threads) : std::max(1u, std::thread::hardware_concurrency());
+            const size_t numStrips = std::min({ threads, static_cast<size_t>(height), rowBytes * height / (PngParallelMinBytes / 4) });
+            if (rowBytes * height >= PngParallelMinBytes && numStrips > 1) {
+                return writePngStrips(outputData, inputData, width, height, sixteenBit, colorType, channels, swap, options, numStrips);
+            }
+
+            outputData.clear();
+
+            // Roughly what elevation compresses to, the buffer grows from there if it has to
+            if (outputData.capacity() == 0) outputData.reserve(rowBytes * height / 2 + 1024);
+
+            png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+            if (!png_ptr) return false;
+
+            png_infop info_ptr = png_create_info_struct(png_ptr);
+            if (!info_ptr) {
+                png_destroy_write_struct(&png_ptr, NULL);
+                return false;
+            }
+
+            if (setjmp(png_jmpbuf(png_ptr))) {
+                png_destroy_write_struct(&png_ptr, &info_ptr);
+                outputData.clear();
+                return false;
+            }
+
+            png_set_write_fn(png_ptr, &outputData, pngWriteFunc, pngFlushFunc);
+
+            png_set_IHDR(png_ptr, info_ptr, width, height, sixteenBit ? 16 : 8, colorType, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+            if (sixteenBit) {
+                // Linear samples, primaries don't mean anything for grayscale so there's no cHRM
+                png_set_gAMA_fixed(png_ptr, info_ptr, PNG_GAMMA_LINEAR);
+            } else {
+                png_set_sRGB(png_ptr, info_ptr, PNG_sRGB_INTENT_PERCEPTUAL);
+            }
+
+            png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, pngFilterFlags(options.Filter));
+            if (options.Level >= 0) png_set_compression_level(png_ptr, std::min(options.Level, 9));
+            if (options.Strategy != PngStrategy::Auto) png_set_compression_strategy(png_ptr, zlibStrategy(options.Strategy));
+
+            png_write_info(png_ptr, info_ptr);
+            if (swap) png_set_swap(png_ptr);
+
+            for (int row = 0; row < height; ++row) {
+                png_write_row(png_ptr, inputData + static_cast<size_t>(row) * rowBytes);
+            }
+            png_write_end(png_ptr, info_ptr);
+
+            png_destroy_write_struct(&png_ptr, &info_ptr);
+            return true;
+        }
+    }
+
+    bool WritePng(vector<uint8_t>& outputData, uint8_t const* inputData, int width, int height, bool swapEndian, PngWriteOptions const& options) {
+        // PNG samples are big endian, samples in the order of a little endian machine are swapped unless they already were
+        const bool swap = (std::endian::native == std::endian::little) != swapEndian;
+
+        return writePngRows(outputData, inputData, width, height, true, PNG_COLOR_TYPE_GRAY, 1, swap, options);
+    }
+
+    bool WritePng(vector<uint8_t>& outputData, ImageData const& img, PngWriteOptions const& options) {
+        htAssert(img.bitDepth == 8 && img.numChannels == 3);
+        htAssert(static_cast<size_t>(img.width) * img.height * 3 == img.data.size());
+
+        return writePngRows(outputData, img.data.data(), img.width, img.height, false, PNG_COLOR_TYPE_RGB, 3, false, options);
+    }
+
+    void BenchmarkPngEncoding(uint16_t const* samples, int width, int height, std::ostream& out) {
+        struct Setting {
+            string Name;
+            PngWriteOptions Options;
+        };
+
+        vector<Setting> settings;
+        const std::pair<char const*, PngFilter> filters[] = {
+            { "none", PngFilter::None }, { "sub", PngFilter::Sub }, { "up", PngFilter::Up }, { "paeth", PngFilter::Paeth }, { "adaptive", PngFilter::Adaptive }
+        };
+        const std::pair<char const*, PngStrategy> strategies[] = {
+            { "default", PngStrategy::Default }, { "filtered", PngStrategy::Filtered }, { "rle", PngStrategy::Rle }
+        };
+        for (int level : { 1, 3, 6, 9 }) {
+            for (auto const& [strategyName, strategy] : strategies) {
+                for (auto const& [filterName, filter] : filters) {
+                    settings.push_back({ "level " + std::to_string(level) + ", " + strategyName + ", " + filterName, { level, strategy, filter } });
+                }
+            }
+        }
+
+        // The default settings split into strips, images under PngParallelMinBytes are still encoded on one thread
+        const int cores = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        for (int threads : { 2, 4, 8, cores }) {
+            PngWriteOptions options;
+            options.Threads = threads;
+            settings.push_back({ "default, " + std::to_string(threads) + " threads", options });
+            if (threads == cores) break;
+        }
+
+        const double inputMB = static_cast<double>(width) * height * 2 / (1024.0 * 1024.0);
+        out << "Encoding a " << width << "x" << height << " 16 bit image, " << inputMB << " MB\n";
+
+        vector<uint8_t> output;
+        for (Setting const& setting : settings) {
+            if (!WritePng(output, reinterpret_cast<uint8_t const*>(samples), width, height, false, setting.Options)) {
+                out << setting.Name << ": failed\n";
+                continue;
+            }
+            const double seconds = FastestRun([&]() {
+                WritePng(output, reinterpret_cast<uint8_t const*>(samples), width, height, false, setting.Options);
+            });
+            out << setting.Name << ": " << inputMB / seconds << " MB/s, " << output.size() << " bytes, "
+                << 100.0 * output.size() / (static_cast<double>(width) * height * 2) << "% of raw\n";
+        }
     }
 }
\ No newline at end of file
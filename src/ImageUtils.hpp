@@ -1,6 +1,10 @@
 #pragma once
 
 #include "Util.hpp"
+#include "PixelFormat.hpp"
+
+#include <memory>
+#include <iosfwd>
 
 namespace HyperTiler {
     struct ImageData {
@@ -18,7 +22,79 @@ namespace HyperTiler {
 
     ImageData ReadPng(vector<uint8_t> const& data, bool expand);
 
-    bool WritePng(vector<uint8_t>& outputData, uint8_t* inputData, int width, int height, bool swapEndian);
+    // Decodes a whole PNG straight into the destination without expanding, row y starts stride bytes
+    // after row y - 1 and the last row has to end exactly at the end of the destination
+    // swapBytes swaps the bytes of 16 bit samples as they are decoded, which are big endian otherwise
+    // convert is run over each row as soon as it is decoded, it has to keep the bit depth of the image
+    bool ReadPngInto(uint8_t const* data, size_t size, uint8_t* destination, uint64_t destinationSize, size_t stride, bool swapBytes, PixelConverter const* convert = nullptr);
+
+    // Decodes a PNG as its bytes arrive with libpng's progressive reader, rows are written straight
+    // into the destination as they are decoded. Samples are left as ReadPng leaves them without
+    // expanding, and the image has to decode to exactly the size of the destination.
+    class PngStreamDecoder {
+        struct State;
+        std::unique_ptr<State> m_state;
+    public:
+        // Returns false once decoding has failed, bytes after the end of the image are ignored
+        bool Feed(uint8_t const* data, size_t size);
+
+        // true once the whole image has been decoded into the destination
+        bool Finished() const;
+
+        // swapBytes and convert are the same as for ReadPngInto, convert has to outlive the decoder
+        PngStreamDecoder(uint8_t* destination, uint64_t size, bool swapBytes = false, PixelConverter const* convert = nullptr);
+        ~PngStreamDecoder();
+    private:
+        PngStreamDecoder(PngStreamDecoder const& other) = delete;
+        PngStreamDecoder& operator=(PngStreamDecoder const& other) = delete;
+    };
+
+    // Row filter of PNG output, Adaptive lets libpng pick one for each row
+    enum class PngFilter : int {
+        Adaptive = 0,
+        None = 1,
+        Sub = 2,
+        Up = 3,
+        Average = 4,
+        Paeth = 5
+    };
+
+    // zlib strategy of PNG output, Auto leaves it to libpng, which uses Filtered unless rows aren't filtered
+    enum class PngStrategy : int {
+        Auto = 0,
+        Default = 1,
+        Filtered = 2,
+        HuffmanOnly = 3,
+        Rle = 4,
+        Fixed = 5
+    };
+
+    struct PngWriteOptions {
+        // zlib level from 0 to 9, -1 for the zlib default
+        int Level = -1;
+        PngStrategy Strategy = PngStrategy::Auto;
+        PngFilter Filter = PngFilter::Adaptive;
+
+        // Images of at least ParallelMinBytes are split into this many strips of rows, deflated on
+        // a thread each and stitched back into one zlib stream, 0 for one strip per core
+        // With 1 the image is written by libpng in one pass
+        int Threads = 1;
+    };
+
+    // Smaller images are always deflated on one thread, strips of them wouldn't be worth a thread
+    constexpr size_t PngParallelMinBytes = 1024 * 1024;
+
+    // Encodes with libpng's write API in a single pass, the image is appended to outputData as it is
+    // compressed. outputData is cleared first but keeps its capacity, so a buffer reused for many
+    // images only grows to the largest of them. With the default options the output is the same as
+    // libpng's simplified API writes.
+    // inputData holds 16 bit samples in the byte order of this machine, or the other one if swapEndian is set
+    bool WritePng(vector<uint8_t>& outputData, uint8_t const* inputData, int width, int height, bool swapEndian, PngWriteOptions const& options = PngWriteOptions());
+
+    // 8 bit RGB images only
+    bool WritePng(vector<uint8_t>& outputData, ImageData const& img, PngWriteOptions const& options = PngWriteOptions());
 
-    bool WritePng(vector<uint8_t>& outputData, ImageData const& img);
+    // Encodes a 16 bit grayscale image with a range of settings and writes how fast each was and how
+    // large its output, samples are in the byte order of this machine
+    void BenchmarkPngEncoding(uint16_t const* samples, int width, int height, std::ostream& out);
 }
\ No newline at end of file
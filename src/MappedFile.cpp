@@ -0,0 +1,78 @@
+#include "MappedFile.hpp"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace HyperTiler {
+    uint8_t const* MappedFile::Data() const {
+        return m_data;
+    }
+    uint64_t MappedFile::Size() const {
+        return m_size;
+    }
+    void MappedFile::WillNeed(path const& file) {
+#ifndef _WIN32
+        const int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0) return;
+#ifdef POSIX_FADV_WILLNEED
+        // Starts the reads in the background and returns
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+        close(fd);
+#endif
+    }
+    MappedFile::MappedFile(path const& file)
+    : m_data(nullptr)
+    , m_size(0)
+#ifdef _WIN32
+    , m_file(INVALID_HANDLE_VALUE)
+    , m_mapping(nullptr)
+#endif
+    {
+#ifdef _WIN32
+        m_file = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE) return;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) return;
+
+        m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!m_mapping) return;
+
+        m_data = reinterpret_cast<uint8_t const*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        if (m_data) m_size = static_cast<uint64_t>(size.QuadPart);
+#else
+        const int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0) return;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+            close(fd);
+            return;
+        }
+
+        // The mapping keeps the file open
+        void* const mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) return;
+
+        m_data = reinterpret_cast<uint8_t const*>(mapped);
+        m_size = static_cast<uint64_t>(info.st_size);
+#endif
+    }
+    MappedFile::~MappedFile() {
+#ifdef _WIN32
+        if (m_data) UnmapViewOfFile(m_data);
+        if (m_mapping) CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+#else
+        if (m_data) munmap(const_cast<uint8_t*>(m_data), m_size);
+#endif
+    }
+}
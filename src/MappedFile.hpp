@@ -0,0 +1,31 @@
+#pragma once
+
+#include "Util.hpp"
+
+namespace HyperTiler {
+    // A whole file mapped read-only into memory. Reads are served from the page cache of the OS,
+    // so the file is never copied into the process and stays cached between uses of it.
+    // The file must not be truncated while it is mapped.
+    class MappedFile {
+        uint8_t const* m_data;
+        uint64_t m_size;
+#ifdef _WIN32
+        void* m_file;
+        void* m_mapping;
+#endif
+    public:
+        // nullptr if the file couldn't be opened or is empty
+        uint8_t const* Data() const;
+        uint64_t Size() const;
+        explicit operator bool() const { return m_data != nullptr; }
+
+        // Asks the OS to start reading a file into the page cache, so that mapping it later doesn't wait
+        static void WillNeed(path const& file);
+
+        MappedFile(path const& file);
+        ~MappedFile();
+    private:
+        MappedFile(MappedFile const& other) = delete;
+        MappedFile& operator=(MappedFile const& other) = delete;
+    };
+}
@@ -0,0 +1,88 @@
+#include "MemoryArena.hpp"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace HyperTiler {
+    // Alignment that lets transparent huge pages back the whole arena
+    constexpr uint64_t HugePageSize = 2ull * 1024ull * 1024ull;
+
+    static uint64_t AlignUp(uint64_t val, uint64_t alignment) {
+        return (val + alignment - 1) / alignment * alignment;
+    }
+
+    uint8_t* MemoryArena::Data() const {
+        return m_data;
+    }
+    uint64_t MemoryArena::Size() const {
+        return m_size;
+    }
+    uint64_t MemoryArena::PageSize() {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+#else
+        return static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+#endif
+    }
+    void MemoryArena::Commit(uint8_t* begin, uint64_t size) {
+        htAssert(begin >= m_data && begin + size <= m_data + m_size);
+#ifdef _WIN32
+        htAssert(VirtualAlloc(begin, size, MEM_COMMIT, PAGE_READWRITE) != nullptr);
+#endif
+    }
+    void MemoryArena::Decommit(uint8_t* begin, uint64_t size) {
+        htAssert(begin >= m_data && begin + size <= m_data + m_size);
+
+        const uint64_t pageSize = PageSize();
+        const uint64_t offset = begin - m_reserved;
+        const uint64_t first = AlignUp(offset, pageSize);
+        const uint64_t last = (offset + size) / pageSize * pageSize;
+        if (last <= first) return;
+
+#ifdef _WIN32
+        VirtualFree(m_reserved + first, last - first, MEM_DECOMMIT);
+#else
+        madvise(m_reserved + first, last - first, MADV_DONTNEED);
+#endif
+    }
+    MemoryArena::MemoryArena(uint64_t size)
+    : m_reserved(nullptr)
+    , m_reservedSize(0)
+    , m_data(nullptr)
+    , m_size(size)
+    {
+        if (size == 0) return;
+
+#ifdef _WIN32
+        m_reservedSize = AlignUp(size, PageSize());
+        m_reserved = reinterpret_cast<uint8_t*>(VirtualAlloc(nullptr, m_reservedSize, MEM_RESERVE, PAGE_READWRITE));
+        htAssert(m_reserved != nullptr);
+        m_data = m_reserved;
+#else
+        // Over-reserve so the start can be aligned to a huge page
+        m_reservedSize = AlignUp(size, HugePageSize) + HugePageSize;
+        void* const mapped = mmap(nullptr, m_reservedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        htAssert(mapped != MAP_FAILED);
+        m_reserved = reinterpret_cast<uint8_t*>(mapped);
+        m_data = m_reserved + (AlignUp(reinterpret_cast<uint64_t>(m_reserved), HugePageSize) - reinterpret_cast<uint64_t>(m_reserved));
+#ifdef MADV_HUGEPAGE
+        // Best effort, fails harmlessly where transparent huge pages are disabled
+        madvise(m_data, AlignUp(size, HugePageSize), MADV_HUGEPAGE);
+#endif
+#endif
+    }
+    MemoryArena::~MemoryArena() {
+        if (!m_reserved) return;
+#ifdef _WIN32
+        VirtualFree(m_reserved, 0, MEM_RELEASE);
+#else
+        munmap(m_reserved, m_reservedSize);
+#endif
+    }
+}
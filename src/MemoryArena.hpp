@@ -0,0 +1,32 @@
+#pragma once
+
+#include "Util.hpp"
+
+namespace HyperTiler {
+    // A range of address space reserved up front, with physical memory committed as it is used.
+    // Where the platform supports it the range is backed by huge pages to reduce TLB misses
+    // when tiles are accessed randomly.
+    class MemoryArena {
+        uint8_t* m_reserved;
+        uint64_t m_reservedSize;
+        uint8_t* m_data;
+        uint64_t m_size;
+    public:
+        uint8_t* Data() const;
+        uint64_t Size() const;
+
+        // Make the range usable, a no-op where the OS commits pages on first touch
+        void Commit(uint8_t* begin, uint64_t size);
+
+        // Give the pages fully inside the range back to the OS, their contents are lost
+        void Decommit(uint8_t* begin, uint64_t size);
+
+        static uint64_t PageSize();
+
+        MemoryArena(uint64_t size);
+        ~MemoryArena();
+    private:
+        MemoryArena(MemoryArena const& other) = delete;
+        MemoryArena& operator=(MemoryArena const& other) = delete;
+    };
+}
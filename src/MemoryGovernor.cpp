@@ -0,0 +1,193 @@
+#include "MemoryGovernor.hpp"
+
+#include <chrono>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace HyperTiler {
+    string MemoryPoolName(MemoryPool pool) {
+        switch (pool) {
+        case MemoryPool::InputCache:
+            return "InputCache";
+        case MemoryPool::Accumulators:
+            return "Accumulators";
+        case MemoryPool::EncodeBuffers:
+            return "EncodeBuffers";
+        case MemoryPool::Downloads:
+            return "Downloads";
+        default:
+            return "Unknown";
+        }
+    }
+
+#ifndef _WIN32
+    // returns 0 if there is no limit or it can't be read
+    static uint64_t ReadCgroupLimit(path const& file) {
+        if (!FileExists(file)) return 0;
+        try {
+            string const val = ReadEntireFileText(file);
+            if (val.rfind("max", 0) == 0) return 0;
+            return std::stoull(val);
+        } catch (std::exception const&) {
+            return 0;
+        }
+    }
+#endif
+
+    uint64_t MemoryGovernor::SystemMemoryLimit() {
+#ifdef _WIN32
+        MEMORYSTATUSEX status;
+        status.dwLength = sizeof(status);
+        if (!GlobalMemoryStatusEx(&status)) return 0;
+        return status.ullTotalPhys;
+#else
+        uint64_t limit = static_cast<uint64_t>(sysconf(_SC_PHYS_PAGES)) * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+
+        // cgroup v2, then v1
+        for (path const& file : { path("/sys/fs/cgroup/memory.max"), path("/sys/fs/cgroup/memory/memory.limit_in_bytes") }) {
+            uint64_t const cgroupLimit = ReadCgroupLimit(file);
+            if (cgroupLimit != 0 && cgroupLimit < limit) limit = cgroupLimit;
+        }
+
+        return limit;
+#endif
+    }
+
+    bool MemoryGovernor::Fits(int pool, uint64_t bytes) const {
+        return m_used[pool] == 0 || m_used[pool] + bytes <= m_limits[pool];
+    }
+
+    uint64_t MemoryGovernor::Budget() const {
+        return m_budget;
+    }
+
+    uint64_t MemoryGovernor::Unassigned() const {
+        std::lock_guard<std::mutex> lock(m_mut);
+        uint64_t assigned = 0;
+        for (int i = 0; i < NumPools; ++i) assigned += m_limits[i];
+        return assigned >= m_budget ? 0 : m_budget - assigned;
+    }
+
+    void MemoryGovernor::SetLimit(MemoryPool pool, uint64_t bytes) {
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            m_limits[static_cast<int>(pool)] = bytes;
+        }
+        m_released.notify_all();
+    }
+
+    uint64_t MemoryGovernor::Limit(MemoryPool pool) const {
+        std::lock_guard<std::mutex> lock(m_mut);
+        return m_limits[static_cast<int>(pool)];
+    }
+
+    uint64_t MemoryGovernor::Used(MemoryPool pool) const {
+        std::lock_guard<std::mutex> lock(m_mut);
+        return m_used[static_cast<int>(pool)];
+    }
+
+    bool MemoryGovernor::Reserve(MemoryPool pool, uint64_t bytes, std::atomic_bool const& RunningFlag) {
+        const int index = static_cast<int>(pool);
+        std::unique_lock<std::mutex> lock(m_mut);
+        while (!Fits(index, bytes)) {
+            if (!RunningFlag) return false;
+            // Wake up periodically to notice cancellation
+            m_released.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        m_used[index] += bytes;
+        if (m_used[index] > m_peak[index]) m_peak[index] = m_used[index];
+        return true;
+    }
+
+    bool MemoryGovernor::TryReserve(MemoryPool pool, uint64_t bytes) {
+        const int index = static_cast<int>(pool);
+        std::lock_guard<std::mutex> lock(m_mut);
+        if (!Fits(index, bytes)) return false;
+        m_used[index] += bytes;
+        if (m_used[index] > m_peak[index]) m_peak[index] = m_used[index];
+        return true;
+    }
+
+    void MemoryGovernor::Release(MemoryPool pool, uint64_t bytes) {
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            const int index = static_cast<int>(pool);
+            htAssert(m_used[index] >= bytes);
+            m_used[index] -= bytes;
+        }
+        m_released.notify_all();
+    }
+
+    json MemoryGovernor::Usage() const {
+        std::lock_guard<std::mutex> lock(m_mut);
+        json pools = json::object();
+        for (int i = 0; i < NumPools; ++i) {
+            pools[MemoryPoolName(static_cast<MemoryPool>(i))] = {
+                {"Limit", m_limits[i]},
+                {"Used", m_used[i]},
+                {"Peak", m_peak[i]}
+            };
+        }
+        return {
+            {"Budget", m_budget},
+            {"Pools", pools}
+        };
+    }
+
+    MemoryGovernor::MemoryGovernor(uint64_t budget)
+    : m_budget(budget)
+    {
+        for (int i = 0; i < NumPools; ++i) {
+            m_limits[i] = 0;
+            m_used[i] = 0;
+            m_peak[i] = 0;
+        }
+    }
+
+    void MemoryReservation::Reset() {
+        if (m_governor) m_governor->Release(m_pool, m_bytes);
+        m_governor = nullptr;
+        m_bytes = 0;
+    }
+
+    MemoryReservation::MemoryReservation()
+    : m_governor(nullptr)
+    , m_pool(MemoryPool::InputCache)
+    , m_bytes(0)
+    { }
+
+    MemoryReservation::MemoryReservation(MemoryGovernor& governor, MemoryPool pool, uint64_t bytes, std::atomic_bool const& RunningFlag)
+    : m_governor(governor.Reserve(pool, bytes, RunningFlag) ? &governor : nullptr)
+    , m_pool(pool)
+    , m_bytes(bytes)
+    { }
+
+    MemoryReservation::MemoryReservation(MemoryReservation&& other) noexcept
+    : m_governor(other.m_governor)
+    , m_pool(other.m_pool)
+    , m_bytes(other.m_bytes)
+    {
+        other.m_governor = nullptr;
+        other.m_bytes = 0;
+    }
+
+    MemoryReservation& MemoryReservation::operator=(MemoryReservation&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            m_governor = other.m_governor;
+            m_pool = other.m_pool;
+            m_bytes = other.m_bytes;
+            other.m_governor = nullptr;
+            other.m_bytes = 0;
+        }
+        return *this;
+    }
+
+    MemoryReservation::~MemoryReservation() {
+        Reset();
+    }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "Util.hpp"
+
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+namespace HyperTiler {
+    enum class MemoryPool : int {
+        InputCache = 0,
+        Accumulators = 1,
+        EncodeBuffers = 2,
+        Downloads = 3,
+        Count = 4
+    };
+
+    string MemoryPoolName(MemoryPool pool);
+
+    // Splits one memory budget between the stages of a conversion. Producers reserve memory before
+    // using it and block while their pool is full, which holds them back until consumers catch up.
+    class MemoryGovernor {
+        static constexpr int NumPools = static_cast<int>(MemoryPool::Count);
+
+        const uint64_t m_budget;
+        uint64_t m_limits[NumPools];
+        uint64_t m_used[NumPools];
+        uint64_t m_peak[NumPools];
+        mutable std::mutex m_mut;
+        std::condition_variable m_released;
+
+        bool Fits(int pool, uint64_t bytes) const;
+    public:
+        // total memory available to the process, taking container limits into account
+        static uint64_t SystemMemoryLimit();
+
+        uint64_t Budget() const;
+
+        // memory that hasn't been given to any pool yet
+        uint64_t Unassigned() const;
+
+        void SetLimit(MemoryPool pool, uint64_t bytes);
+        uint64_t Limit(MemoryPool pool) const;
+        uint64_t Used(MemoryPool pool) const;
+
+        // Blocks until the reservation fits in the pool
+        // Returns false without reserving if RunningFlag is cleared while waiting
+        // A reservation larger than the whole pool is let through once the pool is empty
+        bool Reserve(MemoryPool pool, uint64_t bytes, std::atomic_bool const& RunningFlag);
+        bool TryReserve(MemoryPool pool, uint64_t bytes);
+        void Release(MemoryPool pool, uint64_t bytes);
+
+        json Usage() const;
+
+        MemoryGovernor(uint64_t budget);
+    private:
+        MemoryGovernor(MemoryGovernor const& other) = delete;
+        MemoryGovernor& operator=(MemoryGovernor const& other) = delete;
+    };
+
+    // Releases the reserved memory when destroyed
+    class MemoryReservation {
+        MemoryGovernor* m_governor;
+        MemoryPool m_pool;
+        uint64_t m_bytes;
+    public:
+        bool Valid() const { return m_governor != nullptr; }
+        void Reset();
+
+        MemoryReservation();
+        MemoryReservation(MemoryGovernor& governor, MemoryPool pool, uint64_t bytes, std::atomic_bool const& RunningFlag);
+        MemoryReservation(MemoryReservation&& other) noexcept;
+        MemoryReservation& operator=(MemoryReservation&& other) noexcept;
+        ~MemoryReservation();
+    private:
+        MemoryReservation(MemoryReservation const& other) = delete;
+        MemoryReservation& operator=(MemoryReservation const& other) = delete;
+    };
+}
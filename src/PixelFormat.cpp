@@ -0,0 +1,422 @@
+#include "PixelFormat.hpp"
+#include "Simd.hpp"
+
+#include <cmath>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+
+namespace HyperTiler {
+    namespace {
+        // SSE2 is always there on x86-64, SSSE3 and AVX2 are looked for when the program starts
+        enum class SimdLevel : int {
+            Scalar = 0,
+            Sse2 = 1,
+            Ssse3 = 2,
+            Avx2 = 3
+        };
+
+        SimdLevel detectSimd() {
+#if !defined(HT_X86)
+            return SimdLevel::Scalar;
+#elif defined(_MSC_VER) && !defined(__clang__)
+            int info[4];
+            __cpuid(info, 0);
+            const int maxLeaf = info[0];
+            __cpuid(info, 1);
+            if (!(info[2] & (1 << 9))) return SimdLevel::Sse2;
+
+            // AVX2 also needs the OS to save the upper half of the registers
+            const bool osSavesAvx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+            if (maxLeaf >= 7 && osSavesAvx) {
+                __cpuidex(info, 7, 0);
+                if (info[1] & (1 << 5)) return SimdLevel::Avx2;
+            }
+            return SimdLevel::Ssse3;
+#else
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) return SimdLevel::Avx2;
+            if (__builtin_cpu_supports("ssse3")) return SimdLevel::Ssse3;
+            return SimdLevel::Sse2;
+#endif
+        }
+
+        SimdLevel available() {
+            static const SimdLevel level = detectSimd();
+            return level;
+        }
+
+        template<typename T>
+        T reverseBytes(T value) {
+            T res = 0;
+            for (size_t i = 0; i < sizeof(T); ++i) {
+                res = static_cast<T>((res << 8) | (value & 0xFF));
+                value = static_cast<T>(value >> 8);
+            }
+            return res;
+        }
+
+        template<typename T>
+        T load(uint8_t const* in, bool swapped) {
+            T value;
+            memcpy(&value, in, sizeof(T));
+            return swapped ? reverseBytes(value) : value;
+        }
+
+        template<typename T>
+        void store(uint8_t* out, T value, bool swapped) {
+            if (swapped) value = reverseBytes(value);
+            memcpy(out, &value, sizeof(T));
+        }
+
+        // The value of To that is the same fraction of its full range, rounded to the nearest
+        template<typename From, typename To>
+        To scale(From value) {
+            if constexpr (sizeof(To) >= sizeof(From)) {
+                // 0xFFFF / 0xFF is 0x0101, every wider range is a whole multiple of a narrower one
+                return static_cast<To>(static_cast<To>(value) * (std::numeric_limits<To>::max() / std::numeric_limits<From>::max()));
+            } else {
+                // Odd, so there are no ties
+                constexpr From divisor = std::numeric_limits<From>::max() / std::numeric_limits<To>::max();
+                return static_cast<To>(value / divisor + (value % divisor > divisor / 2 ? 1 : 0));
+            }
+        }
+
+        template<typename From, typename To>
+        To scaleWithGamma(From value, double exponent) {
+            const double normalized = static_cast<double>(value) / static_cast<double>(std::numeric_limits<From>::max());
+            const double res = std::pow(normalized, exponent) * static_cast<double>(std::numeric_limits<To>::max()) + 0.5;
+            return res >= static_cast<double>(std::numeric_limits<To>::max()) ? std::numeric_limits<To>::max() : static_cast<To>(res);
+        }
+
+        template<int Bytes>
+        void swapScalar(uint8_t const* source, uint8_t* destination, uint64_t count) {
+            for (uint64_t i = 0; i < count; ++i) {
+                uint8_t sample[Bytes];
+                memcpy(sample, source + i * Bytes, Bytes);
+                for (int b = 0; b < Bytes; ++b) destination[i * Bytes + b] = sample[Bytes - 1 - b];
+            }
+        }
+
+        void narrowScalar(uint8_t const* source, uint8_t* destination, uint64_t count, bool swapped) {
+            for (uint64_t i = 0; i < count; ++i) destination[i] = scale<uint16_t, uint8_t>(load<uint16_t>(source + i * 2, swapped));
+        }
+
+        void widenScalar(uint8_t const* source, uint8_t* destination, uint64_t count) {
+            // 257 * v has the same two bytes in either order
+            for (uint64_t i = 0; i < count; ++i) {
+                destination[i * 2] = source[i];
+                destination[i * 2 + 1] = source[i];
+            }
+        }
+
+#ifdef HT_X86
+        // Reverses each sample of a 16 byte lane
+        __m128i swapMask(int sampleBytes) {
+            alignas(16) int8_t mask[16];
+            for (int i = 0; i < 16; ++i) mask[i] = static_cast<int8_t>(i / sampleBytes * sampleBytes + sampleBytes - 1 - i % sampleBytes);
+            return _mm_load_si128(reinterpret_cast<__m128i const*>(mask));
+        }
+
+        // Each returns how many bytes or samples it did, the rest is left to narrower instructions
+
+        uint64_t swapSse2(uint8_t const* source, uint8_t* destination, uint64_t size) {
+            uint64_t i = 0;
+            for (; i + 16 <= size; i += 16) {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(source + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+            }
+            return i;
+        }
+
+        HT_TARGET("ssse3")
+        uint64_t swapSsse3(uint8_t const* source, uint8_t* destination, uint64_t size, int sampleBytes) {
+            const __m128i mask = swapMask(sampleBytes);
+            uint64_t i = 0;
+            for (; i + 16 <= size; i += 16) {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(source + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_shuffle_epi8(v, mask));
+            }
+            return i;
+        }
+
+        HT_TARGET("avx2")
+        uint64_t swapAvx2(uint8_t const* source, uint8_t* destination, uint64_t size, int sampleBytes) {
+            const __m256i mask = _mm256_broadcastsi128_si256(swapMask(sampleBytes));
+            uint64_t i = 0;
+            for (; i + 32 <= size; i += 32) {
+                const __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(source + i));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i), _mm256_shuffle_epi8(v, mask));
+            }
+            return i;
+        }
+
+        // round(v / 257) is (t - t / 256) / 256 with t = v + 128, t saturates where it would overflow and is still right
+        uint64_t narrowSse2(uint8_t const* source, uint8_t* destination, uint64_t count, bool swapped) {
+            const __m128i half = _mm_set1_epi16(128);
+            auto const narrow = [half, swapped](__m128i v) {
+                if (swapped) v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+                const __m128i t = _mm_adds_epu16(v, half);
+                return _mm_srli_epi16(_mm_sub_epi16(t, _mm_srli_epi16(t, 8)), 8);
+            };
+
+            uint64_t i = 0;
+            for (; i + 16 <= count; i += 16) {
+                const __m128i low = narrow(_mm_loadu_si128(reinterpret_cast<__m128i const*>(source + i * 2)));
+                const __m128i high = narrow(_mm_loadu_si128(reinterpret_cast<__m128i const*>(source + i * 2 + 16)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_packus_epi16(low, high));
+            }
+            return i;
+        }
+
+        HT_TARGET("avx2")
+        uint64_t narrowAvx2(uint8_t const* source, uint8_t* destination, uint64_t count, bool swapped) {
+            const __m256i half = _mm256_set1_epi16(128);
+
+            uint64_t i = 0;
+            for (; i + 32 <= count; i += 32) {
+                __m256i low = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(source + i * 2));
+                __m256i high = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(source + i * 2 + 32));
+                if (swapped) {
+                    low = _mm256_or_si256(_mm256_slli_epi16(low, 8), _mm256_srli_epi16(low, 8));
+                    high = _mm256_or_si256(_mm256_slli_epi16(high, 8), _mm256_srli_epi16(high, 8));
+                }
+
+                low = _mm256_adds_epu16(low, half);
+                low = _mm256_srli_epi16(_mm256_sub_epi16(low, _mm256_srli_epi16(low, 8)), 8);
+                high = _mm256_adds_epu16(high, half);
+                high = _mm256_srli_epi16(_mm256_sub_epi16(high, _mm256_srli_epi16(high, 8)), 8);
+
+                // Packing works within each 16 byte lane, the quarters are put back in order after
+                const __m256i packed = _mm256_packus_epi16(low, high);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i), _mm256_permute4x64_epi64(packed, 0xD8));
+            }
+            return i;
+        }
+
+        uint64_t widenSse2(uint8_t const* source, uint8_t* destination, uint64_t count) {
+            uint64_t i = 0;
+            for (; i + 16 <= count; i += 16) {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(source + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i * 2), _mm_unpacklo_epi8(v, v));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i * 2 + 16), _mm_unpackhi_epi8(v, v));
+            }
+            return i;
+        }
+#endif
+
+        void swapBytes(uint8_t const* source, uint8_t* destination, uint64_t size, int sampleBytes, SimdLevel level) {
+            uint64_t done = 0;
+#ifdef HT_X86
+            if (level >= SimdLevel::Avx2) done = swapAvx2(source, destination, size, sampleBytes);
+            if (level >= SimdLevel::Ssse3) done += swapSsse3(source + done, destination + done, size - done, sampleBytes);
+            else if (level >= SimdLevel::Sse2 && sampleBytes == 2) done += swapSse2(source + done, destination + done, size - done);
+#endif
+
+            const uint64_t rest = (size - done) / sampleBytes;
+            switch (sampleBytes) {
+            case 2: swapScalar<2>(source + done, destination + done, rest); break;
+            case 4: swapScalar<4>(source + done, destination + done, rest); break;
+            case 8: swapScalar<8>(source + done, destination + done, rest); break;
+            }
+        }
+
+        void narrowSamples(uint8_t const* source, uint8_t* destination, uint64_t count, bool swapped, SimdLevel level) {
+            uint64_t done = 0;
+#ifdef HT_X86
+            if (level >= SimdLevel::Avx2) done = narrowAvx2(source, destination, count, swapped);
+            if (level >= SimdLevel::Sse2) done += narrowSse2(source + done * 2, destination + done, count - done, swapped);
+#endif
+            narrowScalar(source + done * 2, destination + done, count - done, swapped);
+        }
+
+        void widenSamples(uint8_t const* source, uint8_t* destination, uint64_t count, SimdLevel level) {
+            uint64_t done = 0;
+#ifdef HT_X86
+            if (level >= SimdLevel::Sse2) done = widenSse2(source, destination, count);
+#endif
+            widenScalar(source + done, destination + done * 2, count - done);
+        }
+
+        void copyKernel(PixelConverter const& converter, uint8_t const* source, uint8_t* destination, uint64_t count) {
+            if (source != destination) memmove(destination, source, count * converter.From().SampleBytes());
+        }
+
+        void swapKernel(PixelConverter const& converter, uint8_t const* source, uint8_t* destination, uint64_t count) {
+            const int sampleBytes = converter.From().SampleBytes();
+            swapBytes(source, destination, count * sampleBytes, sampleBytes, available());
+        }
+
+        void narrowKernel(PixelConverter const& converter, uint8_t const* source, uint8_t* destination, uint64_t count) {
+            narrowSamples(source, destination, count, converter.From().Swapped, available());
+        }
+
+        void widenKernel(PixelConverter const& /*converter*/, uint8_t const* source, uint8_t* destination, uint64_t count) {
+            widenSamples(source, destination, count, available());
+        }
+
+        template<typename From, typename To>
+        void scaleKernel(PixelConverter const& converter, uint8_t const* source, uint8_t* destination, uint64_t count) {
+            const bool swapIn = converter.From().Swapped;
+            const bool swapOut = converter.To().Swapped;
+            for (uint64_t i = 0; i < count; ++i) {
+                store<To>(destination + i * sizeof(To), scale<From, To>(load<From>(source + i * sizeof(From), swapIn)), swapOut);
+            }
+        }
+
+        template<typename From, typename To, bool SwapIn, bool SwapOut>
+        void tableKernel(PixelConverter const& converter, uint8_t const* source, uint8_t* destination, uint64_t count) {
+            To const* table = reinterpret_cast<To const*>(converter.Table());
+            for (uint64_t i = 0; i < count; ++i) {
+                store<To>(destination + i * sizeof(To), table[load<From>(source + i * sizeof(From), SwapIn)], SwapOut);
+            }
+        }
+
+        // Samples too wide for a table of every value
+        template<typename From, typename To>
+        void gammaKernel(PixelConverter const& converter, uint8_t const* source, uint8_t* destination, uint64_t count) {
+            const bool swapIn = converter.From().Swapped;
+            const bool swapOut = converter.To().Swapped;
+            const double exponent = converter.From().Gamma / converter.To().Gamma;
+            for (uint64_t i = 0; i < count; ++i) {
+                const From value = load<From>(source + i * sizeof(From), swapIn);
+                store<To>(destination + i * sizeof(To), scaleWithGamma<From, To>(value, exponent), swapOut);
+            }
+        }
+
+        template<typename From, typename To>
+        PixelConverter::Kernel pickKernel(PixelFormat const& from, PixelFormat const& to, vector<uint64_t>& table) {
+            if (from.Gamma == to.Gamma) {
+                if constexpr (std::is_same_v<From, To>) {
+                    return from.Swapped == to.Swapped || sizeof(From) == 1 ? copyKernel : swapKernel;
+                } else if constexpr (std::is_same_v<From, uint16_t> && std::is_same_v<To, uint8_t>) {
+                    return narrowKernel;
+                } else if constexpr (std::is_same_v<From, uint8_t> && std::is_same_v<To, uint16_t>) {
+                    return widenKernel;
+                } else {
+                    return scaleKernel<From, To>;
+                }
+            }
+
+            if constexpr (sizeof(From) > 2) {
+                return gammaKernel<From, To>;
+            } else {
+                const uint64_t values = static_cast<uint64_t>(std::numeric_limits<From>::max()) + 1;
+                table.assign((values * sizeof(To) + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+
+                To* entries = reinterpret_cast<To*>(table.data());
+                const double exponent = from.Gamma / to.Gamma;
+                for (uint64_t value = 0; value < values; ++value) entries[value] = scaleWithGamma<From, To>(static_cast<From>(value), exponent);
+
+                if (from.Swapped && sizeof(From) > 1) {
+                    return to.Swapped && sizeof(To) > 1 ? tableKernel<From, To, true, true> : tableKernel<From, To, true, false>;
+                }
+                return to.Swapped && sizeof(To) > 1 ? tableKernel<From, To, false, true> : tableKernel<From, To, false, false>;
+            }
+        }
+
+        template<typename From>
+        PixelConverter::Kernel pickKernelTo(PixelFormat const& from, PixelFormat const& to, vector<uint64_t>& table) {
+            switch (to.BitDepth) {
+            case 8: return pickKernel<From, uint8_t>(from, to, table);
+            case 16: return pickKernel<From, uint16_t>(from, to, table);
+            case 32: return pickKernel<From, uint32_t>(from, to, table);
+            case 64: return pickKernel<From, uint64_t>(from, to, table);
+            }
+            throw std::runtime_error("Unsupported bit depth");
+        }
+    }
+
+    void SwapSampleBytes(uint8_t const* source, uint8_t* destination, uint64_t size, int sampleBytes) {
+        if (sampleBytes == 1) {
+            if (source != destination) memmove(destination, source, size);
+            return;
+        }
+        swapBytes(source, destination, size, sampleBytes, available());
+    }
+
+    PixelFormat const& PixelConverter::From() const {
+        return m_from;
+    }
+
+    PixelFormat const& PixelConverter::To() const {
+        return m_to;
+    }
+
+    bool PixelConverter::IsIdentity() const {
+        return m_kernel == copyKernel;
+    }
+
+    void const* PixelConverter::Table() const {
+        return m_table.empty() ? nullptr : m_table.data();
+    }
+
+    void PixelConverter::Convert(uint8_t const* source, uint8_t* destination, uint64_t count) const {
+        m_kernel(*this, source, destination, count);
+    }
+
+    PixelConverter::PixelConverter(PixelFormat const& from, PixelFormat const& to)
+    : m_from(from)
+    , m_to(to)
+    {
+        switch (from.BitDepth) {
+        case 8: m_kernel = pickKernelTo<uint8_t>(from, to, m_table); return;
+        case 16: m_kernel = pickKernelTo<uint16_t>(from, to, m_table); return;
+        case 32: m_kernel = pickKernelTo<uint32_t>(from, to, m_table); return;
+        case 64: m_kernel = pickKernelTo<uint64_t>(from, to, m_table); return;
+        }
+        throw std::runtime_error("Unsupported bit depth");
+    }
+
+    PixelConverter::PixelConverter()
+    : m_kernel(copyKernel)
+    { }
+
+    bool HasAvx2() {
+        return available() == SimdLevel::Avx2;
+    }
+
+    void BenchmarkPixelConversion(std::ostream& out) {
+        const uint64_t count = 1 << 20;
+        out << "Converting " << count << " samples\n";
+
+        vector<uint8_t> source(count * 8);
+        vector<uint8_t> destination(count * 8);
+        uint32_t state = 1;
+        for (uint8_t& byte : source) {
+            state = state * 1664525u + 1013904223u;
+            byte = static_cast<uint8_t>(state >> 24);
+        }
+
+        // Megabytes of input a second
+        auto const report = [&out](char const* name, char const* level, uint64_t inputBytes, double seconds) {
+            out << name << ", " << level << ": " << static_cast<double>(inputBytes) / (1024.0 * 1024.0) / seconds << " MB/s\n";
+        };
+
+        char const* const levelNames[] = { "scalar", "SSE2", "SSSE3", "AVX2" };
+        for (int level = 0; level <= static_cast<int>(available()); ++level) {
+            const SimdLevel simd = static_cast<SimdLevel>(level);
+            for (int sampleBytes : { 2, 4, 8 }) {
+                if (simd == SimdLevel::Sse2 && sampleBytes != 2) continue;
+                const double seconds = FastestRun([&]() { swapBytes(source.data(), destination.data(), count * sampleBytes, sampleBytes, simd); });
+                report(sampleBytes == 2 ? "Swap 16 bit" : sampleBytes == 4 ? "Swap 32 bit" : "Swap 64 bit", levelNames[level], count * sampleBytes, seconds);
+            }
+
+            if (simd != SimdLevel::Ssse3) {
+                const double narrow = FastestRun([&]() { narrowSamples(source.data(), destination.data(), count, true, simd); });
+                report("Swapped 16 to 8 bit", levelNames[level], count * 2, narrow);
+            }
+            if (simd <= SimdLevel::Sse2) {
+                const double widen = FastestRun([&]() { widenSamples(source.data(), destination.data(), count, simd); });
+                report("8 to 16 bit", levelNames[level], count, widen);
+            }
+        }
+
+        const PixelConverter gamma(PixelFormat{ 16, true, 2.2 }, PixelFormat{ 16, false, 1.0 });
+        report("Swapped 16 bit gamma 2.2 to linear", "table", count * 2, FastestRun([&]() { gamma.Convert(source.data(), destination.data(), count); }));
+
+        const PixelConverter wide(PixelFormat{ 16, false, 1.0 }, PixelFormat{ 32, true, 1.0 });
+        report("16 to swapped 32 bit", "scalar", count * 2, FastestRun([&]() { wide.Convert(source.data(), destination.data(), count); }));
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Util.hpp"
+
+#include <iosfwd>
+
+namespace HyperTiler {
+    // How the samples of an image are laid out in memory or in a file
+    struct PixelFormat {
+        // 8, 16, 32 or 64
+        int BitDepth = 16;
+
+        // Samples are in the other byte order than this machine's
+        bool Swapped = false;
+
+        // Samples are stored as linear ^ (1 / Gamma) of their full range, 1 is linear
+        double Gamma = 1.0;
+
+        int SampleBytes() const { return BitDepth / 8; }
+    };
+
+    // Reverses the bytes of each sample of sampleBytes, size is in bytes and source may be the destination
+    // Done 16 or 32 bytes at a time with SSSE3 or AVX2 where the processor has them
+    void SwapSampleBytes(uint8_t const* source, uint8_t* destination, uint64_t size, int sampleBytes);
+
+    // Converts samples from one format to another in a single pass, swapping their bytes, scaling them to
+    // the full range of another bit depth and changing their gamma at once. Gamma is changed through a table
+    // of every value when samples are 16 bits or less, so a converter is meant to be made once and reused.
+    // The common conversions, swapping bytes and scaling between 8 and 16 bits, use SSE2, SSSE3 or AVX2.
+    class PixelConverter {
+    public:
+        typedef void (*Kernel)(PixelConverter const& converter, uint8_t const* source, uint8_t* destination, uint64_t count);
+
+    private:
+        PixelFormat m_from;
+        PixelFormat m_to;
+        Kernel m_kernel;
+
+        // The output of every input value, in the byte order of this machine
+        vector<uint64_t> m_table;
+
+    public:
+        PixelFormat const& From() const;
+        PixelFormat const& To() const;
+
+        // Whether samples come out unchanged
+        bool IsIdentity() const;
+
+        // Table of the output of every input value, nullptr if the conversion doesn't use one
+        void const* Table() const;
+
+        // Converts count samples, source may be the destination if both formats have the same bit depth
+        void Convert(uint8_t const* source, uint8_t* destination, uint64_t count) const;
+
+        PixelConverter(PixelFormat const& from, PixelFormat const& to);
+
+        // Leaves 16 bit samples unchanged
+        PixelConverter();
+    };
+
+    // Whether this processor and its OS support AVX2, for kernels kept outside this module
+    bool HasAvx2();
+
+    // Times each conversion the converter has a fast path for, with and without SIMD, and writes how fast each was
+    void BenchmarkPixelConversion(std::ostream& out);
+}
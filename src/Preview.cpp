@@ -0,0 +1,243 @@
+#include "Preview.hpp"
+#include "ImageUtils.hpp"
+#include "PixelFormat.hpp"
+#include "Simd.hpp"
+
+#include <ostream>
+
+namespace HyperTiler {
+    namespace {
+        // Color mapped rows compress well against the row above even without looking for matches, a level 1
+        // Huffman only deflate of them is about ten times faster than the default settings and half again as large
+        // Written on one thread, the requests of a client are already served in parallel
+        PngWriteOptions previewPngOptions() {
+            PngWriteOptions options;
+            options.Level = 1;
+            options.Strategy = PngStrategy::HuffmanOnly;
+            options.Filter = PngFilter::Up;
+            options.Threads = 1;
+            return options;
+        }
+
+        void colorizeScalar(uint32_t const* colors, uint16_t const* samples, uint64_t count, bool swapped, uint8_t* rgb) {
+            for (uint64_t i = 0; i < count; ++i) {
+                const uint16_t value = swapped ? SwapBytes(samples[i]) : samples[i];
+                memcpy(rgb + i * 3, colors + value, 3);
+            }
+        }
+
+#ifdef HT_X86
+        HT_TARGET("avx2") void colorizeAvx2(uint32_t const* colors, uint16_t const* samples, uint64_t count, bool swapped, uint8_t* rgb) {
+            const __m128i swapMask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+
+            // The three color bytes of each of the four pixels in a lane, moved to the front of it
+            const __m256i packMask = _mm256_setr_epi8(
+                0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+            // Each lane is stored as 16 bytes of which the first 12 are kept, so the loop stops while there are
+            // still pixels after it whose colors overwrite the rest
+            uint64_t i = 0;
+            for (; i + 10 <= count; i += 8) {
+                __m128i values = _mm_loadu_si128(reinterpret_cast<__m128i const*>(samples + i));
+                if (swapped) values = _mm_shuffle_epi8(values, swapMask);
+
+                const __m256i indices = _mm256_cvtepu16_epi32(values);
+                const __m256i pixels = _mm256_i32gather_epi32(reinterpret_cast<int const*>(colors), indices, 4);
+                const __m256i packed = _mm256_shuffle_epi8(pixels, packMask);
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(rgb + i * 3), _mm256_castsi256_si128(packed));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(rgb + i * 3 + 12), _mm256_extracti128_si256(packed, 1));
+            }
+
+            colorizeScalar(colors, samples + i, count - i, swapped, rgb + i * 3);
+        }
+#endif
+
+        void colorize(uint32_t const* colors, uint16_t const* samples, uint64_t count, bool swapped, uint8_t* rgb, bool simd) {
+#ifdef HT_X86
+            if (simd && HasAvx2()) {
+                colorizeAvx2(colors, samples, count, swapped, rgb);
+                return;
+            }
+#endif
+            colorizeScalar(colors, samples, count, swapped, rgb);
+        }
+    }
+
+    void ColorTable::Colorize(uint16_t const* samples, uint64_t count, bool swapped, uint8_t* rgb) const {
+        colorize(m_colors.data(), samples, count, swapped, rgb, true);
+    }
+
+    ColorTable::ColorTable(float minVal, float maxVal)
+    : m_min(minVal)
+    , m_max(maxVal)
+    , m_colors(65536)
+    {
+        for (int value = 0; value < 65536; ++value) {
+            const uvec3 color = ToRGBU8(ColorMap((value - minVal) / (maxVal - minVal)));
+            const uint8_t bytes[4] = { static_cast<uint8_t>(color.x), static_cast<uint8_t>(color.y), static_cast<uint8_t>(color.z), 0 };
+            memcpy(&m_colors[value], bytes, sizeof(bytes));
+        }
+    }
+
+    std::shared_ptr<ColorTable const> PreviewRenderer::TableFor(float minVal, float maxVal) {
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            for (auto it = m_tables.begin(); it != m_tables.end(); ++it) {
+                if ((*it)->Min() == minVal && (*it)->Max() == maxVal) {
+                    m_tables.splice(m_tables.begin(), m_tables, it);
+                    return m_tables.front();
+                }
+            }
+        }
+
+        // Made outside the lock, two requests for a new range may both make it
+        std::shared_ptr<ColorTable const> const table = std::make_shared<ColorTable const>(minVal, maxVal);
+
+        std::lock_guard<std::mutex> lock(m_mut);
+        m_tables.push_front(table);
+        if (m_tables.size() > MaxTables) m_tables.pop_back();
+        return table;
+    }
+
+    void PreviewRenderer::Keep(string const& tag, Png const& png) {
+        std::lock_guard<std::mutex> lock(m_mut);
+        if (png->size() > m_maxSize || m_rendered.find(tag) != m_rendered.end()) return;
+
+        m_lru.push_front(tag);
+        m_rendered[tag] = Entry{ png, m_lru.begin() };
+        m_size += png->size();
+
+        while (m_size > m_maxSize) {
+            const auto oldest = m_rendered.find(m_lru.back());
+            m_size -= oldest->second.Data->size();
+            m_rendered.erase(oldest);
+            m_lru.pop_back();
+        }
+    }
+
+    PreviewRenderer::Png PreviewRenderer::Find(string const& tag) {
+        std::lock_guard<std::mutex> lock(m_mut);
+        const auto it = m_rendered.find(tag);
+        if (it == m_rendered.end()) return nullptr;
+
+        m_lru.splice(m_lru.begin(), m_lru, it->second.LruPosition);
+        return it->second.Data;
+    }
+
+    PreviewRenderer::Png PreviewRenderer::Render(string const& tag, uint16_t const* samples, int width, int height, bool swapped, float minVal, float maxVal) {
+        if (!tag.empty()) {
+            Png const kept = Find(tag);
+            if (kept) return kept;
+        }
+
+        std::shared_ptr<ColorTable const> const table = TableFor(minVal, maxVal);
+
+        ImageData image;
+        image.width = width;
+        image.height = height;
+        image.bitDepth = 8;
+        image.numChannels = 3;
+        image.data.resize(static_cast<size_t>(width) * height * 3);
+        table->Colorize(samples, static_cast<uint64_t>(width) * height, swapped, image.data.data());
+
+        std::shared_ptr<vector<uint8_t>> const png = std::make_shared<vector<uint8_t>>();
+        if (!WritePng(*png, image, previewPngOptions())) return nullptr;
+
+        if (!tag.empty()) Keep(tag, png);
+        return png;
+    }
+
+    PreviewRenderer::PreviewRenderer(uint64_t maxSize)
+    : m_mut()
+    , m_maxSize(maxSize)
+    , m_size(0)
+    , m_lru()
+    , m_rendered()
+    , m_tables()
+    { }
+
+    void BenchmarkPreview(uint16_t const* samples, int width, int height, std::ostream& out) {
+        const uint64_t count = static_cast<uint64_t>(width) * height;
+        out << "Rendering a preview of a " << width << "x" << height << " 16 bit image\n";
+
+        auto const report = [&out](string const& name, double seconds) {
+            out << name << ": " << seconds * 1000.0 << " ms\n";
+        };
+
+        uint16_t lowest = 0xFFFF;
+        uint16_t highest = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            lowest = std::min(lowest, samples[i]);
+            highest = std::max(highest, samples[i]);
+        }
+        const float minVal = lowest;
+        const float maxVal = highest > lowest ? highest : lowest + 1.0f;
+
+        ImageData reference;
+        reference.width = width;
+        reference.height = height;
+        reference.bitDepth = 8;
+        reference.numChannels = 3;
+        reference.data.resize(count * 3);
+        report("ColorMap for every sample", FastestRun([&]() {
+            for (uint64_t i = 0; i < count; ++i) {
+                const uvec3 color = ToRGBU8(ColorMap((samples[i] - minVal) / (maxVal - minVal)));
+                reference.data[i * 3 + 0] = static_cast<uint8_t>(color.x);
+                reference.data[i * 3 + 1] = static_cast<uint8_t>(color.y);
+                reference.data[i * 3 + 2] = static_cast<uint8_t>(color.z);
+            }
+        }));
+
+        std::unique_ptr<ColorTable> table;
+        report("Making the table", FastestRun([&]() { table = std::make_unique<ColorTable>(minVal, maxVal); }));
+
+        vector<uint16_t> swappedSamples(samples, samples + count);
+        for (uint16_t& sample : swappedSamples) sample = SwapBytes(sample);
+
+        ImageData image = reference;
+        for (bool simd : { false, true }) {
+            if (simd && !HasAvx2()) continue;
+            for (bool swapped : { false, true }) {
+                uint16_t const* const input = swapped ? swappedSamples.data() : samples;
+                std::fill(image.data.begin(), image.data.end(), static_cast<uint8_t>(0));
+                const double seconds = FastestRun([&]() { colorize(table->Colors(), input, count, swapped, image.data.data(), simd); });
+                report(string("Table, ") + (simd ? "AVX2" : "scalar") + (swapped ? ", swapped" : "")
+                    + (image.data == reference.data ? "" : ", DOES NOT MATCH"), seconds);
+            }
+        }
+
+        struct Setting {
+            string Name;
+            PngWriteOptions Options;
+        };
+        vector<Setting> settings = { { "default PNG settings", PngWriteOptions() } };
+        const std::pair<char const*, PngFilter> filters[] = {
+            { "none", PngFilter::None }, { "sub", PngFilter::Sub }, { "up", PngFilter::Up }, { "adaptive", PngFilter::Adaptive }
+        };
+        const std::pair<char const*, PngStrategy> strategies[] = {
+            { "filtered", PngStrategy::Filtered }, { "rle", PngStrategy::Rle }, { "huffman only", PngStrategy::HuffmanOnly }
+        };
+        for (auto const& [strategyName, strategy] : strategies) {
+            for (auto const& [filterName, filter] : filters) {
+                PngWriteOptions options;
+                options.Level = 1;
+                options.Strategy = strategy;
+                options.Filter = filter;
+                settings.push_back({ string("level 1, ") + strategyName + ", " + filterName, options });
+            }
+        }
+        settings.push_back({ "preview settings", previewPngOptions() });
+
+        vector<uint8_t> png;
+        for (Setting const& setting : settings) {
+            const double seconds = FastestRun([&]() { WritePng(png, image, setting.Options); });
+            out << "Encoding with " << setting.Name << ": " << seconds * 1000.0 << " ms, " << png.size() << " bytes\n";
+        }
+
+        // A renderer that keeps nothing, so each run renders again with the table it made on the first
+        PreviewRenderer renderer(0);
+        report("Whole preview", FastestRun([&]() { renderer.Render(string(), samples, width, height, false, minVal, maxVal); }));
+    }
+}
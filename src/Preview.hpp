@@ -0,0 +1,80 @@
+#pragma once
+
+#include "Util.hpp"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <iosfwd>
+
+namespace HyperTiler {
+    // The color of every 16 bit sample for one range of values, the color ColorMap gives
+    // (value - minVal) / (maxVal - minVal) as ToRGBU8 rounds it. Colors are packed as red, green,
+    // blue and an unused byte, in that order in memory.
+    class ColorTable {
+        float m_min;
+        float m_max;
+        vector<uint32_t> m_colors;
+
+    public:
+        float Min() const { return m_min; }
+        float Max() const { return m_max; }
+
+        // The packed color of each value
+        uint32_t const* Colors() const { return m_colors.data(); }
+
+        // Colors count samples into 8 bit RGB, swapping their bytes first if swapped is set
+        // Done eight samples at a time with an AVX2 gather where the processor has it
+        void Colorize(uint16_t const* samples, uint64_t count, bool swapped, uint8_t* rgb) const;
+
+        ColorTable(float minVal, float maxVal);
+    };
+
+    // Renders single channel 16 bit tiles as color mapped RGB PNGs, and keeps the most recently
+    // rendered ones up to a size limit. Each rendering is kept under a tag that has to change whenever
+    // the tile or its range does. Tables are kept for the few ranges used last, since a client asks
+    // for many tiles of the same range.
+    class PreviewRenderer {
+    public:
+        typedef std::shared_ptr<vector<uint8_t> const> Png;
+
+        static constexpr size_t MaxTables = 4;
+
+    private:
+        struct Entry {
+            Png Data;
+            std::list<string>::iterator LruPosition;
+        };
+
+        std::mutex m_mut;
+        const uint64_t m_maxSize;
+        uint64_t m_size;
+
+        // most recently used at the front
+        std::list<string> m_lru;
+        map<string, Entry> m_rendered;
+
+        // most recently used at the front
+        std::list<std::shared_ptr<ColorTable const>> m_tables;
+
+        std::shared_ptr<ColorTable const> TableFor(float minVal, float maxVal);
+
+        // drops the least recently used renderings until the rest fit in the size limit
+        void Keep(string const& tag, Png const& png);
+
+    public:
+        // The rendering kept under the tag, nullptr if there isn't one
+        Png Find(string const& tag);
+
+        // Renders the tile, or returns the rendering kept under the tag, nullptr if the PNG can't be written
+        // Renderings with an empty tag aren't kept
+        Png Render(string const& tag, uint16_t const* samples, int width, int height, bool swapped, float minVal, float maxVal);
+
+        PreviewRenderer(uint64_t maxSize);
+    };
+
+    // Renders a preview of a tile through ColorMap for every sample and through a table, with and without
+    // SIMD, then encodes it with a range of PNG settings and writes how fast each was
+    // samples are in the byte order of this machine
+    void BenchmarkPreview(uint16_t const* samples, int width, int height, std::ostream& out);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+// HT_X86 is defined when building for x86-64, where the intrinsics are available
+// HT_TARGET(isa) lets one function use instructions beyond those the whole program is built for
+#if defined(__x86_64__) || defined(_M_X64)
+#define HT_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define HT_TARGET(isa)
+#else
+#define HT_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
@@ -0,0 +1,393 @@
+#include "TileArchive.hpp"
+
+#include "Http.hpp"
+
+#include <zlib.h>
+
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+namespace HyperTiler {
+    // Compression of directories and tiles as recorded in the header
+    enum ArchiveCompression : uint8_t {
+        CompressionUnknown = 0,
+        CompressionNone = 1,
+        CompressionGzip = 2,
+        CompressionBrotli = 3,
+        CompressionZstd = 4
+    };
+
+    static constexpr size_t HeaderSize = 127;
+
+    static vector<uint8_t> Gunzip(vector<uint8_t> const& data) {
+        z_stream stream{};
+        htAssert(inflateInit2(&stream, 32 + MAX_WBITS) == Z_OK);
+
+        vector<uint8_t> res(std::max<size_t>(data.size() * 4, 4096));
+        stream.next_in = const_cast<Bytef*>(data.data());
+        stream.avail_in = static_cast<uInt>(data.size());
+
+        int ret;
+        do {
+            if (stream.total_out == res.size()) res.resize(res.size() * 2);
+            stream.next_out = res.data() + stream.total_out;
+            stream.avail_out = static_cast<uInt>(res.size() - stream.total_out);
+            ret = inflate(&stream, Z_NO_FLUSH);
+        } while (ret == Z_OK);
+
+        res.resize(stream.total_out);
+        inflateEnd(&stream);
+
+        if (ret != Z_STREAM_END) throw std::runtime_error("Corrupt gzip data");
+        return res;
+    }
+
+    static vector<uint8_t> Decompress(vector<uint8_t>&& data, uint8_t compression) {
+        if (compression == CompressionGzip) return Gunzip(data);
+        return std::move(data);
+    }
+
+    static bool IsSupported(uint8_t compression) {
+        return compression == CompressionUnknown || compression == CompressionNone || compression == CompressionGzip;
+    }
+
+    bool TileArchive::ReadRange(uint64_t offset, uint64_t length, vector<uint8_t>& data, ResourceStamp& stamp, bool& missing) const {
+        missing = false;
+        data.clear();
+
+        if (m_isNetworkResource) {
+            long status = 0;
+            data = ReadUrlRange(m_path, offset, length, &stamp, &status);
+            missing = status == 404 || status == 410;
+            if (status == 200 && length < stamp.Size && !m_warnedNoRanges.exchange(true)) {
+                std::cout << m_path << " doesn't support range requests, every read downloads the whole archive\n";
+            }
+            return status == 200 || status == 206;
+        }
+
+        if (!GetFileStamp(m_path, stamp)) {
+            missing = true;
+            return false;
+        }
+        if (offset >= stamp.Size) return true;
+
+        std::ifstream f(m_path, std::ios::binary);
+        if (!f) return false;
+        data.resize(static_cast<size_t>(std::min(length, stamp.Size - offset)));
+        f.seekg(static_cast<std::streamoff>(offset));
+        f.read(reinterpret_cast<char*>(data.data()), data.size());
+        return static_cast<bool>(f);
+    }
+
+    bool TileArchive::Load(bool& missing) {
+        missing = false;
+        if (m_loaded) return true;
+
+        vector<uint8_t> start;
+        ResourceStamp stamp;
+        if (!ReadRange(0, InitialRead, start, stamp, missing)) return false;
+
+        if (start.size() < HeaderSize || memcmp(start.data(), "PMTiles", 7) != 0) {
+            throw std::runtime_error(m_path + " is not a PMTiles archive");
+        }
+        if (start[7] != 3) {
+            throw std::runtime_error(m_path + " is a PMTiles archive of unsupported version " + std::to_string(start[7]));
+        }
+
+        auto readU64 = [&start](size_t at) {
+            uint64_t res = 0;
+            for (size_t i = 0; i < 8; ++i) res |= static_cast<uint64_t>(start[at + i]) << (8 * i);
+            return res;
+        };
+
+        Header header;
+        header.RootOffset = readU64(8);
+        header.RootLength = readU64(16);
+        header.LeafOffset = readU64(40);
+        header.LeafLength = readU64(48);
+        header.DataOffset = readU64(56);
+        header.DataLength = readU64(64);
+        header.InternalCompression = start[97];
+        header.TileCompression = start[98];
+        header.MinZoom = start[100];
+        header.MaxZoom = start[101];
+
+        if (!IsSupported(header.InternalCompression) || !IsSupported(header.TileCompression)) {
+            throw std::runtime_error(m_path + " uses a compression other than gzip");
+        }
+
+        // The root directory is normally part of the first read
+        vector<uint8_t> root;
+        if (header.RootOffset + header.RootLength <= start.size()) {
+            root.assign(start.begin() + header.RootOffset, start.begin() + header.RootOffset + header.RootLength);
+        } else {
+            ResourceStamp rootStamp;
+            if (!ReadRange(header.RootOffset, header.RootLength, root, rootStamp, missing)) return false;
+            if (root.size() != header.RootLength) return false;
+        }
+
+        m_root = ParseDirectory(Decompress(std::move(root), header.InternalCompression));
+        m_leaves.clear();
+        m_header = header;
+        m_stamp = stamp;
+        m_stampChecked = std::chrono::steady_clock::now();
+        m_loaded = true;
+        return true;
+    }
+
+    vector<TileArchive::Entry> TileArchive::ParseDirectory(vector<uint8_t> const& data) const {
+        size_t pos = 0;
+        auto readVarint = [&]() {
+            uint64_t res = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                if (pos >= data.size()) break;
+                const uint8_t byte = data[pos++];
+                res |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) return res;
+            }
+            throw std::runtime_error("Malformed directory in " + m_path);
+        };
+
+        // Every entry takes at least four bytes
+        const uint64_t numEntries = readVarint();
+        if (numEntries > data.size() / 4) throw std::runtime_error("Malformed directory in " + m_path);
+
+        vector<Entry> entries(static_cast<size_t>(numEntries));
+
+        // Stored column by column, tile ids as differences from the previous one
+        uint64_t lastId = 0;
+        for (Entry& entry : entries) {
+            lastId += readVarint();
+            entry.TileId = lastId;
+        }
+        for (Entry& entry : entries) entry.RunLength = static_cast<uint32_t>(readVarint());
+        for (Entry& entry : entries) entry.Length = static_cast<uint32_t>(readVarint());
+
+        // Zero means the data directly follows the previous entry's, otherwise the offset plus one
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const uint64_t value = readVarint();
+            if (value == 0) {
+                if (i == 0) throw std::runtime_error("Malformed directory in " + m_path);
+                entries[i].Offset = entries[i - 1].Offset + entries[i - 1].Length;
+            } else {
+                entries[i].Offset = value - 1;
+            }
+        }
+
+        return entries;
+    }
+
+    TileArchive::Location TileArchive::Locate(ivec3 const& coord, Entry& entry) {
+        const int zoom = static_cast<int>(m_header.MaxZoom) - coord.z;
+        if (zoom < static_cast<int>(m_header.MinZoom) || zoom < 0 || zoom > 31) return Location::Missing;
+
+        const uint64_t extent = uint64_t(1) << zoom;
+        if (coord.x < 0 || coord.y < 0 || static_cast<uint64_t>(coord.x) >= extent || static_cast<uint64_t>(coord.y) >= extent) return Location::Missing;
+
+        const uint64_t tileId = TileId(zoom, coord.x, coord.y);
+
+        // PMTiles nests at most three levels of leaf directories
+        vector<Entry> const* directory = &m_root;
+        for (int depth = 0; depth < 4; ++depth) {
+            auto const found = std::upper_bound(directory->begin(), directory->end(), tileId, [](uint64_t id, Entry const& e) { return id < e.TileId; });
+            if (found == directory->begin()) return Location::Missing;
+
+            Entry const& candidate = *(found - 1);
+            if (candidate.RunLength > 0) {
+                if (tileId >= candidate.TileId + candidate.RunLength) return Location::Missing;
+                entry = candidate;
+                return Location::Found;
+            }
+
+            auto leaf = m_leaves.find(candidate.Offset);
+            if (leaf == m_leaves.end()) {
+                vector<uint8_t> data;
+                ResourceStamp stamp;
+                bool missing;
+                if (!ReadRange(m_header.LeafOffset + candidate.Offset, candidate.Length, data, stamp, missing)) return Location::Unavailable;
+                if (data.size() != candidate.Length) return Location::Unavailable;
+
+                leaf = m_leaves.emplace(candidate.Offset, ParseDirectory(Decompress(std::move(data), m_header.InternalCompression))).first;
+            }
+            directory = &leaf->second;
+        }
+
+        throw std::runtime_error("Directories of " + m_path + " are nested too deeply");
+    }
+
+    bool TileArchive::SameArchive(ResourceStamp const& stamp) {
+        if (m_stamp.Matches(stamp)) return true;
+
+        m_loaded = false;
+        m_leaves.clear();
+        return false;
+    }
+
+    void TileArchive::ReadTilesOnce(vector<Tile>& tiles, ResourceStamp& stamp, bool& changed) {
+        changed = false;
+
+        struct Located {
+            size_t Index;
+            Entry Tile;
+        };
+        vector<Located> located;
+        Header header;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+
+            bool missing = false;
+            if (!Load(missing)) {
+                for (Tile& tile : tiles) tile.Missing = missing;
+                return;
+            }
+
+            header = m_header;
+            stamp = m_stamp;
+
+            for (size_t i = 0; i < tiles.size(); ++i) {
+                Entry entry;
+                const Location location = Locate(tiles[i].Coord, entry);
+                if (location == Location::Found) located.push_back(Located{ i, entry });
+                tiles[i].Missing = location == Location::Missing;
+            }
+        }
+
+        std::sort(located.begin(), located.end(), [](Located const& a, Located const& b) { return a.Tile.Offset < b.Tile.Offset; });
+
+        // Identical tiles are stored once, so ranges can overlap as well as be adjacent
+        for (size_t begin = 0; begin < located.size(); ) {
+            const uint64_t start = located[begin].Tile.Offset;
+            uint64_t end = start + located[begin].Tile.Length;
+
+            size_t last = begin + 1;
+            for (; last < located.size(); ++last) {
+                Entry const& next = located[last].Tile;
+                const uint64_t nextEnd = std::max(end, next.Offset + next.Length);
+                if (next.Offset > end + MaxGap || nextEnd - start > MaxRange) break;
+                end = nextEnd;
+            }
+
+            vector<uint8_t> data;
+            ResourceStamp readStamp;
+            bool missing;
+            const bool read = ReadRange(header.DataOffset + start, end - start, data, readStamp, missing);
+
+            if (read) {
+                std::lock_guard<std::mutex> lock(m_mut);
+                if (!SameArchive(readStamp)) {
+                    changed = true;
+                    return;
+                }
+            }
+
+            if (read && data.size() == end - start) {
+                for (size_t i = begin; i < last; ++i) {
+                    Entry const& entry = located[i].Tile;
+                    Tile& tile = tiles[located[i].Index];
+
+                    auto const first = data.begin() + (entry.Offset - start);
+                    try {
+                        tile.Data = Decompress(vector<uint8_t>(first, first + entry.Length), header.TileCompression);
+                    } catch (std::exception const& ex) {
+                        std::cout << "Tile " << tile.Coord.z << "/" << tile.Coord.x << "/" << tile.Coord.y << " of " << m_path << " is unreadable: " << ex.what() << "\n";
+                        tile.Data.clear();
+                    }
+                }
+            }
+
+            begin = last;
+        }
+    }
+
+    uint64_t TileArchive::TileId(int zoom, uint64_t x, uint64_t y) {
+        // Tiles of all lower zoom levels come first
+        uint64_t id = ((uint64_t(1) << (2 * zoom)) - 1) / 3;
+
+        for (uint64_t s = zoom > 0 ? uint64_t(1) << (zoom - 1) : 0; s > 0; s /= 2) {
+            const uint64_t rx = (x & s) ? 1 : 0;
+            const uint64_t ry = (y & s) ? 1 : 0;
+            id += s * s * ((3 * rx) ^ ry);
+
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = s - 1 - x;
+                    y = s - 1 - y;
+                }
+                std::swap(x, y);
+            }
+        }
+
+        return id;
+    }
+
+    TileArchive& TileArchive::Open(URI const& format) {
+        static std::mutex mut;
+        static map<string, std::unique_ptr<TileArchive>> archives;
+
+        const string path = format.ArchivePath();
+
+        std::lock_guard<std::mutex> lock(mut);
+        std::unique_ptr<TileArchive>& archive = archives[path];
+        if (!archive) archive.reset(new TileArchive(path, format.IsNetworkResource()));
+        return *archive;
+    }
+
+    bool TileArchive::CurrentStamp(ResourceStamp& stamp) {
+        std::lock_guard<std::mutex> lock(m_mut);
+
+        const auto now = std::chrono::steady_clock::now();
+        if (m_loaded && now - m_stampChecked < StampLifetime) {
+            stamp = m_stamp;
+            return true;
+        }
+
+        ResourceStamp current;
+        if (!(m_isNetworkResource ? GetUrlStamp(m_path, current) : GetFileStamp(m_path, current))) return false;
+
+        if (m_loaded && SameArchive(current)) m_stampChecked = now;
+
+        stamp = current;
+        return true;
+    }
+
+    bool TileArchive::Exists(ivec3 const& coord) {
+        std::lock_guard<std::mutex> lock(m_mut);
+
+        bool missing;
+        if (!Load(missing)) return false;
+
+        Entry entry;
+        return Locate(coord, entry) == Location::Found;
+    }
+
+    void TileArchive::ReadTiles(vector<Tile>& tiles, ResourceStamp& stamp) {
+        bool changed;
+        ReadTilesOnce(tiles, stamp, changed);
+        if (!changed) return;
+
+        // The archive was replaced while reading, so offsets from the old directories are meaningless
+        for (Tile& tile : tiles) {
+            tile.Data.clear();
+            tile.Missing = false;
+        }
+        ReadTilesOnce(tiles, stamp, changed);
+        if (!changed) return;
+
+        for (Tile& tile : tiles) tile.Data.clear();
+    }
+
+    TileArchive::TileArchive(string const& path, bool isNetworkResource)
+    : m_path(path)
+    , m_isNetworkResource(isNetworkResource)
+    , m_warnedNoRanges(false)
+    , m_loaded(false)
+    , m_header()
+    , m_stamp()
+    , m_stampChecked()
+    , m_root()
+    , m_leaves()
+    { }
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "Util.hpp"
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+namespace HyperTiler {
+    // Reads tiles out of a single PMTiles (version 3) archive, local or remote, instead of one file per
+    // tile. The header and root directory are read once with the first request, leaf directories when a
+    // tile first needs them, and tiles are read with HTTP range requests. Tiles that lie close together
+    // in the archive are read with one request, which with the Hilbert ordering of PMTiles are usually
+    // tiles that are close together on the map.
+    // Tiles are named "<archive>#{z}/{x}/{y}", where z counts levels down from the most detailed zoom
+    // level in the archive, so input tiles at level 0 are its most detailed tiles. Thread safe.
+    class TileArchive {
+    public:
+        struct Tile {
+            ivec3 Coord;
+
+            // empty if the tile couldn't be read
+            vector<uint8_t> Data;
+
+            // the archive definitely doesn't have the tile
+            bool Missing = false;
+        };
+
+    private:
+        struct Header {
+            uint64_t RootOffset = 0;
+            uint64_t RootLength = 0;
+            uint64_t LeafOffset = 0;
+            uint64_t LeafLength = 0;
+            uint64_t DataOffset = 0;
+            uint64_t DataLength = 0;
+            uint8_t InternalCompression = 0;
+            uint8_t TileCompression = 0;
+            uint8_t MinZoom = 0;
+            uint8_t MaxZoom = 0;
+        };
+
+        // A run of tiles with the same data, or a leaf directory if RunLength is 0
+        struct Entry {
+            uint64_t TileId = 0;
+            uint64_t Offset = 0;
+            uint32_t Length = 0;
+            uint32_t RunLength = 0;
+        };
+
+        const string m_path;
+        const bool m_isNetworkResource;
+        mutable std::atomic_bool m_warnedNoRanges;
+
+        std::mutex m_mut;
+        bool m_loaded;
+        Header m_header;
+        ResourceStamp m_stamp;
+        std::chrono::steady_clock::time_point m_stampChecked;
+        vector<Entry> m_root;
+
+        // keyed by offset in the leaf directory section
+        map<uint64_t, vector<Entry>> m_leaves;
+
+        enum class Location {
+            Found,
+            Missing,
+
+            // a directory on the way couldn't be read
+            Unavailable
+        };
+
+        // Returns false if the range couldn't be read, missing is set if the archive doesn't exist
+        // data is shorter than length if the archive ends first
+        bool ReadRange(uint64_t offset, uint64_t length, vector<uint8_t>& data, ResourceStamp& stamp, bool& missing) const;
+
+        // Reads the header and root directory if they aren't loaded, the lock must be held
+        // Returns false if they couldn't be read, missing is set if the archive doesn't exist
+        bool Load(bool& missing);
+        vector<Entry> ParseDirectory(vector<uint8_t> const& data) const;
+
+        // Finds the entry of a tile, reading leaf directories on the way, the lock must be held
+        Location Locate(ivec3 const& coord, Entry& entry);
+
+        // False if the stamp shows the archive changed since its directories were read, which then need reading again
+        bool SameArchive(ResourceStamp const& stamp);
+
+        void ReadTilesOnce(vector<Tile>& tiles, ResourceStamp& stamp, bool& changed);
+
+        TileArchive(string const& path, bool isNetworkResource);
+    public:
+        // Tiles further apart than this are read with separate requests, the gap is read and discarded otherwise
+        static constexpr uint64_t MaxGap = 64 * 1024;
+        static constexpr uint64_t MaxRange = 16 * 1024 * 1024;
+
+        // The header and root directory are within this many bytes at the start of the archive
+        static constexpr uint64_t InitialRead = 16384;
+
+        // How long the stamp of the archive is trusted before asking its source again
+        static constexpr std::chrono::seconds StampLifetime = std::chrono::seconds(10);
+
+        // Position of a tile along the Hilbert curves of all zoom levels, as used by PMTiles
+        static uint64_t TileId(int zoom, uint64_t x, uint64_t y);
+
+        // One reader per archive for the whole process, format is the tile format string of a dataset
+        static TileArchive& Open(URI const& format);
+
+        // The stamp of every tile in the archive, false if the archive doesn't exist
+        bool CurrentStamp(ResourceStamp& stamp);
+
+        bool Exists(ivec3 const& coord);
+
+        // Reads the tiles, nearby ones together, stamp receives the stamp of the archive they were read from
+        void ReadTiles(vector<Tile>& tiles, ResourceStamp& stamp);
+    private:
+        TileArchive(TileArchive const& other) = delete;
+        TileArchive& operator=(TileArchive const& other) = delete;
+    };
+}
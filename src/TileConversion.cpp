@@ -1,17 +1,23 @@
 #include "TileConversion.hpp"
-#include "DatasetCache.hpp"
+#include "MemoryGovernor.hpp"
+#include "FileBatcher.hpp"
+#include "MemoryArena.hpp"
 
 #include <iostream>
 #include <chrono>
 
 #include "ImageUtils.hpp"
+#include "ElevationCodec.hpp"
 #include "jsonUtils.hpp"
 #include "Config.hpp"
 
 namespace HyperTiler {
-    typedef std::function<uint8_t const* (ivec2 const&)> LoadFunc;
+    typedef std::function<TileService::Handle (ivec2 const&)> LoadFunc;
     typedef std::function<void(ivec3 const&, uint8_t*)> StoreFunc;
 
+    // Encoded output tiles are written in batches of this many
+    constexpr size_t OutputWriteBatch = 16;
+
     // return, as a set of coordinates in gridspace
     DiscreteAABB2<int> GetCoveredTiles(DiscreteAABB2<int> const& PixelRegion, ivec2 const& TileSize) {
         return DiscreteAABB2<int>(
@@ -34,6 +40,20 @@ namespace HyperTiler {
         }
     };
 
+    // Adds the samples of one region of an input tile, swapping their bytes on the way if the tile is
+    // still in the byte order of its source
+    template<bool Swap>
+    void AddRegionSamples(ConversionSpatialConfig const& Conf, SampleRegion const& Region, ivec3 const& OutputCoord, ivec2 const& MyPixelBegin, uint16_t const* Data, ImageSamples& Samples) {
+        const ivec2 InputCoordTexelBegin = Conf.InputCoordTexels(Region.InputCoord).Begin;
+
+        for (ivec2 Pixel : Region.PixelRegion) {
+            ivec2 MyPixel = (Pixel + InputCoordTexelBegin - MyPixelBegin) >> OutputCoord.z;
+            Pixel = Conf.InputTileSize - 1 - Pixel;
+            const uint16_t Value = Data[Pixel.y * Conf.InputTileSize.x + Pixel.x];
+            Samples.AddSample(MyPixel, Swap ? SwapBytes(Value) : Value);
+        }
+    }
+
     // TODO: Make this json serializable
     struct Job {
         ivec3                   OutputCoord;
@@ -49,17 +69,18 @@ namespace HyperTiler {
             for (SampleRegion const& Region : Regions) {
                 if (!RunningFlag) return true;
 
-                const auto Data = reinterpret_cast<const uint16_t*>(Load(Region.InputCoord));
+                // Keeps the tile in the cache until this region is sampled
+                const TileService::Handle Tile = Load(Region.InputCoord);
 
-                if (!Data)
+                if (!Tile)
                     continue;
 
-                const ivec2 InputCoordTexelBegin = Conf.InputCoordTexels(Region.InputCoord).Begin;
+                const auto Data = reinterpret_cast<const uint16_t*>(Tile.Data());
 
-                for (ivec2 Pixel : Region.PixelRegion) {
-                    ivec2 MyPixel = (Pixel + InputCoordTexelBegin - MyPixelBegin) >> OutputCoord.z;
-                    Pixel = Conf.InputTileSize - 1 - Pixel;
-                    Samples.AddSample(MyPixel, Data[Pixel.y * Conf.InputTileSize.x + Pixel.x]);
+                if (Tile.NeedsSwap()) {
+                    AddRegionSamples<true>(Conf, Region, OutputCoord, MyPixelBegin, Data, Samples);
+                } else {
+                    AddRegionSamples<false>(Conf, Region, OutputCoord, MyPixelBegin, Data, Samples);
                 }
             }
 
@@ -132,64 +153,205 @@ namespace HyperTiler {
         return errors;
     }
     
-    bool Convert(Config const& Conf, LogStreamFunc const& StreamLog, std::atomic_bool& RunningFlag) {
-        const auto Jobs = GenJobs(Conf.SpatialConfig);
+    uint64_t EffectiveMemoryBudget(ConversionOptimizationConfig const& Conf) {
+        const uint64_t SystemLimit = MemoryGovernor::SystemMemoryLimit();
+        if (SystemLimit == 0) return Conf.availableMemory;
+        if (Conf.availableMemory == 0) return SystemLimit / 2;
+        return std::min(Conf.availableMemory, SystemLimit / 4 * 3);
+    }
 
-        ImageSamples Samples(Conf.SpatialConfig.OutputTileSize);
-        DatasetCache Cache(".htcache/", Conf.SpatialConfig.InputTileSize.x * Conf.SpatialConfig.InputTileSize.y * 2, 128, false);
+    // Divides the memory budget between the stages of the conversion
+    // Buffers with a known size are planned first and the input cache gets whatever is left
+    // Returns the number of bytes the input cache may hold
+    uint64_t PlanMemory(MemoryGovernor& Governor, Config const& Conf, uint64_t InFileSize, uint64_t OutFileSize, int NumWorkers) {
+        const uint64_t OutputArea = static_cast<uint64_t>(Conf.SpatialConfig.OutputTileSize.x) * Conf.SpatialConfig.OutputTileSize.y;
 
-        const uint64_t InFileSize = Conf.SpatialConfig.InputTileSize.x * Conf.SpatialConfig.InputTileSize.y * Conf.DatasetConfig.InputEncoding.BitDepth / 8;
-        
-        const bool IsFilesystemResource = Conf.DatasetConfig.InputURIFormat.IsFilesystemResource();
-        // loads and caches
-        LoadFunc Load = [IsFilesystemResource, &Cache, &Conf, InFileSize, StreamLog](ivec2 const& loc) -> uint8_t* {
-            auto tp0 = std::chrono::system_clock::now();
-            
-            // Get the name of this resource... could be made a lot faster but I doubt this line will be the bottleneck
-            const string Name = FormatTileString(Conf.DatasetConfig.InputURIFormat, ivec3(loc, 0));
+        // ImageSamples keeps a sum and a count per pixel
+        Governor.SetLimit(MemoryPool::Accumulators, NumWorkers * OutputArea * (sizeof(uint64_t) + sizeof(int)));
 
-            // Early return if its a file and the specified file doesn't exist
-            if (IsFilesystemResource && !FileExists(Name)) return nullptr;
+        // Generated data plus the encoded copies waiting to be written, which are assumed to be no larger
+        Governor.SetLimit(MemoryPool::EncodeBuffers, NumWorkers * OutFileSize * (1 + OutputWriteBatch));
 
-            if (Cache.IsInCache(Name)) return Cache[Name].Data;
+        // Room for the prefetch window, which is twice the requests kept in flight
+        const uint64_t PrefetchBytes = InFileSize * std::max(Conf.OptimizationConfig.maxDownloads, 1) * 2;
+        Governor.SetLimit(MemoryPool::Downloads, std::max(InFileSize, std::min(PrefetchBytes, Governor.Budget() / 8)));
 
-            auto RawData = IsFilesystemResource ? ReadEntireFileBinary(Name) : ReadEntireUrlBinary(Name);
+        // Cached tiles take up a whole slot of their size class
+        const uint64_t SlotSize = SlabAllocator::SizeClassOf(InFileSize);
+        const uint64_t Slots = Governor.Unassigned() / SlotSize;
+        if (Slots < 4) {
+            std::cout << "Memory budget of " << Governor.Budget() << " bytes leaves room for only " << Slots << " cached input tiles\n";
+        }
 
-            if (RawData.empty()) return nullptr;
+        const uint64_t CacheBudget = std::max(Slots, uint64_t(1)) * SlotSize;
+        Governor.SetLimit(MemoryPool::InputCache, CacheBudget);
+        return CacheBudget;
+    }
+    
+    bool Convert(Config const& Conf, TileService& Tiles, LogStreamFunc const& StreamLog, std::atomic_bool& RunningFlag) {
+        const auto Jobs = GenJobs(Conf.SpatialConfig);
+
+        const uint64_t InFileSize = Conf.SpatialConfig.InputTileSize.x * Conf.SpatialConfig.InputTileSize.y * Conf.DatasetConfig.InputEncoding.BitDepth / 8;
+        const uint64_t OutFileSize = Conf.SpatialConfig.OutputTileSize.x * Conf.SpatialConfig.OutputTileSize.y * Conf.DatasetConfig.OutputEncoding.BitDepth / 8;
+
+        MemoryGovernor Governor(EffectiveMemoryBudget(Conf.OptimizationConfig));
+        const uint64_t CacheBudget = PlanMemory(Governor, Conf, InFileSize, OutFileSize, 1);
 
-            auto tp1 = std::chrono::system_clock::now();
+        // The shared cache keeps this budget afterwards, so previews can use the tiles this conversion loaded
+        MemoryReservation CacheMemory(Governor, MemoryPool::InputCache, CacheBudget, RunningFlag);
+        Tiles.Configure(Conf.OptimizationConfig, CacheBudget);
 
-            std::cout << "Loading took " << (tp1 - tp0).count() / 1000000 << " ms\n";
+        // Sources are checked for changes once per conversion
+        Tiles.Revalidate();
+        DatasetCache::Dataset const& Input = Tiles.AddDataset(Conf.InputDataset());
 
-            //std::cout << "Loaded resource " << Name << "\n";
+        MemoryReservation SamplesMemory(Governor, MemoryPool::Accumulators, Governor.Limit(MemoryPool::Accumulators), RunningFlag);
+        ImageSamples Samples(Conf.SpatialConfig.OutputTileSize);
 
-            if (Conf.DatasetConfig.InputEncoding.Encoding == FormatEncoding::PNG) {
-                RawData = ReadPng(RawData, false).data;
+        StreamLog(new MemoryUsageItem(Governor.Usage()));
+
+        // A manifest of the inputs made beforehand, by the UI for instance, saves fetching tiles that don't exist
+        std::shared_ptr<TileManifest const> Known;
+        {
+            ivec2 InputBegin(std::numeric_limits<int>::max());
+            ivec2 InputEnd(std::numeric_limits<int>::min());
+            for (Job const& j : Jobs) {
+                for (SampleRegion const& Region : j.Regions) {
+                    InputBegin = ivec2(std::min(InputBegin.x, Region.InputCoord.x), std::min(InputBegin.y, Region.InputCoord.y));
+                    InputEnd = ivec2(std::max(InputEnd.x, Region.InputCoord.x + 1), std::max(InputEnd.y, Region.InputCoord.y + 1));
+                }
             }
+            if (InputBegin.x < InputEnd.x) Known = Tiles.FindManifest(Input.Config.Format, ivec3(InputBegin, 0), ivec3(InputEnd, 1));
+        }
+        if (Known) std::cout << "Using a manifest of " << Known->Count() << " input tiles\n";
+
+        // loads and caches
+        LoadFunc Load = [&Tiles, &Input, &Governor, StreamLog, &RunningFlag, &Known](ivec2 const& loc) -> TileService::Handle {
+            if (Known && !Known->Has(ivec3(loc, 0))) return TileService::Handle();
+
+            TileService::Handle Tile = Tiles.Load(Input, ivec3(loc, 0), &Governor, &RunningFlag);
 
-            if (Conf.DatasetConfig.InputEncoding.SwapEndian) {
-                htAssert(Conf.DatasetConfig.InputEncoding.BitDepth == 16);
-                for (int i = 0; i < RawData.size(); i += 2)
-                    std::swap(RawData[i], RawData[i + 1]);
+            if (Tile.Fetched()) {
+                std::cout << "Loading took " << std::chrono::duration_cast<std::chrono::milliseconds>(Tile.FetchTime()).count() << " ms\n";
+                StreamLog(new TileLoadedItem(ivec3(loc.x, loc.y, 0), Tile.FetchTime()));
             }
 
-            auto Data = Cache[Name];
+            return Tile;
+        };
 
-            memcpy(Data.Data, RawData.data(), RawData.size());
+        // Input tiles in the order the jobs first need them, and how many of them are needed up to each job
+        vector<ivec2> InputOrder;
+        vector<size_t> JobFrontier;
+        {
+            set<pair<int, int>> Seen;
+            for (Job const& j : Jobs) {
+                for (SampleRegion const& Region : j.Regions) {
+                    if (Known && !Known->Has(ivec3(Region.InputCoord, 0))) continue;
+                    if (Seen.insert({ Region.InputCoord.x, Region.InputCoord.y }).second) InputOrder.push_back(Region.InputCoord);
+                }
+                JobFrontier.push_back(InputOrder.size());
+            }
+        }
 
-            auto tp2 = std::chrono::system_clock::now();
+        // Tiles are prefetched this far ahead of the job being processed, which has to be well within the
+        // cache or prefetched tiles are evicted before they are used
+        const uint64_t CacheSlots = CacheBudget / SlabAllocator::SizeClassOf(InFileSize);
+        const size_t PrefetchWindow = static_cast<size_t>(std::min(Governor.Limit(MemoryPool::Downloads) / InFileSize, CacheSlots / 2));
+        size_t Prefetched = 0;
+
+        // The tile being generated, each pending output reserves its own buffer
+        MemoryReservation GenerateMemory(Governor, MemoryPool::EncodeBuffers, OutFileSize, RunningFlag);
+
+        // Raw tiles are generated straight into a slot of their batch and written from there without being copied,
+        // slots are aligned and padded so they can be written with O_DIRECT
+        const bool RawOutput = Conf.DatasetConfig.WritesRaw();
+        const uint64_t SlotAlignment = std::max<uint64_t>(MemoryArena::PageSize(), FileBatcher::DirectAlignment);
+        const uint64_t RawSlotSize = (OutFileSize + SlotAlignment - 1) / SlotAlignment * SlotAlignment;
+        MemoryArena RawOutputs(RawOutput ? RawSlotSize * OutputWriteBatch : 0);
+        if (RawOutput) RawOutputs.Commit(RawOutputs.Data(), RawOutputs.Size());
+
+        // Samples are generated with the 16 bits of the input and converted to the output format in one pass,
+        // PNG output is swapped by WritePng
+        PixelFormat OutputSamples;
+        OutputSamples.BitDepth = Conf.DatasetConfig.OutputEncoding.BitDepth;
+        OutputSamples.Swapped = RawOutput && Conf.DatasetConfig.OutputEncoding.SwapEndian;
+        OutputSamples.Gamma = Conf.DatasetConfig.OutputEncoding.Gamma;
+        const PixelConverter OutputConverter(PixelFormat(), OutputSamples);
+
+        // Raw tiles that don't need converting are generated straight into their slot
+        const uint64_t OutputSampleCount = static_cast<uint64_t>(Conf.SpatialConfig.OutputTileSize.x) * Conf.SpatialConfig.OutputTileSize.y;
+        vector<uint8_t> OutputData(RawOutput && OutputConverter.IsIdentity() ? 0 : OutputSampleCount * 2, 0);
+
+        htAssert(RawOutput || Conf.DatasetConfig.OutputEncoding.BitDepth == 16);
+
+        struct PendingOutput {
+            ivec3 Coord;
+            vector<uint8_t> Data;
+
+            // Slot of a raw tile, which is written instead of Data
+            uint8_t const* RawData;
+            std::chrono::system_clock::duration GenerationTime;
+            std::chrono::system_clock::duration EncodingTime;
+
+            // released once the tile is written
+            MemoryReservation Memory;
+        };
+        vector<PendingOutput> PendingOutputs;
+        const TileFormat OutputFormat(Conf.DatasetConfig.OutputURIFormat);
+        const PngWriteOptions PngOptions = Conf.OptimizationConfig.PngOptions();
+
+        // Buffers of tiles that were written, encoded into again so they only grow to the largest tile once
+        vector<vector<uint8_t>> SpareOutputs;
+
+        // Tiles are reported as saved once they are written, each with its share of the time the batch took
+        auto const WriteOutputs = [&Conf, &OutFileSize, &OutputFormat, &StreamLog, &PendingOutputs, &SpareOutputs]() {
+            if (PendingOutputs.empty()) return;
+
+            const auto WriteStart = std::chrono::system_clock::now();
+            vector<FileWrite> Writes(PendingOutputs.size());
+            for (size_t i = 0; i < Writes.size(); ++i) {
+                Writes[i].Path = OutputFormat.Render(PendingOutputs[i].Coord);
+                if (PendingOutputs[i].RawData) {
+                    Writes[i].Data = PendingOutputs[i].RawData;
+                    Writes[i].Size = OutFileSize;
+                    Writes[i].Direct = Conf.OptimizationConfig.directOutput;
+                } else {
+                    Writes[i].Data = PendingOutputs[i].Data.data();
+                    Writes[i].Size = PendingOutputs[i].Data.size();
+                }
+            }
+            LocalFiles().Write(Writes);
+            const auto WriteTime = (std::chrono::system_clock::now() - WriteStart) / Writes.size();
 
-            StreamLog(new TileLoadedItem(ivec3(loc.x, loc.y, 0), tp2 - tp1));
+            for (size_t i = 0; i < Writes.size(); ++i) {
+                if (!Writes[i].Ok) std::cout << "Failed to write " << Writes[i].Path.string() << "\n";
+                StreamLog(new TileSavedItem(PendingOutputs[i].Coord, PendingOutputs[i].GenerationTime, PendingOutputs[i].EncodingTime + WriteTime));
+                if (!PendingOutputs[i].RawData) SpareOutputs.push_back(std::move(PendingOutputs[i].Data));
+            }
+            PendingOutputs.clear();
+        };
 
-            return Data.Data;
+        // Prefetches still on their way reserved their memory from the governor, which doesn't outlive this
+        auto const Finish = [&WriteOutputs, &Tiles, &Governor]() {
+            WriteOutputs();
+            Tiles.Flush();
+            Tiles.ForgetGovernor(Governor);
         };
 
-        vector<uint8_t> OutputData(Conf.SpatialConfig.OutputTileSize.x * Conf.SpatialConfig.OutputTileSize.y * Conf.DatasetConfig.OutputEncoding.BitDepth, 0);
+        for (size_t JobIndex = 0; JobIndex < Jobs.size(); ++JobIndex) {
+            if (!RunningFlag) {
+                Finish();
+                return true;
+            }
 
-        htAssert(Conf.DatasetConfig.OutputEncoding.BitDepth == 16);
+            Job const& j = Jobs[JobIndex];
 
-        for (Job const& j : Jobs) {
-            if (!RunningFlag) return true;
+            const size_t PrefetchEnd = std::min(InputOrder.size(), JobFrontier[JobIndex] + PrefetchWindow);
+            vector<ivec3> PrefetchCoords;
+            for (; Prefetched < PrefetchEnd; ++Prefetched) {
+                PrefetchCoords.push_back(ivec3(InputOrder[Prefetched], 0));
+            }
+            Tiles.Prefetch(Input, PrefetchCoords, &Governor, &RunningFlag);
 
             std::chrono::system_clock::time_point genStart = std::chrono::system_clock::now();
 
@@ -197,35 +359,61 @@ namespace HyperTiler {
             if (j.AddSamples(Conf.SpatialConfig, Load, Samples, RunningFlag)) {
                 // Didn't finish normally
                 std::cout << "Stopped during sampling, skipping tile output\n";
+                Finish();
                 return true;
             }
             std::cout << " ... " << Samples.GetTotalSamples() << " samples\n";
 
-            if (Conf.DatasetConfig.OutputEncoding.BitDepth == 8) {
-                Samples.GenerateData<uint8_t>(reinterpret_cast<uint8_t*>(OutputData.data()), 0);
-            } else if (Conf.DatasetConfig.OutputEncoding.BitDepth == 16) {
-                Samples.GenerateData<uint16_t>(reinterpret_cast<uint16_t*>(OutputData.data()), 0);
-            } else if (Conf.DatasetConfig.OutputEncoding.BitDepth == 32) {
-                Samples.GenerateData<uint32_t>(reinterpret_cast<uint32_t*>(OutputData.data()), 0);
-            } else if (Conf.DatasetConfig.OutputEncoding.BitDepth == 64) {
-                Samples.GenerateData<uint64_t>(reinterpret_cast<uint64_t*>(OutputData.data()), 0);
+            // Blocks while outputs waiting to be written fill the pool
+            MemoryReservation OutputMemory(Governor, MemoryPool::EncodeBuffers, OutFileSize, RunningFlag);
+            if (!OutputMemory.Valid()) {
+                Finish();
+                return true;
+            }
+
+            uint8_t* const Slot = RawOutput ? RawOutputs.Data() + PendingOutputs.size() * RawSlotSize : nullptr;
+            uint8_t* const Generated = OutputData.empty() ? Slot : OutputData.data();
+            Samples.GenerateData<uint16_t>(reinterpret_cast<uint16_t*>(Generated), 0);
+
+            if (!OutputConverter.IsIdentity()) OutputConverter.Convert(Generated, RawOutput ? Slot : Generated, OutputSampleCount);
+
+            if (RawOutput) {
+                Samples.Clear();
+
+                std::chrono::system_clock::time_point genEnd = std::chrono::system_clock::now();
+                PendingOutputs.push_back(PendingOutput{ j.OutputCoord, vector<uint8_t>(), Slot, genEnd - genStart, std::chrono::system_clock::duration::zero(), std::move(OutputMemory) });
+                if (PendingOutputs.size() == OutputWriteBatch) WriteOutputs();
+
+                StreamLog(new MemoryUsageItem(Governor.Usage()));
+                continue;
             }
 
             vector<uint8_t> FinalOutput;
+            if (!SpareOutputs.empty()) {
+                FinalOutput = std::move(SpareOutputs.back());
+                SpareOutputs.pop_back();
+            }
 
             std::chrono::system_clock::time_point genEnd = std::chrono::system_clock::now();
 
-            // This will work... because currently, only 16 bit single channel PNG output is supported
+            // This will work... because currently, only 16 bit single channel output is supported
             // But in the future more output modes will need to be supported
-            WritePng(FinalOutput, OutputData.data(), Conf.SpatialConfig.OutputTileSize.x, Conf.SpatialConfig.OutputTileSize.y, Conf.DatasetConfig.OutputEncoding.SwapEndian);
-            WriteEntireFileBinary(FormatTileString(Conf.DatasetConfig.OutputURIFormat, j.OutputCoord), FinalOutput);
+            if (Conf.DatasetConfig.OutputEncoding.Encoding == FormatEncoding::Elevation) {
+                WriteElevationTile(FinalOutput, reinterpret_cast<uint16_t const*>(OutputData.data()), Conf.SpatialConfig.OutputTileSize.x, Conf.SpatialConfig.OutputTileSize.y);
+            } else {
+                WritePng(FinalOutput, OutputData.data(), Conf.SpatialConfig.OutputTileSize.x, Conf.SpatialConfig.OutputTileSize.y, Conf.DatasetConfig.OutputEncoding.SwapEndian, PngOptions);
+            }
             Samples.Clear();
 
             std::chrono::system_clock::time_point saveEnd = std::chrono::system_clock::now();
 
-            StreamLog(new TileSavedItem(j.OutputCoord, genEnd - genStart, saveEnd - genEnd));
+            PendingOutputs.push_back(PendingOutput{ j.OutputCoord, std::move(FinalOutput), nullptr, genEnd - genStart, saveEnd - genEnd, std::move(OutputMemory) });
+            if (PendingOutputs.size() == OutputWriteBatch) WriteOutputs();
+
+            StreamLog(new MemoryUsageItem(Governor.Usage()));
         }
 
+        Finish();
         return true;
     }
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "TileUtils.hpp"
+#include "TileService.hpp"
 #include "Config.hpp"
 #include "jsonUtils.hpp"
 
@@ -59,6 +60,19 @@ namespace HyperTiler {
         }
     };
 
+    struct MemoryUsageItem : public LogItem {
+        json usage;
+        inline virtual json content() const override {
+            return {
+                {"type", json("MemoryUsageItem")},
+                {"usage", usage}
+            };
+        }
+        MemoryUsageItem(json usage)
+        : usage(usage)
+        { }
+    };
+
     struct Log {
         std::chrono::system_clock::time_point time;
         std::shared_ptr<LogItem> item;
@@ -71,5 +85,8 @@ namespace HyperTiler {
 
     typedef std::function<void(Log)> LogStreamFunc;
 
-    bool Convert(Config const& Conf, LogStreamFunc const& StreamLog, std::atomic_bool& RunningFlag);
+    // The memory budget a conversion with these settings will use
+    uint64_t EffectiveMemoryBudget(ConversionOptimizationConfig const& Conf);
+
+    bool Convert(Config const& Conf, TileService& Tiles, LogStreamFunc const& StreamLog, std::atomic_bool& RunningFlag);
 }
\ No newline at end of file
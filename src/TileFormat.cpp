@@ -0,0 +1,191 @@
+#include "TileFormat.hpp"
+
+#include <charconv>
+#include <algorithm>
+#include <stdexcept>
+
+namespace HyperTiler {
+    namespace {
+        // Enough for any int and its sign
+        constexpr size_t MaxDigits = 12;
+
+        // Digits of value, with its sign
+        size_t WriteInt(int value, char* out) {
+            return static_cast<size_t>(std::to_chars(out, out + MaxDigits, value).ptr - out);
+        }
+    }
+
+    URI const& TileFormat::Format() const {
+        return m_format;
+    }
+
+    vector<TileFormat::Segment> const& TileFormat::Segments() const {
+        return m_segments;
+    }
+
+    bool TileFormat::IsNetworkResource() const {
+        return m_isNetworkResource;
+    }
+
+    bool TileFormat::IsFilesystemResource() const {
+        return !m_isNetworkResource;
+    }
+
+    bool TileFormat::IsArchiveResource() const {
+        return m_isArchiveResource;
+    }
+
+    void TileFormat::Render(ivec3 const& coord, string& name) const {
+        name.clear();
+        name.reserve(m_literalSize + 3 * MaxDigits);
+
+        for (Segment const& segment : m_segments) {
+            if (segment.Axis < 0) {
+                name += segment.Literal;
+                continue;
+            }
+
+            char digits[MaxDigits];
+            const int value = coord[segment.Axis];
+            const size_t length = WriteInt(value, digits);
+
+            if (segment.Width == 0) {
+                name.append(digits, length);
+                continue;
+            }
+            if (length > static_cast<size_t>(segment.Width)) throw std::runtime_error("Int too large to fit in format string");
+
+            // Zeros go after the sign
+            const size_t sign = value < 0 ? 1 : 0;
+            name.append(digits, sign);
+            name.append(static_cast<size_t>(segment.Width) - length, '0');
+            name.append(digits + sign, length - sign);
+        }
+    }
+
+    string TileFormat::Render(ivec3 const& coord) const {
+        string name;
+        Render(coord, name);
+        return name;
+    }
+
+    bool TileFormat::Parse(std::string_view name, ivec3& coord) const {
+        return Match(m_segments.data(), m_segments.size(), name, coord);
+    }
+
+    bool TileFormat::Reversible() const {
+        // Only a character that can't be part of a number ends an unpadded one for sure, padded
+        // numbers and literal digits in between don't
+        bool unpadded = false;
+        for (Segment const& segment : m_segments) {
+            if (segment.Axis >= 0) {
+                if (segment.Width > 0) continue;
+                if (unpadded) return false;
+                unpadded = true;
+            } else if (segment.Literal.find_first_not_of("0123456789-") != string::npos) {
+                unpadded = false;
+            }
+        }
+        return true;
+    }
+
+    bool TileFormat::Match(Segment const* segments, size_t count, std::string_view name, ivec3& coord) {
+        if (count == 0) return name.empty();
+
+        Segment const& segment = segments[0];
+        if (segment.Axis < 0) {
+            if (name.substr(0, segment.Literal.size()) != segment.Literal) return false;
+            return Match(segments + 1, count - 1, name.substr(segment.Literal.size()), coord);
+        }
+
+        const size_t sign = !name.empty() && name[0] == '-' ? 1 : 0;
+        size_t digitsEnd = sign;
+        while (digitsEnd < name.size() && name[digitsEnd] >= '0' && name[digitsEnd] <= '9') ++digitsEnd;
+
+        // Longest number first, shorter ones only if the rest of the name doesn't match then
+        for (size_t end = digitsEnd; end > sign; --end) {
+            int value = 0;
+            const auto parsed = std::from_chars(name.data(), name.data() + end, value);
+            if (parsed.ec != std::errc() || parsed.ptr != name.data() + end) continue;
+
+            // Anything but what Render makes of the value, like extra zeros, isn't a name of this format
+            char digits[MaxDigits];
+            const size_t length = WriteInt(value, digits);
+            if (segment.Width == 0) {
+                if (std::string_view(digits, length) != name.substr(0, end)) continue;
+            } else {
+                // Exactly Width characters, zeros between the sign and the digits
+                if (end != static_cast<size_t>(segment.Width) || length > end || sign != (value < 0 ? 1u : 0u)) continue;
+
+                const size_t zeros = end - length;
+                if (name.substr(sign, zeros).find_first_not_of('0') != std::string_view::npos) continue;
+                if (name.substr(sign + zeros, length - sign) != std::string_view(digits + sign, length - sign)) continue;
+            }
+
+            coord[segment.Axis] = value;
+            if (Match(segments + 1, count - 1, name.substr(end), coord)) return true;
+        }
+
+        return false;
+    }
+
+    TileFormat::TileFormat(URI const& format)
+    : m_format(format)
+    , m_literalSize(0)
+    , m_isNetworkResource(format.IsNetworkResource())
+    , m_isArchiveResource(format.IsArchiveResource())
+    {
+        struct Field {
+            size_t Position;
+            size_t Length;
+            int Axis;
+            int Width;
+        };
+
+        // Same as the "{x[0-9]*}" FormatTileString searches for, the first of each axis is the coordinate
+        vector<Field> fields;
+        for (int axis = 0; axis < 3; ++axis) {
+            const char name = "xyz"[axis];
+
+            size_t pos = 0;
+            size_t end = 0;
+            while ((pos = format.find('{', pos)) != string::npos) {
+                end = pos + 1;
+                if (end < format.size() && format[end] == name) {
+                    ++end;
+                    while (end < format.size() && format[end] >= '0' && format[end] <= '9') ++end;
+                    if (end < format.size() && format[end] == '}') break;
+                }
+                ++pos;
+            }
+            if (pos == string::npos) throw std::runtime_error("Incorrect format string");
+
+            // "{x}" isn't padded, "{x0}" can't be formatted at all
+            const size_t length = end + 1 - pos;
+            int width = 0;
+            if (length > 3) {
+                std::from_chars(format.data() + pos + 2, format.data() + end, width);
+                if (width <= 0) throw std::runtime_error("Int too large to fit in format string");
+            }
+
+            fields.push_back({ pos, length, axis, width });
+        }
+        std::sort(fields.begin(), fields.end(), [](Field const& a, Field const& b) { return a.Position < b.Position; });
+
+        size_t pos = 0;
+        for (Field const& field : fields) {
+            if (field.Position > pos) m_segments.push_back({ format.substr(pos, field.Position - pos) });
+            m_segments.push_back({ string(), field.Axis, field.Width });
+            pos = field.Position + field.Length;
+        }
+        if (pos < format.size()) m_segments.push_back({ format.substr(pos) });
+
+        for (Segment const& segment : m_segments) m_literalSize += segment.Literal.size();
+    }
+
+    TileFormat::TileFormat()
+    : m_literalSize(0)
+    , m_isNetworkResource(false)
+    , m_isArchiveResource(false)
+    { }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "Util.hpp"
+
+#include <string_view>
+
+namespace HyperTiler {
+    // A format string like "tiles/{z}/{x}/{y4}.png" parsed once into its literal text and the coordinates
+    // in between, a coordinate is padded with zeros to the number of digits after its axis if there is one.
+    // Names are the same FormatTileString makes, without a regex or allocating, and can be read back into
+    // the coordinate they were made from.
+    class TileFormat {
+    public:
+        // Literal text, or a coordinate if Axis isn't negative
+        struct Segment {
+            string Literal;
+            int Axis = -1;
+
+            // digits the coordinate is padded to, 0 if it isn't padded
+            int Width = 0;
+        };
+
+    private:
+        URI m_format;
+        vector<Segment> m_segments;
+        size_t m_literalSize;
+        bool m_isNetworkResource;
+        bool m_isArchiveResource;
+
+    public:
+        URI const& Format() const;
+        vector<Segment> const& Segments() const;
+
+        bool IsNetworkResource() const;
+        bool IsFilesystemResource() const;
+        bool IsArchiveResource() const;
+
+        // Replaces the contents of name, which keeps its capacity, so reusing one name for many tiles doesn't allocate
+        // Throws if a coordinate has more digits than it is padded to
+        void Render(ivec3 const& coord, string& name) const;
+        string Render(ivec3 const& coord) const;
+
+        // Reads back the coordinate of a name, false if Render doesn't make the name for any coordinate
+        // If the format isn't Reversible, this is one of the coordinates it could be
+        bool Parse(std::string_view name, ivec3& coord) const;
+
+        // Whether every name is made from only one coordinate, which isn't the case if two unpadded
+        // coordinates only have digits between them, like "{x}{y}" or "{x}{y2}{z}", since their
+        // digits can be split in more than one way
+        bool Reversible() const;
+
+        // Matches a whole name against segments, longer numbers first, coordinates found are written to coord
+        static bool Match(Segment const* segments, size_t count, std::string_view name, ivec3& coord);
+
+        // Throws if the format doesn't have every axis or pads one to 0 digits, like FormatTileString does
+        TileFormat(URI const& format);
+        TileFormat();
+    };
+}
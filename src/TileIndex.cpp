@@ -0,0 +1,184 @@
+#include "TileIndex.hpp"
+
+#include <algorithm>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+namespace HyperTiler {
+    bool TileIndex::Parse(URI const& format) {
+        // Directory listings never give back backslashes
+        if (format.find('\\') != string::npos) return false;
+
+        std::unique_ptr<TileFormat> parsed;
+        try {
+            parsed = std::make_unique<TileFormat>(format);
+        } catch (std::runtime_error const&) {
+            return false;
+        }
+        if (!parsed->Reversible()) return false;
+
+        m_components.assign(1, vector<TileFormat::Segment>());
+        for (TileFormat::Segment const& segment : parsed->Segments()) {
+            if (segment.Axis >= 0) {
+                m_components.back().push_back(segment);
+                continue;
+            }
+
+            size_t pos = 0;
+            while (true) {
+                const size_t slash = segment.Literal.find('/', pos);
+                string const part = segment.Literal.substr(pos, slash == string::npos ? string::npos : slash - pos);
+                if (!part.empty() || (slash != string::npos && m_components.back().empty())) m_components.back().push_back({ part });
+                if (slash == string::npos) break;
+
+                m_components.emplace_back();
+                pos = slash + 1;
+            }
+        }
+        if (m_components.back().empty()) m_components.back().push_back({ string() });
+
+        return true;
+    }
+
+    void TileIndex::Scan(string const& prefix, size_t component, ivec3 coord, vector<pair<ivec3, uint64_t>>& found) const {
+        vector<TileFormat::Segment> const& segments = m_components[component];
+        const bool last = component + 1 == m_components.size();
+
+        std::error_code ec;
+
+        // Names without coordinates are entered without listing the directory they are in
+        if (segments.size() == 1 && segments[0].Axis < 0) {
+            string const name = prefix + segments[0].Literal;
+            if (!last) {
+                Scan(name + "/", component + 1, coord, found);
+            } else if (std::filesystem::is_regular_file(name, ec)) {
+                const uint64_t size = std::filesystem::file_size(name, ec);
+                if (!ec) found.push_back({ coord, size });
+            }
+            return;
+        }
+
+#ifndef _WIN32
+        // Entries are looked up relative to the open directory, which saves resolving the whole path of every tile
+        DIR* const dir = opendir(prefix.empty() ? "." : prefix.c_str());
+        if (!dir) return;
+
+        string name;
+        while (dirent const* entry = readdir(dir)) {
+            name = entry->d_name;
+
+            ivec3 matched = coord;
+            if (!TileFormat::Match(segments.data(), segments.size(), name, matched)) continue;
+
+            struct stat st;
+            if (fstatat(dirfd(dir), entry->d_name, &st, 0) != 0) continue;
+
+            if (!last) {
+                if (S_ISDIR(st.st_mode)) Scan(prefix + name + "/", component + 1, matched, found);
+            } else if (S_ISREG(st.st_mode)) {
+                found.push_back({ matched, static_cast<uint64_t>(st.st_size) });
+            }
+        }
+        closedir(dir);
+#else
+        std::filesystem::directory_iterator it(prefix.empty() ? path(".") : path(prefix), ec);
+        for (; !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+            string const name = it->path().filename().string();
+
+            ivec3 matched = coord;
+            if (!TileFormat::Match(segments.data(), segments.size(), name, matched)) continue;
+
+            if (!last) {
+                if (it->is_directory(ec)) Scan(prefix + name + "/", component + 1, matched, found);
+            } else if (it->is_regular_file(ec)) {
+                const uint64_t size = it->file_size(ec);
+                if (!ec) found.push_back({ matched, size });
+            }
+            ec.clear();
+        }
+#endif
+    }
+
+    int64_t TileIndex::BitOf(ivec3 const& coord, Level const*& level) const {
+        auto const it = m_levels.find(coord.z);
+        if (it == m_levels.end()) return -1;
+
+        level = &it->second;
+        const ivec2 local = ivec2(coord) - level->Begin;
+        if (local.x < 0 || local.y < 0 || local.x >= level->Size.x || local.y >= level->Size.y) return -1;
+
+        return static_cast<int64_t>(local.y) * level->Size.x + local.x;
+    }
+
+    TileIndex::TileIndex()
+    : m_count(0)
+    { }
+
+    std::shared_ptr<TileIndex const> TileIndex::Build(URI const& format) {
+        std::shared_ptr<TileIndex> index(new TileIndex());
+        if (!index->Parse(format)) return nullptr;
+
+        vector<pair<ivec3, uint64_t>> found;
+        index->Scan(string(), 0, ivec3(0), found);
+
+        // Nothing found might as well mean the listing went wrong, so it isn't trusted to say so
+        if (found.empty()) return nullptr;
+
+        map<int, pair<pair<ivec2, ivec2>, uint64_t>> bounds;
+        for (auto const& [coord, size] : found) {
+            auto it = bounds.find(coord.z);
+            if (it == bounds.end()) {
+                bounds[coord.z] = { { ivec2(coord), ivec2(coord) }, 1 };
+            } else {
+                ivec2& begin = it->second.first.first;
+                ivec2& end = it->second.first.second;
+                begin = ivec2(std::min(begin.x, coord.x), std::min(begin.y, coord.y));
+                end = ivec2(std::max(end.x, coord.x), std::max(end.y, coord.y));
+                ++it->second.second;
+            }
+        }
+
+        for (auto const& [z, levelBounds] : bounds) {
+            Level& level = index->m_levels[z];
+            level.Begin = levelBounds.first.first;
+            level.Size = levelBounds.first.second - levelBounds.first.first + 1;
+
+            const uint64_t area = static_cast<uint64_t>(level.Size.x) * static_cast<uint64_t>(level.Size.y);
+            if (area > std::max(MinBitmapSize, MaxBitsPerTile * levelBounds.second)) return nullptr;
+
+            level.Bits.resize((area + 63) / 64);
+            level.Sizes.resize(area);
+        }
+
+        for (auto const& [coord, size] : found) {
+            Level const* level = nullptr;
+            const int64_t bit = index->BitOf(coord, level);
+            Level& dst = index->m_levels[coord.z];
+            dst.Bits[bit / 64] |= 1ull << (bit % 64);
+            dst.Sizes[bit] = size;
+        }
+        index->m_count = found.size();
+
+        return index;
+    }
+
+    bool TileIndex::Exists(ivec3 const& coord) const {
+        Level const* level = nullptr;
+        const int64_t bit = BitOf(coord, level);
+        return bit >= 0 && (level->Bits[bit / 64] >> (bit % 64) & 1);
+    }
+
+    uint64_t TileIndex::TileSize(ivec3 const& coord) const {
+        Level const* level = nullptr;
+        const int64_t bit = BitOf(coord, level);
+        return bit >= 0 ? level->Sizes[bit] : 0;
+    }
+
+    size_t TileIndex::Count() const {
+        return m_count;
+    }
+}
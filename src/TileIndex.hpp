@@ -0,0 +1,51 @@
+#pragma once
+
+#include "TileFormat.hpp"
+
+namespace HyperTiler {
+    // Which tiles of a local dataset exist, found by listing its directories once and reading the
+    // coordinates back out of the file names with the format string, instead of looking for each tile
+    // on its own. Only directories the format string can lead to are listed. Every level is kept as a
+    // bitmap over the bounds of its tiles, along with the size of each file. Immutable once built.
+    class TileIndex {
+        struct Level {
+            ivec2 Begin;
+            ivec2 Size;
+            vector<uint64_t> Bits;
+            vector<uint64_t> Sizes;
+        };
+
+        // the format string split at every '/'
+        vector<vector<TileFormat::Segment>> m_components;
+        map<int, Level> m_levels;
+        size_t m_count;
+
+        // Returns false if names made by the format string can't be read back unambiguously
+        bool Parse(URI const& format);
+
+        // Lists the directory prefix leads to and matches its entries against the component
+        void Scan(string const& prefix, size_t component, ivec3 coord, vector<pair<ivec3, uint64_t>>& found) const;
+
+        // -1 if the level doesn't have the coordinate in its bounds
+        int64_t BitOf(ivec3 const& coord, Level const*& level) const;
+
+        TileIndex();
+    public:
+        // A level isn't indexed if its bounds have more than this many tiles for each tile that exists
+        static constexpr uint64_t MaxBitsPerTile = 64;
+
+        // Bounds smaller than this are always indexed
+        static constexpr uint64_t MinBitmapSize = 1ull << 16;
+
+        // nullptr if the format string can't be read backwards, no tiles were found, or the tiles are
+        // too far apart for bitmaps, tiles then have to be looked for one at a time
+        static std::shared_ptr<TileIndex const> Build(URI const& format);
+
+        bool Exists(ivec3 const& coord) const;
+
+        // 0 if the tile doesn't exist
+        uint64_t TileSize(ivec3 const& coord) const;
+
+        size_t Count() const;
+    };
+}
@@ -0,0 +1,90 @@
+#include "TileManifest.hpp"
+
+#include <bit>
+
+namespace HyperTiler {
+    uint64_t TileManifest::Volume(ivec3 const& begin, ivec3 const& end) {
+        if (end.x <= begin.x || end.y <= begin.y || end.z <= begin.z) return 0;
+
+        const uint64_t width = static_cast<uint64_t>(static_cast<int64_t>(end.x) - begin.x);
+        const uint64_t height = static_cast<uint64_t>(static_cast<int64_t>(end.y) - begin.y);
+        const uint64_t depth = static_cast<uint64_t>(static_cast<int64_t>(end.z) - begin.z);
+        if (width > MaxTiles || height > MaxTiles || depth > MaxTiles) return 0;
+        if (width * height > MaxTiles || width * height * depth > MaxTiles) return 0;
+
+        return width * height * depth;
+    }
+
+    uint64_t TileManifest::BitOf(ivec3 const& coord) const {
+        const uint64_t width = static_cast<uint64_t>(End.x - Begin.x);
+        const uint64_t height = static_cast<uint64_t>(End.y - Begin.y);
+        return (static_cast<uint64_t>(coord.z - Begin.z) * height + static_cast<uint64_t>(coord.y - Begin.y)) * width + static_cast<uint64_t>(coord.x - Begin.x);
+    }
+
+    bool TileManifest::Contains(ivec3 const& begin, ivec3 const& end) const {
+        return begin.x >= Begin.x && begin.y >= Begin.y && begin.z >= Begin.z && end.x <= End.x && end.y <= End.y && end.z <= End.z;
+    }
+
+    bool TileManifest::Has(ivec3 const& coord) const {
+        if (!Contains(coord, coord + 1)) return false;
+
+        const uint64_t bit = BitOf(coord);
+        return Bits[bit / 64] >> (bit % 64) & 1;
+    }
+
+    void TileManifest::Set(ivec3 const& coord) {
+        const uint64_t bit = BitOf(coord);
+        Bits[bit / 64] |= 1ull << (bit % 64);
+    }
+
+    vector<uint64_t> TileManifest::Ranges(int z) const {
+        vector<uint64_t> res;
+        if (z < Begin.z || z >= End.z) return res;
+
+        const uint64_t levelSize = static_cast<uint64_t>(End.x - Begin.x) * static_cast<uint64_t>(End.y - Begin.y);
+        const uint64_t levelBegin = static_cast<uint64_t>(z - Begin.z) * levelSize;
+
+        uint64_t runStart = 0;
+        bool inRun = false;
+        for (uint64_t i = 0; i < levelSize;) {
+            const uint64_t bit = levelBegin + i;
+            const uint64_t word = Bits[bit / 64] >> (bit % 64);
+
+            // Whole words without a change are skipped at once
+            const uint64_t remaining = std::min<uint64_t>(64 - bit % 64, levelSize - i);
+            const uint64_t mask = remaining == 64 ? ~0ull : (1ull << remaining) - 1;
+            const uint64_t changes = (inRun ? ~word : word) & mask;
+            if (changes == 0) {
+                i += remaining;
+                continue;
+            }
+
+            i += static_cast<uint64_t>(std::countr_zero(changes));
+            if (inRun) {
+                res.push_back(runStart);
+                res.push_back(i - runStart);
+            } else {
+                runStart = i;
+            }
+            inRun = !inRun;
+        }
+        if (inRun) {
+            res.push_back(runStart);
+            res.push_back(levelSize - runStart);
+        }
+
+        return res;
+    }
+
+    size_t TileManifest::Count() const {
+        size_t count = 0;
+        for (uint64_t word : Bits) count += static_cast<size_t>(std::popcount(word));
+        return count;
+    }
+
+    TileManifest::TileManifest(ivec3 const& begin, ivec3 const& end)
+    : Begin(begin)
+    , End(end)
+    , Bits((Volume(begin, end) + 63) / 64, 0)
+    { }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "Util.hpp"
+
+namespace HyperTiler {
+    // Which tiles of a box of coordinates [Begin, End) exist, one bit per tile, x fastest, then y, then z
+    struct TileManifest {
+        ivec3 Begin;
+        ivec3 End;
+        vector<uint64_t> Bits;
+
+        // Larger boxes aren't made into manifests
+        static constexpr uint64_t MaxTiles = 1ull << 26;
+
+        // Tiles in the box, 0 if it is empty or larger than MaxTiles
+        static uint64_t Volume(ivec3 const& begin, ivec3 const& end);
+
+        // Index of the tile in the box, the tile has to be inside it
+        uint64_t BitOf(ivec3 const& coord) const;
+
+        bool Contains(ivec3 const& begin, ivec3 const& end) const;
+        bool Has(ivec3 const& coord) const;
+        void Set(ivec3 const& coord);
+
+        // Tiles of the level that exist as flattened pairs of start and length, the start counting tiles
+        // from the corner of the level in the same order as the bits
+        vector<uint64_t> Ranges(int z) const;
+
+        size_t Count() const;
+
+        TileManifest(ivec3 const& begin, ivec3 const& end);
+    };
+}
@@ -0,0 +1,971 @@
+#include "TileService.hpp"
+
+#include "TileUtils.hpp"
+#include "Http.hpp"
+#include "ImageUtils.hpp"
+#include "ElevationCodec.hpp"
+#include "TileArchive.hpp"
+#include "FileBatcher.hpp"
+
+#include <iostream>
+#include <algorithm>
+
+namespace HyperTiler {
+    TileService::Handle::Handle(TileService& owner, DatasetCache::Dataset const& dataset, ivec3 const& coord, uint8_t const* data)
+    : m_owner(&owner)
+    , m_dataset(&dataset)
+    , m_coord(coord)
+    , m_data(data)
+    , m_fetched(false)
+    , m_fetchTime(0)
+    , m_stamp()
+    , m_mapping()
+    , m_needsSwap(false)
+    { }
+
+    TileService::Handle::Handle(std::unique_ptr<MappedFile> mapping, bool needsSwap)
+    : m_owner(nullptr)
+    , m_dataset(nullptr)
+    , m_coord(0)
+    , m_data(mapping->Data())
+    , m_fetched(false)
+    , m_fetchTime(0)
+    , m_stamp()
+    , m_mapping(std::move(mapping))
+    , m_needsSwap(needsSwap)
+    { }
+
+    void TileService::Handle::Reset() {
+        if (m_owner) m_owner->Release(*this);
+        m_owner = nullptr;
+        m_dataset = nullptr;
+        m_data = nullptr;
+        m_stamp = ResourceStamp();
+        m_mapping.reset();
+        m_needsSwap = false;
+    }
+
+    TileService::Handle::Handle()
+    : m_owner(nullptr)
+    , m_dataset(nullptr)
+    , m_coord(0)
+    , m_data(nullptr)
+    , m_fetched(false)
+    , m_fetchTime(0)
+    , m_stamp()
+    , m_mapping()
+    , m_needsSwap(false)
+    { }
+
+    TileService::Handle::Handle(Handle&& other) noexcept
+    : m_owner(other.m_owner)
+    , m_dataset(other.m_dataset)
+    , m_coord(other.m_coord)
+    , m_data(other.m_data)
+    , m_fetched(other.m_fetched)
+    , m_fetchTime(other.m_fetchTime)
+    , m_stamp(std::move(other.m_stamp))
+    , m_mapping(std::move(other.m_mapping))
+    , m_needsSwap(other.m_needsSwap)
+    {
+        other.m_owner = nullptr;
+        other.m_dataset = nullptr;
+        other.m_data = nullptr;
+        other.m_needsSwap = false;
+    }
+
+    TileService::Handle& TileService::Handle::operator=(Handle&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            m_owner = other.m_owner;
+            m_dataset = other.m_dataset;
+            m_coord = other.m_coord;
+            m_data = other.m_data;
+            m_fetched = other.m_fetched;
+            m_fetchTime = other.m_fetchTime;
+            m_stamp = std::move(other.m_stamp);
+            m_mapping = std::move(other.m_mapping);
+            m_needsSwap = other.m_needsSwap;
+            other.m_owner = nullptr;
+            other.m_dataset = nullptr;
+            other.m_data = nullptr;
+            other.m_needsSwap = false;
+        }
+        return *this;
+    }
+
+    TileService::Handle::~Handle() {
+        Reset();
+    }
+
+    void TileService::Release(Handle& handle) {
+        std::lock_guard<std::mutex> lock(m_mut);
+        m_cache->Unpin(*handle.m_dataset, handle.m_coord);
+        --m_pins;
+        m_changed.notify_all();
+    }
+
+    void TileService::RevalidateIfStale() {
+        const auto now = std::chrono::steady_clock::now();
+        if (now - m_lastRevalidation < RevalidateInterval) return;
+
+        m_cache->Revalidate();
+        m_lastRevalidation = now;
+
+        // Neither is looked at once it is this old, and tiles that are never used again would keep them forever
+        std::erase_if(m_exists, [now](auto const& entry) { return now - entry.second.Checked >= RevalidateInterval; });
+        std::erase_if(m_prefetched, [now](auto const& entry) { return now - entry.second.Finished >= RevalidateInterval; });
+    }
+
+    void TileService::FlushIfStale() {
+        const auto now = std::chrono::steady_clock::now();
+        if (now - m_lastFlush < FlushInterval) return;
+
+        m_cache->Flush();
+        m_lastFlush = now;
+    }
+
+    void TileService::Flush() {
+        std::lock_guard<std::mutex> lock(m_mut);
+        m_cache->Flush();
+        m_lastFlush = std::chrono::steady_clock::now();
+    }
+
+    std::shared_ptr<TileIndex const> TileService::IndexOf(URI const& format) {
+        if (!format.IsFilesystemResource() || format.IsArchiveResource()) return nullptr;
+
+        std::lock_guard<std::mutex> lock(m_indexMut);
+        if (!m_indexInputs) return nullptr;
+
+        const auto now = std::chrono::steady_clock::now();
+        auto found = m_indices.find(format);
+        if (found != m_indices.end() && now - found->second.Built < RevalidateInterval) return found->second.Index;
+
+        // Datasets that can't be indexed are remembered too, so they aren't listed on every query
+        IndexEntry& entry = m_indices[format];
+        entry.Index = TileIndex::Build(format);
+        entry.Built = now;
+        return entry.Index;
+    }
+
+    void TileService::SetExists(string const& name, bool exists) {
+        m_exists[name] = ExistenceEntry{ exists, std::chrono::steady_clock::now() };
+    }
+
+    void TileService::DecodeWorker() {
+        while (true) {
+            DecodeJob job;
+            {
+                std::unique_lock<std::mutex> lock(m_mut);
+                m_decodeReady.wait(lock, [this] { return m_stopping || !m_decodeQueue.empty(); });
+                if (m_stopping) return;
+
+                job = std::move(m_decodeQueue.front());
+                m_decodeQueue.pop_front();
+            }
+
+            if (job.Feed) {
+                job.Feed->Feed();
+                continue;
+            }
+
+            if (!job.Batch.empty()) {
+                if (job.Dataset->Config.Format.IsArchiveResource()) {
+                    ReadArchiveBatch(job);
+                } else {
+                    ReadFileBatch(job);
+                }
+                continue;
+            }
+
+            DatasetCache::Dataset const& dataset = *job.Dataset;
+            ResourceStamp stamp;
+            bool missing = false;
+            bool decoded = false;
+
+            try {
+                if (job.Downloaded) {
+                    stamp = job.Download.Stamp;
+                    missing = job.Download.Status == 404 || job.Download.Status == 410;
+                    decoded = DecodeDownload(dataset, job.Name, job.Download, job.Stream.get(), job.Destination);
+                } else {
+                    decoded = Fetch(dataset, job.Coord, job.Name, job.Destination, stamp, missing, nullptr, nullptr);
+                }
+            } catch (std::exception const& ex) {
+                std::cout << "Prefetching " << job.Name << " failed: " << ex.what() << "\n";
+                decoded = false;
+                missing = false;
+            }
+
+            std::lock_guard<std::mutex> lock(m_mut);
+            if (FinishFetch(dataset, job.Coord, job.Name, job.Destination, decoded, stamp, missing)) {
+                m_prefetched[DatasetCache::IndexKey(dataset, job.Coord)] = PrefetchedEntry{ std::chrono::system_clock::now() - job.Start, std::chrono::steady_clock::now() };
+            }
+        }
+    }
+
+    void TileService::ReadArchiveBatch(DecodeJob const& job) {
+        DatasetCache::Dataset const& dataset = *job.Dataset;
+
+        vector<TileArchive::Tile> tiles(job.Batch.size());
+        for (size_t i = 0; i < tiles.size(); ++i) tiles[i].Coord = job.Batch[i];
+
+        ResourceStamp stamp;
+        try {
+            TileArchive::Open(dataset.Config.Format).ReadTiles(tiles, stamp);
+        } catch (std::exception const& ex) {
+            std::cout << "Reading from " << dataset.Config.Format.ArchivePath() << " failed: " << ex.what() << "\n";
+            for (TileArchive::Tile& tile : tiles) {
+                tile.Data.clear();
+                tile.Missing = false;
+            }
+        }
+
+        // Decoded like downloaded tiles, by whichever workers are free
+        std::lock_guard<std::mutex> lock(m_mut);
+        for (TileArchive::Tile& tile : tiles) {
+            DecodeJob decode;
+            decode.Dataset = &dataset;
+            decode.Coord = tile.Coord;
+            decode.Name = dataset.Format.Render(tile.Coord);
+            decode.Start = job.Start;
+            decode.Destination = m_cache->Reserve(dataset, tile.Coord);
+            decode.Downloaded = true;
+            decode.Download.Url = decode.Name;
+            decode.Download.Status = tile.Missing ? 404 : tile.Data.empty() ? 0 : 200;
+            decode.Download.Data = std::move(tile.Data);
+            decode.Download.Stamp = stamp;
+            m_decodeQueue.push_back(std::move(decode));
+        }
+        m_decodeReady.notify_all();
+    }
+
+    void TileService::ReadFileBatch(DecodeJob const& job) {
+        DatasetCache::Dataset const& dataset = *job.Dataset;
+
+        vector<FileRead> reads(job.Batch.size());
+        for (size_t i = 0; i < reads.size(); ++i) reads[i].Path = dataset.Format.Render(job.Batch[i]);
+        LocalFiles().Read(reads);
+
+        std::lock_guard<std::mutex> lock(m_mut);
+        for (size_t i = 0; i < reads.size(); ++i) {
+            DecodeJob decode;
+            decode.Dataset = &dataset;
+            decode.Coord = job.Batch[i];
+            decode.Name = dataset.Format.Render(job.Batch[i]);
+            decode.Start = job.Start;
+            decode.Destination = m_cache->Reserve(dataset, job.Batch[i]);
+            decode.Downloaded = true;
+            decode.Download.Url = decode.Name;
+            decode.Download.Status = reads[i].Missing ? 404 : reads[i].Ok ? 200 : 0;
+            decode.Download.Data = std::move(reads[i].Data);
+            decode.Download.Stamp = reads[i].Stamp;
+            m_decodeQueue.push_back(std::move(decode));
+        }
+        m_decodeReady.notify_all();
+    }
+
+    bool TileService::IsCurrent(DatasetCache::Dataset const& dataset, string const& name, ResourceStamp const& stored) {
+        URI const& format = dataset.Config.Format;
+
+        ResourceStamp current;
+        if (format.IsArchiveResource()) return TileArchive::Open(format).CurrentStamp(current) && stored.Matches(current);
+        if (format.IsFilesystemResource()) return GetFileStamp(name, current) && stored.Matches(current);
+        return GetUrlStamp(name, current) && stored.Matches(current);
+    }
+
+    uint8_t* TileService::FindCurrent(DatasetCache::Dataset const& dataset, ivec3 const& coord, string const& name, std::unique_lock<std::mutex>& lock) {
+        // Cached copies are only used if the source hasn't changed since they were decoded
+        // The source is checked without the lock, once per tile between revalidations
+        ResourceStamp stored;
+        while (m_cache->NeedsCheck(dataset, coord, stored)) {
+            lock.unlock();
+            const bool current = IsCurrent(dataset, name, stored);
+            lock.lock();
+            m_cache->Check(dataset, coord, stored, current);
+        }
+        return m_cache->Find(dataset, coord);
+    }
+
+    bool TileService::MapsDirectly(DatasetCache::Dataset const& dataset) const {
+        DatasetConfig const& conf = dataset.Config;
+
+        // The samplers only swap 16 bit samples themselves, anything else about them is changed as they are decoded
+        return m_conf.mapRawInputs
+            && conf.Encoding.Encoding == FormatEncoding::Raw
+            && conf.Encoding.BitDepth == 16
+            && !conf.Encoding.HasGammEncoding()
+            && !conf.Format.IsArchiveResource()
+            && conf.Format.IsFilesystemResource();
+    }
+
+    TileService::Handle TileService::LoadMapped(DatasetCache::Dataset const& dataset, string const& name, std::chrono::system_clock::time_point fetchStart) {
+        // Taken before mapping, so a file replaced in between is at worst tagged as older than it is
+        ResourceStamp stamp;
+        GetFileStamp(name, stamp);
+
+        std::unique_ptr<MappedFile> mapping = std::make_unique<MappedFile>(name);
+
+        const bool exists = static_cast<bool>(*mapping);
+        const bool matches = exists && mapping->Size() == dataset.ElementSize;
+        if (exists && !matches) std::cout << "Tile " << name << " does not match the configured tile size\n";
+
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            SetExists(name, exists);
+        }
+        if (!matches) return Handle();
+
+        Handle res(std::move(mapping), dataset.Config.Encoding.SwapEndian);
+        res.m_stamp = std::move(stamp);
+        res.m_fetched = true;
+        res.m_fetchTime = std::chrono::system_clock::now() - fetchStart;
+        return res;
+    }
+
+    string TileService::MirrorName(DatasetCache::Dataset const& dataset, ivec3 const& coord) {
+        return dataset.Config.Mirror.empty() ? string() : dataset.Mirror.Render(coord);
+    }
+
+    // Samples are decoded into the cache through the converter of their dataset, unless it leaves them as they are
+    static PixelConverter const* ConverterOf(DatasetCache::Dataset const& dataset) {
+        return dataset.Converter.IsIdentity() ? nullptr : &dataset.Converter;
+    }
+
+    TileService::StreamedPng::StreamedPng(uint8_t* destination, uint64_t size, bool swapBytes, PixelConverter const* convert)
+    : Decoder(destination, size, swapBytes, convert)
+    { }
+
+    bool TileService::StreamedPng::Queue(uint8_t const* data, size_t size, bool& startFeeding) {
+        std::lock_guard<std::mutex> lock(Mut);
+        if (Failed) return false;
+
+        Parts.emplace_back(data, data + size);
+        startFeeding = !Feeding;
+        Feeding = true;
+        return true;
+    }
+
+    void TileService::StreamedPng::Feed() {
+        std::unique_lock<std::mutex> lock(Mut);
+        while (!Parts.empty()) {
+            vector<uint8_t> const part = std::move(Parts.front());
+            Parts.pop_front();
+            if (Failed) continue;
+
+            lock.unlock();
+            const bool fed = Decoder.Feed(part.data(), part.size());
+            lock.lock();
+            if (!fed) Failed = true;
+        }
+        Feeding = false;
+        Drained.notify_all();
+    }
+
+    void TileService::StreamedPng::WaitDrained() {
+        std::unique_lock<std::mutex> lock(Mut);
+        Drained.wait(lock, [this] { return !Feeding; });
+    }
+
+    std::shared_ptr<TileService::StreamedPng> TileService::MakeStream(DatasetCache::Dataset const& dataset, uint8_t* destination) {
+        if (dataset.Config.Encoding.Encoding != FormatEncoding::PNG) return nullptr;
+        return std::make_shared<StreamedPng>(destination, dataset.ElementSize, dataset.Config.Encoding.SwapEndian, ConverterOf(dataset));
+    }
+
+    Downloader::StreamFunc TileService::StreamInto(std::shared_ptr<StreamedPng> const& stream) {
+        if (!stream) return nullptr;
+
+        // The job feeding a download is queued before the one finishing it, since both are queued by the
+        // downloader thread, so a worker waiting for it to drain never waits on a job nobody has taken
+        return [this, stream](uint8_t const* data, size_t size) {
+            bool startFeeding = false;
+            if (!stream->Queue(data, size, startFeeding)) return false;
+            if (startFeeding) {
+                DecodeJob job;
+                job.Feed = stream;
+
+                std::lock_guard<std::mutex> lock(m_mut);
+                m_decodeQueue.push_back(std::move(job));
+                m_decodeReady.notify_one();
+            }
+            return true;
+        };
+    }
+
+    bool TileService::Fetch(DatasetCache::Dataset const& dataset, ivec3 const& coord, string const& name, uint8_t* destination, ResourceStamp& stamp, bool& missing, MemoryGovernor* governor, std::atomic_bool const* runningFlag) {
+        DatasetConfig const& conf = dataset.Config;
+        const bool isArchiveResource = conf.Format.IsArchiveResource();
+        const bool isFilesystemResource = !isArchiveResource && conf.Format.IsFilesystemResource();
+        missing = false;
+
+        // Early return if its a file and the specified file doesn't exist
+        if (isFilesystemResource && !GetFileStamp(name, stamp)) {
+            missing = true;
+            return false;
+        }
+
+        // Holds back the download until there is room for it
+        MemoryReservation downloadMemory;
+        if (governor) {
+            htAssert(runningFlag);
+            downloadMemory = MemoryReservation(*governor, MemoryPool::Downloads, dataset.ElementSize, *runningFlag);
+            if (!downloadMemory.Valid()) return false;
+        }
+
+        if (!isArchiveResource && !isFilesystemResource) {
+            // Goes through the downloader like prefetches, so slow requests are hedged here too
+            std::shared_ptr<StreamedPng> const stream = MakeStream(dataset, destination);
+            std::promise<Downloader::Result> done;
+            std::future<Downloader::Result> download = done.get_future();
+            m_downloader.Enqueue(name, [&done](Downloader::Result& result) {
+                done.set_value(std::move(result));
+            }, MirrorName(dataset, coord), StreamInto(stream));
+
+            Downloader::Result const result = download.get();
+            stamp = result.Stamp;
+
+            // Only a definite answer from the server counts, errors are retried next time
+            missing = result.Status == 404 || result.Status == 410;
+            return DecodeDownload(dataset, name, result, stream.get(), destination);
+        }
+
+        vector<uint8_t> rawData;
+        if (isArchiveResource) {
+            vector<TileArchive::Tile> tiles(1);
+            tiles[0].Coord = coord;
+            TileArchive::Open(conf.Format).ReadTiles(tiles, stamp);
+            rawData = std::move(tiles[0].Data);
+            missing = tiles[0].Missing;
+        } else {
+            rawData = ReadEntireFileBinary(name);
+        }
+
+        if (rawData.empty()) return false;
+
+        return Decode(dataset, name, rawData, destination);
+    }
+
+    bool TileService::Decode(DatasetCache::Dataset const& dataset, string const& name, vector<uint8_t> const& rawData, uint8_t* destination) const {
+        DatasetConfig const& conf = dataset.Config;
+
+        // Samples are converted as they are decoded, raw samples as they are copied out of the file
+        bool matches;
+        if (conf.Encoding.Encoding == FormatEncoding::PNG) {
+            const size_t rowBytes = static_cast<size_t>(conf.Size.x) * conf.Channels * (conf.Encoding.BitDepth / 8);
+            matches = ReadPngInto(rawData.data(), rawData.size(), destination, dataset.ElementSize, rowBytes, conf.Encoding.SwapEndian, ConverterOf(dataset));
+        } else if (conf.Encoding.Encoding == FormatEncoding::Elevation) {
+            matches = conf.Channels == 1 && conf.Encoding.BitDepth == 16
+                && ReadElevationTileInto(rawData.data(), rawData.size(), reinterpret_cast<uint16_t*>(destination), conf.Size.x, conf.Size.y, ConverterOf(dataset));
+        } else {
+            matches = rawData.size() == dataset.ElementSize;
+            if (matches) dataset.Converter.Convert(rawData.data(), destination, dataset.ElementSize / (conf.Encoding.BitDepth / 8));
+        }
+
+        if (!matches) {
+            std::cout << "Tile " << name << " does not match the configured tile size\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool TileService::DecodeDownload(DatasetCache::Dataset const& dataset, string const& name, Downloader::Result const& result, StreamedPng* stream, uint8_t* destination) const {
+        // Parts still being decoded write to the destination
+        if (stream) stream->WaitDrained();
+
+        // Bodies served from the cache or by a hedge weren't streamed, and are decoded now
+        if (result.Streamed && stream && stream->Decoder.Finished()) return true;
+
+        if (result.Data.empty()) return false;
+        return Decode(dataset, name, result.Data, destination);
+    }
+
+    uint8_t* TileService::FinishFetch(DatasetCache::Dataset const& dataset, ivec3 const& coord, string const& name, uint8_t* slot, bool decoded, ResourceStamp const& stamp, bool missing) {
+        string const key = DatasetCache::IndexKey(dataset, coord);
+        m_loading.erase(key);
+        m_changed.notify_all();
+
+        const auto reserved = m_downloadMemory.find(key);
+        if (reserved != m_downloadMemory.end()) {
+            reserved->second->Release(MemoryPool::Downloads, dataset.ElementSize);
+            m_downloadMemory.erase(reserved);
+        }
+
+        if (!decoded) {
+            m_cache->Discard(dataset, coord);
+            if (missing) {
+                m_cache->MarkMissing(dataset, coord);
+                SetExists(name, false);
+            }
+            return nullptr;
+        }
+
+        m_cache->Commit(dataset, coord, stamp);
+        SetExists(name, true);
+        return slot;
+    }
+
+    static RequestDeadlines Deadlines(ConversionOptimizationConfig const& conf) {
+        RequestDeadlines deadlines;
+        deadlines.ConnectTimeoutMs = conf.connectTimeout;
+        deadlines.TimeoutMs = conf.requestTimeout;
+        deadlines.LowSpeedLimit = conf.lowSpeedLimit;
+        deadlines.LowSpeedTime = conf.lowSpeedTime;
+        return deadlines;
+    }
+
+    void TileService::Configure(ConversionOptimizationConfig const& conf, uint64_t memoryBudget) {
+        std::unique_lock<std::mutex> lock(m_mut);
+
+        const bool sameFilesystemSettings =
+            conf.cacheOnFilesystem == m_conf.cacheOnFilesystem &&
+            conf.persistCache == m_conf.persistCache &&
+            conf.cacheBaseDirectory == m_conf.cacheBaseDirectory &&
+            conf.maxCacheSize == m_conf.maxCacheSize &&
+            conf.missingTileLifetime == m_conf.missingTileLifetime;
+
+        RemoteConcurrency().SetLimit(conf.maxDownloads);
+        SetRequestDeadlines(Deadlines(conf));
+        ResponseCache().Configure(conf.cacheResponses, conf.cacheBaseDirectory / "responses", conf.maxResponseCacheSize, conf.responseMaxAge);
+        m_downloader.SetHedging(conf.hedgeRequests);
+        LocalFiles().SetUseIoUring(conf.useIoUring);
+        {
+            std::lock_guard<std::mutex> indexLock(m_indexMut);
+            m_indexInputs = conf.indexInputs;
+            m_indices.clear();
+        }
+
+        if (sameFilesystemSettings) {
+            m_conf = conf;
+            m_cache->SetMemoryBudget(memoryBudget);
+            return;
+        }
+
+        // Tiles that are in use or on their way in belong to the old cache
+        // The cache is reconfigured rather than replaced, callers hold on to its datasets without holding the lock
+        m_changed.wait(lock, [this] { return m_pins == 0 && m_loading.empty(); });
+
+        m_conf = conf;
+        m_prefetched.clear();
+        m_cache->Reconfigure(m_conf, memoryBudget);
+    }
+
+    void TileService::Revalidate() {
+        {
+            std::lock_guard<std::mutex> lock(m_indexMut);
+            m_indices.clear();
+        }
+
+        std::lock_guard<std::mutex> lock(m_mut);
+        m_cache->Revalidate();
+        m_exists.clear();
+        m_lastRevalidation = std::chrono::steady_clock::now();
+    }
+
+    DatasetCache::Dataset const& TileService::AddDataset(DatasetConfig const& conf) {
+        const uint64_t elementSize = static_cast<uint64_t>(conf.Size.x) * conf.Size.y * conf.Channels * conf.Encoding.BitDepth / 8;
+
+        std::lock_guard<std::mutex> lock(m_mut);
+        return m_cache->AddDataset(conf, elementSize);
+    }
+
+    TileService::Handle TileService::Load(DatasetCache::Dataset const& dataset, ivec3 const& coord, MemoryGovernor* governor, std::atomic_bool const* runningFlag) {
+        const auto fetchStart = std::chrono::system_clock::now();
+
+        // Missing local tiles aren't looked for
+        std::shared_ptr<TileIndex const> const index = IndexOf(dataset.Config.Format);
+        if (index && !index->Exists(coord)) return Handle();
+
+        const string key = DatasetCache::IndexKey(dataset, coord);
+
+        const string name = dataset.Format.Render(coord);
+
+        std::unique_lock<std::mutex> lock(m_mut);
+        RevalidateIfStale();
+        FlushIfStale();
+
+        if (MapsDirectly(dataset)) {
+            lock.unlock();
+            return LoadMapped(dataset, name, fetchStart);
+        }
+
+        while (true) {
+            // Tiles that were missing when last probed
+            if (m_cache->IsKnownMissing(dataset, coord)) return Handle();
+
+            uint8_t* const cached = FindCurrent(dataset, coord, name, lock);
+
+            if (cached) {
+                m_cache->Pin(dataset, coord);
+                ++m_pins;
+
+                Handle res(*this, dataset, coord, cached);
+                res.m_stamp = m_cache->StampOf(dataset, coord);
+
+                // The first use of a prefetched tile reports the fetch
+                const auto prefetched = m_prefetched.find(key);
+                if (prefetched != m_prefetched.end()) {
+                    res.m_fetched = true;
+                    res.m_fetchTime = prefetched->second.FetchTime;
+                    m_prefetched.erase(prefetched);
+                }
+
+                return res;
+            }
+
+            if (m_loading.find(key) == m_loading.end()) break;
+
+            // Another thread is fetching this tile
+            m_changed.wait(lock);
+        }
+
+        m_loading.insert(key);
+        uint8_t* const slot = m_cache->Reserve(dataset, coord);
+        lock.unlock();
+
+        ResourceStamp stamp;
+        bool missing = false;
+        bool decoded = false;
+        try {
+            decoded = Fetch(dataset, coord, name, slot, stamp, missing, governor, runningFlag);
+        } catch (...) {
+            lock.lock();
+            m_cache->Discard(dataset, coord);
+            m_loading.erase(key);
+            m_changed.notify_all();
+            throw;
+        }
+
+        lock.lock();
+        if (!FinishFetch(dataset, coord, name, slot, decoded, stamp, missing)) return Handle();
+
+        m_cache->Pin(dataset, coord);
+        ++m_pins;
+
+        Handle res(*this, dataset, coord, slot);
+        res.m_stamp = stamp;
+        res.m_fetched = true;
+        res.m_fetchTime = std::chrono::system_clock::now() - fetchStart;
+        return res;
+    }
+
+    void TileService::Prefetch(DatasetCache::Dataset const& dataset, ivec3 const& coord, MemoryGovernor* governor, std::atomic_bool const* runningFlag) {
+        if (dataset.Config.Format.IsArchiveResource()) {
+            Prefetch(dataset, vector<ivec3>{ coord }, governor, runningFlag);
+            return;
+        }
+        htAssert(!governor || runningFlag);
+
+        std::shared_ptr<TileIndex const> const index = IndexOf(dataset.Config.Format);
+        if (index && !index->Exists(coord)) return;
+
+        const string key = DatasetCache::IndexKey(dataset, coord);
+
+        DecodeJob job;
+        job.Dataset = &dataset;
+        job.Coord = coord;
+        job.Name = dataset.Format.Render(coord);
+        job.Start = std::chrono::system_clock::now();
+
+        {
+            std::unique_lock<std::mutex> lock(m_mut);
+            RevalidateIfStale();
+            FlushIfStale();
+
+            // Mapped tiles are read on use, all that helps is getting them into the page cache first
+            if (MapsDirectly(dataset)) {
+                lock.unlock();
+                MappedFile::WillNeed(job.Name);
+                return;
+            }
+
+            // Waits for earlier prefetches to be decoded while the Downloads pool is full, then looks the tile up again
+            bool reserved = false;
+            while (true) {
+                if (m_cache->IsKnownMissing(dataset, coord) || FindCurrent(dataset, coord, job.Name, lock) || m_loading.find(key) != m_loading.end()) {
+                    if (reserved) governor->Release(MemoryPool::Downloads, dataset.ElementSize);
+                    return;
+                }
+                if (!governor || reserved || governor->TryReserve(MemoryPool::Downloads, dataset.ElementSize)) break;
+
+                lock.unlock();
+                reserved = governor->Reserve(MemoryPool::Downloads, dataset.ElementSize, *runningFlag);
+                if (!reserved) return;
+                lock.lock();
+            }
+
+            if (governor) m_downloadMemory[key] = governor;
+            m_loading.insert(key);
+            job.Destination = m_cache->Reserve(dataset, coord);
+
+            if (dataset.Config.Format.IsFilesystemResource()) {
+                m_decodeQueue.push_back(std::move(job));
+                m_decodeReady.notify_one();
+                return;
+            }
+        }
+
+        job.Stream = MakeStream(dataset, job.Destination);
+        Downloader::StreamFunc const stream = StreamInto(job.Stream);
+        m_downloader.Enqueue(job.Name, [this, job](Downloader::Result& result) mutable {
+            job.Downloaded = true;
+            job.Download = std::move(result);
+
+            std::lock_guard<std::mutex> lock(m_mut);
+            m_decodeQueue.push_back(std::move(job));
+            m_decodeReady.notify_one();
+        }, MirrorName(dataset, coord), stream);
+    }
+
+    void TileService::Prefetch(DatasetCache::Dataset const& dataset, vector<ivec3> const& coords, MemoryGovernor* governor, std::atomic_bool const* runningFlag) {
+        const bool isArchiveResource = dataset.Config.Format.IsArchiveResource();
+        if (!isArchiveResource && !dataset.Config.Format.IsFilesystemResource()) {
+            for (ivec3 const& coord : coords) Prefetch(dataset, coord, governor, runningFlag);
+            return;
+        }
+        htAssert(!governor || runningFlag);
+        const size_t batchSize = isArchiveResource ? ArchiveBatch : FileBatch;
+        std::shared_ptr<TileIndex const> const index = IndexOf(dataset.Config.Format);
+
+        DecodeJob job;
+        job.Dataset = &dataset;
+        job.Start = std::chrono::system_clock::now();
+
+        std::unique_lock<std::mutex> lock(m_mut);
+        RevalidateIfStale();
+        FlushIfStale();
+
+        // Nothing to read for mapped tiles, see the Prefetch of a single tile
+        if (MapsDirectly(dataset)) {
+            lock.unlock();
+            for (ivec3 const& coord : coords) Prefetch(dataset, coord, governor, runningFlag);
+            return;
+        }
+
+        // Cached tiles are checked against their sources together, without the lock
+        struct Unchecked {
+            ivec3 Coord;
+            string Name;
+            ResourceStamp Stamp;
+            bool Current = false;
+        };
+        vector<Unchecked> unchecked;
+        for (ivec3 const& coord : coords) {
+            Unchecked tile;
+            if (!m_cache->NeedsCheck(dataset, coord, tile.Stamp)) continue;
+            tile.Coord = coord;
+            tile.Name = dataset.Format.Render(coord);
+            unchecked.push_back(std::move(tile));
+        }
+        if (!unchecked.empty()) {
+            lock.unlock();
+            for (Unchecked& tile : unchecked) tile.Current = IsCurrent(dataset, tile.Name, tile.Stamp);
+            lock.lock();
+            for (Unchecked const& tile : unchecked) m_cache->Check(dataset, tile.Coord, tile.Stamp, tile.Current);
+        }
+
+        // A reservation made while waiting for room is kept for the next tile that needs it
+        bool reserved = false;
+        string name;
+        for (size_t i = 0; i < coords.size(); ++i) {
+            ivec3 const& coord = coords[i];
+            if (index && !index->Exists(coord)) continue;
+
+            const string key = DatasetCache::IndexKey(dataset, coord);
+            if (m_cache->IsKnownMissing(dataset, coord)) continue;
+            dataset.Format.Render(coord, name);
+            if (FindCurrent(dataset, coord, name, lock)) continue;
+            if (m_loading.find(key) != m_loading.end()) continue;
+
+            if (governor && !reserved && !governor->TryReserve(MemoryPool::Downloads, dataset.ElementSize)) {
+                // Room is made by the tiles queued so far, so they go first
+                if (!job.Batch.empty()) {
+                    m_decodeQueue.push_back(job);
+                    job.Batch.clear();
+                    m_decodeReady.notify_all();
+                }
+
+                lock.unlock();
+                reserved = governor->Reserve(MemoryPool::Downloads, dataset.ElementSize, *runningFlag);
+                lock.lock();
+                if (!reserved) break;
+
+                // The lock was released, so the tile is looked up again
+                --i;
+                continue;
+            }
+            reserved = false;
+
+            if (governor) m_downloadMemory[key] = governor;
+            m_loading.insert(key);
+            job.Batch.push_back(coord);
+
+            if (job.Batch.size() == batchSize) {
+                m_decodeQueue.push_back(job);
+                job.Batch.clear();
+            }
+        }
+        if (reserved) governor->Release(MemoryPool::Downloads, dataset.ElementSize);
+
+        if (!job.Batch.empty()) m_decodeQueue.push_back(std::move(job));
+        m_decodeReady.notify_all();
+    }
+
+    void TileService::ForgetGovernor(MemoryGovernor const& governor) {
+        std::lock_guard<std::mutex> lock(m_mut);
+        std::erase_if(m_downloadMemory, [&governor](auto const& entry) { return entry.second == &governor; });
+    }
+
+    json TileService::DownloadStatus() {
+        json status = RemoteConcurrency().Status();
+        status["hedging"] = m_downloader.Status();
+        return status;
+    }
+
+    bool TileService::Exists(URI const& format, ivec3 const& coord) {
+        string name;
+        return Exists(TileFormat(format), coord, name);
+    }
+
+    bool TileService::Exists(TileFormat const& format, ivec3 const& coord, string& name) {
+        if (std::shared_ptr<TileIndex const> const index = IndexOf(format.Format())) return index->Exists(coord);
+
+        format.Render(coord, name);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            const auto found = m_exists.find(name);
+            if (found != m_exists.end() && std::chrono::steady_clock::now() - found->second.Checked < RevalidateInterval) {
+                return found->second.Exists;
+            }
+        }
+
+        bool exists;
+        if (format.IsArchiveResource()) {
+            exists = TileArchive::Open(format.Format()).Exists(coord);
+        } else {
+            exists = format.IsFilesystemResource() ? FileExists(name) : CheckUrlExistence(name);
+        }
+
+        std::lock_guard<std::mutex> lock(m_mut);
+        SetExists(name, exists);
+        return exists;
+    }
+
+    std::shared_ptr<TileManifest const> TileService::Manifest(URI const& format, ivec3 const& begin, ivec3 const& end, ManifestLevelFunc const& onLevel) {
+        if (TileManifest::Volume(begin, end) == 0) return nullptr;
+
+        std::shared_ptr<TileManifest const> const known = FindManifest(format, begin, end);
+        if (known && known->Begin == begin && known->End == end) {
+            for (int z = begin.z; z < end.z; ++z) {
+                if (onLevel && !onLevel(z, *known)) return nullptr;
+            }
+            return known;
+        }
+
+        const TileFormat tileFormat(format);
+
+        std::shared_ptr<TileIndex const> const index = known ? nullptr : IndexOf(format);
+        const bool parallel = !known && !index && format.IsNetworkResource();
+
+        auto res = std::make_shared<TileManifest>(begin, end);
+        vector<ivec3> coords;
+        for (int z = begin.z; z < end.z; ++z) {
+            coords.clear();
+            for (int y = begin.y; y < end.y; ++y) {
+                for (int x = begin.x; x < end.x; ++x) coords.emplace_back(x, y, z);
+            }
+
+            vector<uint8_t> found(coords.size(), 0);
+            if (parallel) {
+                std::atomic<size_t> next(0);
+                std::exception_ptr error;
+                std::mutex errorMut;
+
+                auto check = [this, &tileFormat, &coords, &found, &next, &error, &errorMut]() {
+                    string name;
+                    try {
+                        for (size_t i = next++; i < coords.size(); i = next++) found[i] = Exists(tileFormat, coords[i], name);
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(errorMut);
+                        error = std::current_exception();
+                        next = coords.size();
+                    }
+                };
+
+                vector<std::thread> workers;
+                for (size_t i = 1; i < std::min(coords.size(), ManifestWorkers); ++i) workers.emplace_back(check);
+                check();
+                for (std::thread& worker : workers) worker.join();
+                if (error) std::rethrow_exception(error);
+            } else {
+                string name;
+                for (size_t i = 0; i < coords.size(); ++i) {
+                    found[i] = known ? known->Has(coords[i]) : index ? index->Exists(coords[i]) : Exists(tileFormat, coords[i], name);
+                }
+            }
+
+            for (size_t i = 0; i < coords.size(); ++i) {
+                if (found[i]) res->Set(coords[i]);
+            }
+
+            if (onLevel && !onLevel(z, *res)) return nullptr;
+        }
+
+        // Parts of kept manifests aren't kept again
+        if (known) return res;
+
+        std::lock_guard<std::mutex> lock(m_indexMut);
+        vector<ManifestEntry>& entries = m_manifests[format];
+        entries.push_back({ res, std::chrono::steady_clock::now() });
+        if (entries.size() > MaxManifests) entries.erase(entries.begin());
+        return res;
+    }
+
+    std::shared_ptr<TileManifest const> TileService::FindManifest(URI const& format, ivec3 const& begin, ivec3 const& end) {
+        std::lock_guard<std::mutex> lock(m_indexMut);
+
+        auto found = m_manifests.find(format);
+        if (found == m_manifests.end()) return nullptr;
+
+        vector<ManifestEntry>& entries = found->second;
+        const auto now = std::chrono::steady_clock::now();
+        entries.erase(std::remove_if(entries.begin(), entries.end(), [now](ManifestEntry const& entry) { return now - entry.Built >= RevalidateInterval; }), entries.end());
+
+        // The newest manifest that covers the range
+        for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+            if (it->Manifest->Contains(begin, end)) return it->Manifest;
+        }
+        return nullptr;
+    }
+
+    TileService::TileService(ConversionOptimizationConfig const& conf, uint64_t memoryBudget)
+    : m_conf(conf)
+    , m_cache(std::make_unique<DatasetCache>(conf, memoryBudget))
+    , m_pins(0)
+    , m_lastRevalidation(std::chrono::steady_clock::now())
+    , m_lastFlush(std::chrono::steady_clock::now())
+    , m_indexInputs(conf.indexInputs)
+    , m_stopping(false)
+    , m_downloader(RemoteConcurrency())
+    {
+        RemoteConcurrency().SetLimit(conf.maxDownloads);
+        SetRequestDeadlines(Deadlines(conf));
+        ResponseCache().Configure(conf.cacheResponses, conf.cacheBaseDirectory / "responses", conf.maxResponseCacheSize, conf.responseMaxAge);
+        m_downloader.SetHedging(conf.hedgeRequests);
+        LocalFiles().SetUseIoUring(conf.useIoUring);
+
+        const int numDecoders = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        for (int i = 0; i < numDecoders; ++i) {
+            m_decoders.emplace_back([this] { DecodeWorker(); });
+        }
+    }
+
+    TileService::~TileService() {
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            m_stopping = true;
+        }
+        m_decodeReady.notify_all();
+        for (std::thread& decoder : m_decoders) decoder.join();
+    }
+}
@@ -0,0 +1,299 @@
+#pragma once
+
+#include "DatasetCache.hpp"
+#include "MemoryGovernor.hpp"
+#include "Http.hpp"
+#include "MappedFile.hpp"
+#include "TileIndex.hpp"
+#include "TileManifest.hpp"
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+
+namespace HyperTiler {
+    // Loads and decodes input tiles for the whole process. Previews, existence checks and conversions
+    // share one DatasetCache and one record of which tiles exist, so a tile is only fetched once no
+    // matter which of them asks for it first. Thread safe.
+    class TileService {
+    public:
+        // Keeps a loaded tile in memory while held
+        class Handle {
+            TileService* m_owner;
+            DatasetCache::Dataset const* m_dataset;
+            ivec3 m_coord;
+            uint8_t const* m_data;
+            bool m_fetched;
+            std::chrono::system_clock::duration m_fetchTime;
+            ResourceStamp m_stamp;
+
+            // set instead of m_owner for tiles read straight from their file
+            std::unique_ptr<MappedFile> m_mapping;
+            bool m_needsSwap;
+
+            friend class TileService;
+            Handle(TileService& owner, DatasetCache::Dataset const& dataset, ivec3 const& coord, uint8_t const* data);
+            Handle(std::unique_ptr<MappedFile> mapping, bool needsSwap);
+        public:
+            uint8_t const* Data() const { return m_data; }
+            explicit operator bool() const { return m_data != nullptr; }
+
+            // true if the samples are in the byte order of the source and have to be swapped when read
+            // Only tiles read straight from their file are left unswapped
+            bool NeedsSwap() const { return m_needsSwap; }
+
+            // true if the tile was downloaded and decoded for this handle rather than found in the cache
+            bool Fetched() const { return m_fetched; }
+            std::chrono::system_clock::duration FetchTime() const { return m_fetchTime; }
+
+            // The stamp of the source the tile was decoded or mapped from, which changes whenever the tile does
+            ResourceStamp const& Stamp() const { return m_stamp; }
+
+            void Reset();
+
+            Handle();
+            Handle(Handle&& other) noexcept;
+            Handle& operator=(Handle&& other) noexcept;
+            ~Handle();
+        private:
+            Handle(Handle const& other) = delete;
+            Handle& operator=(Handle const& other) = delete;
+        };
+
+    private:
+        struct ExistenceEntry {
+            bool Exists = false;
+            std::chrono::steady_clock::time_point Checked;
+        };
+
+        struct PrefetchedEntry {
+            std::chrono::system_clock::duration FetchTime;
+            std::chrono::steady_clock::time_point Finished;
+        };
+
+        struct IndexEntry {
+            std::shared_ptr<TileIndex const> Index;
+            std::chrono::steady_clock::time_point Built;
+        };
+
+        struct ManifestEntry {
+            std::shared_ptr<TileManifest const> Manifest;
+            std::chrono::steady_clock::time_point Built;
+        };
+
+        // A PNG decoded by the decode workers as its download arrives. The downloader thread only queues the
+        // parts of the body, so it goes on serving the other transfers while they are decoded
+        struct StreamedPng {
+            PngStreamDecoder Decoder;
+
+            std::mutex Mut;
+            std::condition_variable Drained;
+            std::deque<vector<uint8_t>> Parts;
+
+            // a decode job is feeding the parts to the decoder, or is queued to
+            bool Feeding = false;
+            bool Failed = false;
+
+            // Returns false once decoding has failed, otherwise queues the part and sets startFeeding if a
+            // decode job has to be queued to feed it
+            bool Queue(uint8_t const* data, size_t size, bool& startFeeding);
+
+            // Feeds the parts queued so far and those queued meanwhile, run by a decode job
+            void Feed();
+
+            // Waits for the parts queued so far to be fed, after which nothing writes to the destination
+            void WaitDrained();
+
+            StreamedPng(uint8_t* destination, uint64_t size, bool swapBytes, PixelConverter const* convert);
+        };
+
+        // A prefetched tile waiting for a decode worker
+        struct DecodeJob {
+            DatasetCache::Dataset const* Dataset = nullptr;
+            ivec3 Coord;
+            string Name;
+            std::chrono::system_clock::time_point Start;
+
+            // the cache slot reserved for the tile
+            uint8_t* Destination = nullptr;
+
+            // remote tiles are read by the downloader, local ones by the worker
+            bool Downloaded = false;
+            Downloader::Result Download;
+
+            // decoding the download into Destination as it arrives, if its encoding allows
+            std::shared_ptr<StreamedPng> Stream;
+
+            // parts of a download to feed to its decoder, nothing else of the job is used
+            std::shared_ptr<StreamedPng> Feed;
+
+            // tiles to read from an archive or the local filesystem together, each is then decoded by a job of its own
+            // Coord and Name are unused
+            vector<ivec3> Batch;
+        };
+
+        std::mutex m_mut;
+        std::condition_variable m_changed;
+
+        ConversionOptimizationConfig m_conf;
+
+        // never replaced, the datasets it hands out stay valid for the life of the service
+        std::unique_ptr<DatasetCache> m_cache;
+
+        // index keys of tiles being fetched, other loaders of the same tile wait for them
+        set<string> m_loading;
+        int m_pins;
+
+        std::chrono::steady_clock::time_point m_lastRevalidation;
+        std::chrono::steady_clock::time_point m_lastFlush;
+
+        // keyed by resource name
+        map<string, ExistenceEntry> m_exists;
+
+        // how long prefetched tiles took to fetch, reported by the first Load of each within RevalidateInterval
+        map<string, PrefetchedEntry> m_prefetched;
+
+        // governors prefetched tiles reserved Downloads memory from, keyed by index key, released by FinishFetch
+        map<string, MemoryGovernor*> m_downloadMemory;
+
+        // Indices of local datasets keyed by format string, built by the first query that needs one
+        // Separate from m_mut so a directory listing doesn't hold up loads of cached tiles
+        std::mutex m_indexMut;
+        map<string, IndexEntry> m_indices;
+        bool m_indexInputs;
+
+        // Recent manifests keyed by format string, oldest first, also guarded by m_indexMut
+        map<string, vector<ManifestEntry>> m_manifests;
+
+        std::deque<DecodeJob> m_decodeQueue;
+        std::condition_variable m_decodeReady;
+        bool m_stopping;
+
+        // decode prefetched tiles, and streamed downloads as they arrive, straight into their cache slots
+        vector<std::thread> m_decoders;
+
+        // destroyed first, its unfinished requests still complete into the decode queue
+        Downloader m_downloader;
+
+        void Release(Handle& handle);
+        void RevalidateIfStale();
+        void FlushIfStale();
+        void SetExists(string const& name, bool exists);
+        void DecodeWorker();
+
+        // Read a batch of tiles in one go, see TileArchive.hpp and FileBatcher.hpp, then queue a decode job for each
+        void ReadArchiveBatch(DecodeJob const& job);
+        void ReadFileBatch(DecodeJob const& job);
+
+        // name is reused for the name of the tile
+        bool Exists(TileFormat const& format, ivec3 const& coord, string& name);
+
+        // nullptr if the dataset isn't indexed, see TileIndex.hpp
+        std::shared_ptr<TileIndex const> IndexOf(URI const& format);
+
+        // Whether the source of a tile still has the stamp it was decoded from, called without the lock
+        static bool IsCurrent(DatasetCache::Dataset const& dataset, string const& name, ResourceStamp const& stored);
+
+        // returns the tile if it is cached and its source hasn't changed, the lock must be held
+        // It is released while the source is checked, so anything looked up before has to be looked up again
+        uint8_t* FindCurrent(DatasetCache::Dataset const& dataset, ivec3 const& coord, string const& name, std::unique_lock<std::mutex>& lock);
+
+        // Whether tiles of the dataset are read straight from their files, the lock must be held
+        // Such raw local tiles skip the cache and are sampled from the mapping, the OS caches their pages
+        bool MapsDirectly(DatasetCache::Dataset const& dataset) const;
+        Handle LoadMapped(DatasetCache::Dataset const& dataset, string const& name, std::chrono::system_clock::time_point fetchStart);
+
+        // empty if the dataset has no mirror
+        static string MirrorName(DatasetCache::Dataset const& dataset, ivec3 const& coord);
+
+        // Reads a tile and decodes it into destination, returns false if it couldn't be loaded
+        // missing is set if the source definitely doesn't have the tile
+        bool Fetch(DatasetCache::Dataset const& dataset, ivec3 const& coord, string const& name, uint8_t* destination, ResourceStamp& stamp, bool& missing, MemoryGovernor* governor, std::atomic_bool const* runningFlag);
+        bool Decode(DatasetCache::Dataset const& dataset, string const& name, vector<uint8_t> const& rawData, uint8_t* destination) const;
+
+        // Decodes a download into the destination as it arrives, nullptr if its encoding can't be decoded in parts
+        static std::shared_ptr<StreamedPng> MakeStream(DatasetCache::Dataset const& dataset, uint8_t* destination);
+
+        // Hands the parts of a download to the decode workers
+        Downloader::StreamFunc StreamInto(std::shared_ptr<StreamedPng> const& stream);
+
+        // Finishes a download that may have been decoded by stream as it arrived, after the stream is drained
+        bool DecodeDownload(DatasetCache::Dataset const& dataset, string const& name, Downloader::Result const& result, StreamedPng* stream, uint8_t* destination) const;
+
+        // Commits or discards the reserved slot of a fetch, releases the memory reserved for it by a prefetch
+        // and wakes up whoever waits on it, the lock must be held
+        // returns the slot, or nullptr if the tile couldn't be loaded
+        uint8_t* FinishFetch(DatasetCache::Dataset const& dataset, ivec3 const& coord, string const& name, uint8_t* slot, bool decoded, ResourceStamp const& stamp, bool missing);
+
+    public:
+        // Called with the manifest as each of its levels is finished, returning false stops it
+        typedef std::function<bool(int z, TileManifest const& manifest)> ManifestLevelFunc;
+
+        // Sources are checked for changes at least this often, and existence checks are remembered this long
+        static constexpr std::chrono::seconds RevalidateInterval = std::chrono::seconds(60);
+
+        // The filesystem cache is trimmed and its index saved at least this often while tiles are used
+        static constexpr std::chrono::seconds FlushInterval = std::chrono::seconds(60);
+
+        // Existence checks of remote tiles running at once for a manifest, RemoteConcurrency still limits the requests
+        static constexpr size_t ManifestWorkers = 32;
+
+        // Manifests kept for each format
+        static constexpr size_t MaxManifests = 8;
+
+        // Groups are read by different workers at once, so a batch still makes concurrent requests
+        static constexpr size_t ArchiveBatch = 64;
+        static constexpr size_t FileBatch = 64;
+
+        // Changes the memory budget of the cache, and replaces the cache if its filesystem settings changed
+        // Datasets added before the cache was replaced must be added again
+        void Configure(ConversionOptimizationConfig const& conf, uint64_t memoryBudget);
+
+        // Trims the filesystem cache to its size limit and saves its index, see DatasetCache::Flush
+        void Flush();
+
+        // Makes every cached tile get checked against its source on its next use
+        void Revalidate();
+
+        DatasetCache::Dataset const& AddDataset(DatasetConfig const& conf);
+
+        // Returns an empty handle if the tile doesn't exist or can't be loaded
+        // Downloads reserve memory from the governor if there is one, and give up if runningFlag is cleared
+        Handle Load(DatasetCache::Dataset const& dataset, ivec3 const& coord, MemoryGovernor* governor = nullptr, std::atomic_bool const* runningFlag = nullptr);
+
+        // Starts loading a tile in the background, a Load of it meanwhile waits for it instead of fetching it again
+        // Does nothing if the tile is already cached or on its way
+        // With a governor each tile reserves Downloads memory until it is decoded, blocking while the pool is full
+        // Gives up if runningFlag is cleared while waiting
+        void Prefetch(DatasetCache::Dataset const& dataset, ivec3 const& coord, MemoryGovernor* governor = nullptr, std::atomic_bool const* runningFlag = nullptr);
+
+        // Tiles of an archive are read in groups of up to ArchiveBatch nearby tiles, local tiles in groups of up to FileBatch
+        void Prefetch(DatasetCache::Dataset const& dataset, vector<ivec3> const& coords, MemoryGovernor* governor = nullptr, std::atomic_bool const* runningFlag = nullptr);
+
+        // Prefetches still on their way don't release their memory into the governor, which is about to be destroyed
+        void ForgetGovernor(MemoryGovernor const& governor);
+
+        // Local datasets are answered by an index of their directories, see TileIndex.hpp
+        bool Exists(URI const& format, ivec3 const& coord);
+
+        // Which tiles of [begin, end) exist. Local datasets answer from their index, remote tiles are checked
+        // by up to ManifestWorkers requests at once. Manifests are kept for RevalidateInterval, Revalidate
+        // doesn't drop them, and answer later requests for any part of their range
+        // nullptr if the range is empty or larger than TileManifest::MaxTiles, or if onLevel stopped it
+        std::shared_ptr<TileManifest const> Manifest(URI const& format, ivec3 const& begin, ivec3 const& end, ManifestLevelFunc const& onLevel = nullptr);
+
+        // A kept manifest covering [begin, end), possibly larger, nullptr if there is none
+        std::shared_ptr<TileManifest const> FindManifest(URI const& format, ivec3 const& begin, ivec3 const& end);
+
+        // Concurrency window and hedging of remote requests, for the status API
+        json DownloadStatus();
+
+        TileService(ConversionOptimizationConfig const& conf, uint64_t memoryBudget);
+        ~TileService();
+    private:
+        TileService(TileService const& other) = delete;
+        TileService& operator=(TileService const& other) = delete;
+    };
+}
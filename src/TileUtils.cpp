@@ -1,5 +1,7 @@
 #include "TileUtils.hpp"
 #include "jsonUtils.hpp"
+#include "Http.hpp"
+#include "TileArchive.hpp"
 #include <iostream>
 
 #define HT_CHECK_SAMPLE_OVERFLOW
@@ -12,33 +14,13 @@ namespace HyperTiler {
         while (res.size() < zeros) res.insert(res.begin() + off, '0');
         return res;
     }
-    string FormatTileStringInt(string const& format, int value) {
-        htAssert(format.size() >= 3);
-        string iv = format.substr(2, format.size() - 3);
-        if (iv.length() == 0) {
-            return std::to_string(value);
-        } else {
-            return IntToStringPadZeros(value, std::atoi(iv.c_str()));
-        }
-    }
     string FormatTileString(string orig, ivec3 coord) {
-        static const std::regex formats[3] = {
-            std::regex("\\{x[0-9]*\\}"),
-            std::regex("\\{y[0-9]*\\}"),
-            std::regex("\\{z[0-9]*\\}")
-        };
-
-        for (int i = 0; i < 3; ++i) {
-            std::smatch match;
-            if (!std::regex_search(orig, match, formats[i]) || match.size() > 1) throw std::runtime_error("Incorrect format string");
-
-            orig.replace(orig.begin() + match.position(), orig.begin() + match.position() + match.length(), FormatTileStringInt(match.str(), coord[i]));
-        }
-
-        return orig;
+        return TileFormat(orig).Render(coord);
     }
 
     bool TileExists(URI const& format, ivec3 coord) {
+        if (format.IsArchiveResource()) return TileArchive::Open(format).Exists(coord);
+
         string const& ResourceName = FormatTileString(format, coord);
         return format.IsFilesystemResource() ? FileExists(ResourceName) : CheckUrlExistence(ResourceName);
     }
@@ -47,9 +29,18 @@ namespace HyperTiler {
             const string Name = FormatTileString(Conf.Format, coord);
             
             // Early return if its a file and the specified file doesn't exist
-            if (Conf.Format.IsFilesystemResource() && !FileExists(Name)) return ImageData();
-
-            vector<uint8_t> RawData = Conf.Format.IsFilesystemResource() ? ReadEntireFileBinary(Name) : ReadEntireUrlBinary(Name);
+            if (Conf.Format.IsFilesystemResource() && !Conf.Format.IsArchiveResource() && !FileExists(Name)) return ImageData();
+
+            vector<uint8_t> RawData;
+            if (Conf.Format.IsArchiveResource()) {
+                vector<TileArchive::Tile> Tiles(1);
+                Tiles[0].Coord = coord;
+                ResourceStamp Stamp;
+                TileArchive::Open(Conf.Format).ReadTiles(Tiles, Stamp);
+                RawData = std::move(Tiles[0].Data);
+            } else {
+                RawData = Conf.Format.IsFilesystemResource() ? ReadEntireFileBinary(Name) : ReadEntireUrlBinary(Name);
+            }
 
             if (RawData.empty()) return ImageData();
 
@@ -70,8 +61,7 @@ namespace HyperTiler {
 
             if (Conf.Encoding.SwapEndian) {
                 htAssert(Conf.Encoding.BitDepth == 16);
-                for (int i = 0; i < res.data.size(); i += 2)
-                    std::swap(res.data[i], res.data[i + 1]);
+                SwapSampleBytes(res.data.data(), res.data.data(), res.data.size(), 2);
             }
 
             return res;
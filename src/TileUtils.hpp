@@ -3,11 +3,12 @@
 #include "Util.hpp"
 #include "Config.hpp"
 #include "ImageUtils.hpp"
+#include "TileFormat.hpp"
 
 namespace HyperTiler {
     string IntToStringPadZeros(int value, int zeros);
 
-    string FormatTileStringInt(string const& format, int value);
+    // Parses the format on every call, names of many tiles are better made by one TileFormat
     string FormatTileString(string format, ivec3 coord);
 
     // SLOW!
@@ -1,6 +1,7 @@
 #include "Util.hpp"
 
-#include <curl/curl.h>
+#include <algorithm>
+#include <chrono>
 
 namespace HyperTiler {
     template class DiscreteAABB2<int>;
@@ -124,6 +125,19 @@ namespace HyperTiler {
         }
     }
 
+    double FastestRun(std::function<void()> const& run) {
+        std::chrono::steady_clock::duration best = std::chrono::steady_clock::duration::max();
+        const auto start = std::chrono::steady_clock::now();
+        int runs = 0;
+        do {
+            const auto runStart = std::chrono::steady_clock::now();
+            run();
+            best = std::min(best, std::chrono::steady_clock::now() - runStart);
+            ++runs;
+        } while (runs < 3 || std::chrono::steady_clock::now() - start < std::chrono::milliseconds(250));
+        return std::chrono::duration<double>(best).count();
+    }
+
     int CorrectMod(int val, int mod) {
         int modVal = abs(val) % mod;
         if (val < 0 && modVal) return mod - modVal;
@@ -180,6 +194,34 @@ namespace HyperTiler {
         return glm::clamp(uvec3(color * 255.0f), uvec3(0), uvec3(255));
     }
 
+    uint64_t HashString(string const& str) {
+        // 64 bit FNV-1a
+        uint64_t hash = 14695981039346656037ull;
+        for (char c : str) {
+            hash ^= static_cast<uint8_t>(c);
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+    string HashToString(uint64_t hash) {
+        static const char digits[] = "0123456789abcdef";
+        string res(16, '0');
+        for (int i = 15; i >= 0; --i) {
+            res[i] = digits[hash & 0xF];
+            hash >>= 4;
+        }
+        return res;
+    }
+
+    bool ResourceStamp::Matches(ResourceStamp const& other) const {
+        if (!ETag.empty() && !other.ETag.empty()) return ETag == other.ETag;
+        return Size == other.Size && ModifiedTime == other.ModifiedTime;
+    }
+
+    bool ResourceStamp::IdentifiesVersion() const {
+        return !ETag.empty() || ModifiedTime != -1;
+    }
+
     vector<uint8_t> ReadEntireFileBinary(path const& path) {
         std::ifstream f(path, std::ios::binary | std::ios::ate);
         f.exceptions(::std::ios_base::failbit | ::std::ios_base::badbit | ::std::ios_base::eofbit);
@@ -191,12 +233,12 @@ namespace HyperTiler {
         return res;
     }
     void ReadEntireFileBinary(path const& path, uint8_t* data, uint64_t size) {
-        std::ifstream f(path, std::ios::binary | std::ios::ate);
+        std::ifstream f(path, std::ios::binary);
         f.read((char*)data, size);
     }
     string ReadEntireFileText(path const& path) {
         string res; res.resize(FileSize(path));
-        std::ifstream f(path, std::ios::ate);
+        std::ifstream f(path, std::ios::binary);
         f.read((char*)res.data(), res.size());
         return res;
     }
@@ -220,111 +262,13 @@ namespace HyperTiler {
     bool RemoveFile(path const& path) {
         return std::filesystem::remove(path);
     }
-
-    struct CurlMemoryStruct {
-        char* memory;
-        size_t size;
-    };
-
-    static size_t
-        WriteMemoryCallback(void* contents, size_t size, size_t nmemb, void* userp)
-    {
-        size_t realsize = size * nmemb;
-        CurlMemoryStruct* mem = reinterpret_cast<CurlMemoryStruct*>(userp);
-
-        char* ptr = reinterpret_cast<char*>(realloc(mem->memory, mem->size + realsize + 1));
-
-        htAssert(ptr);
-        if (!ptr) return 0;
-
-        mem->memory = ptr;
-        memcpy(&(mem->memory[mem->size]), contents, realsize);
-        mem->size += realsize;
-        mem->memory[mem->size] = 0;
-
-        return realsize;
-    }
-
-    vector<uint8_t> ReadEntireUrlBinary(string const& path) {
-        CURL* curl_handle;
-        CURLcode res;
-
-        CurlMemoryStruct chunk;
-
-        chunk.memory = reinterpret_cast<char*>(malloc(1));
-        chunk.size = 0;
-
-        curl_global_init(CURL_GLOBAL_ALL);
-
-        curl_handle = curl_easy_init();
-
-        curl_easy_setopt(curl_handle, CURLOPT_URL, path.c_str());
-
-        curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-
-        curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void*)&chunk);
-
-        curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-
-        curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, false);
-
-        curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, true);
-
-        res = curl_easy_perform(curl_handle);
-
-        long http_code = 0;
-        curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
-
-        if (res != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n",
-                curl_easy_strerror(res));
-        }
-
-        if (http_code == 200) {
-            vector<uint8_t> mres;
-            mres.resize(chunk.size);
-            memcpy(mres.data(), chunk.memory, chunk.size);
-
-            curl_easy_cleanup(curl_handle);
-
-            free(chunk.memory);
-
-            return mres;
-        } else {
-            curl_easy_cleanup(curl_handle);
-
-            free(chunk.memory);
-
-            return { };
-        }
-    }
-
-    bool CheckUrlExistence(string const& path) {
-        CURL* curl_handle;
-        CURLcode res;
-
-        curl_global_init(CURL_GLOBAL_ALL);
-
-        curl_handle = curl_easy_init();
-
-        curl_easy_setopt(curl_handle, CURLOPT_URL, path.c_str());
-        curl_easy_setopt(curl_handle, CURLOPT_NOBODY, 1L);
-        curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-        curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, false);
-        curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, true);
-
-        res = curl_easy_perform(curl_handle);
-
-        long http_code = 0;
-        curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
-
-        if (res != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n",
-                curl_easy_strerror(res));
-        }
-
-        curl_easy_cleanup(curl_handle);
-
-        return http_code >= 200 && http_code < 300;
+    bool GetFileStamp(path const& path, ResourceStamp& stamp) {
+        std::error_code ec;
+        if (!std::filesystem::is_regular_file(path, ec)) return false;
+        stamp.Size = std::filesystem::file_size(path, ec);
+        if (ec) return false;
+        stamp.ModifiedTime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+        stamp.ETag.clear();
+        return !ec;
     }
 }
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <map>
 #include <set>
 #include <filesystem>
+#include <functional>
 #include <fstream>
 #include <regex>
 #include <nlohmann/json.hpp>
@@ -53,7 +54,11 @@ namespace HyperTiler {
 
     struct URI : public string {
         bool IsFilesystemResource() const { return !IsNetworkResource(); }
-        bool IsNetworkResource() const { return std::regex_search(*this, std::regex(R"(^https?\:\/\/)")); }
+        bool IsNetworkResource() const { return compare(0, 7, "http://") == 0 || compare(0, 8, "https://") == 0; }
+
+        // Tiles packed in one PMTiles archive, named "<archive>#{z}/{x}/{y}", see TileArchive.hpp
+        bool IsArchiveResource() const { return find(".pmtiles#") != npos; }
+        string ArchivePath() const { return substr(0, find('#')); }
         URI() = default;
         URI(string const& other) : string(other) { }
     };
@@ -124,6 +129,10 @@ namespace HyperTiler {
 
     void htAssert(bool expression);
 
+    // Benchmarks
+    // Runs the work at least three times and for at least a quarter of a second, returns the seconds of the fastest run
+    double FastestRun(std::function<void()> const& run);
+
     // Math
     int CorrectMod(int val, int mod);
     ivec2 CorrectMod(ivec2 val, ivec2 mod);
@@ -131,18 +140,36 @@ namespace HyperTiler {
     ivec2 FloorOnInterval(ivec2 val, ivec2 mod);
     int CeilOnInterval(int val, int mod);
     ivec2 CeilOnInterval(ivec2 val, ivec2 mod);
+    inline uint16_t SwapBytes(uint16_t val) { return static_cast<uint16_t>((val >> 8) | (val << 8)); }
 
     // Color
     vec3 ColorMap(float scalar);
     uvec3 ToRGBU8(vec3 const& color);
 
-    // io
+    // Hashing, stable between runs so it can be used to name things on disk
+    uint64_t HashString(string const& str);
+    string HashToString(uint64_t hash);
+
+    // Identifies one version of a file or url, used to check that a cached copy is still current
+    struct ResourceStamp {
+        uint64_t Size = 0;
+        int64_t ModifiedTime = -1;
+        string ETag;
+
+        // ETags are compared when both sides have one, otherwise size and modification time
+        bool Matches(ResourceStamp const& other) const;
+
+        // Whether there is an ETag or a modification time, a size alone doesn't tell versions apart
+        bool IdentifiesVersion() const;
+    };
+
+    // io, network io is in Http.hpp
     vector<uint8_t> ReadEntireFileBinary(path const& path);
-    vector<uint8_t> ReadEntireUrlBinary(string const& path);
-    bool            CheckUrlExistence(string const& path);
+
+    // return false if the resource doesn't exist
+    bool GetFileStamp(path const& path, ResourceStamp& stamp);
 
     string ReadEntireFileText(path const& path);
-    string ReadEntireUrlText(string const& path);
 
     void ReadEntireFileBinary(path const& path, uint8_t* data, uint64_t size);
     void WriteEntireFileBinary(path const& outPath, uint8_t const* data, uint64_t size);
@@ -92,6 +92,140 @@ namespace HyperTiler {
         });
     }
 
+    // Whether an If-None-Match header lists the tag, or is *
+    inline bool MatchesETag(string const& header, string const& tag) {
+        size_t begin = 0;
+        while (begin < header.size()) {
+            size_t end = header.find(',', begin);
+            if (end == string::npos) end = header.size();
+
+            string candidate = header.substr(begin, end - begin);
+            candidate.erase(0, candidate.find_first_not_of(" \t"));
+            candidate.erase(candidate.find_last_not_of(" \t") + 1);
+
+            // Weak tags name the same response here, it is always byte for byte the same
+            if (candidate.rfind("W/", 0) == 0) candidate.erase(0, 2);
+            if (candidate == "*" || candidate == tag) return true;
+
+            begin = end + 1;
+        }
+        return false;
+    }
+
+    // Works out the ETag of a response before it is made, empty if it can't be tagged
+    // The state is not const, it can keep what was loaded to work out the tag for the response
+    template<typename T>
+    using TagFunc = std::function<string(T&)>;
+
+    template<typename T>
+    using CachedDataFunc = std::function<std::shared_ptr<vector<uint8_t> const>(T&, string const& tag)>;
+
+    // Like AddDataPost, but the response carries the ETag from tagFunc and dataFunc isn't called for a client
+    // that already has it, which is answered with 304. Clients have to revalidate every time, the tag can't be
+    // known without asking. The same request is also taken as a GET with the json in the "request" parameter,
+    // which browsers cache and revalidate on their own.
+    template<typename T>
+    void AddCachedDataRoute(httplib::Server& svr, string const& path, string const& mime, ParseJsonFunc<T> const& parseFunc, TagFunc<T> const& tagFunc, CachedDataFunc<T> const& dataFunc) {
+        const httplib::Server::Handler handler = [parseFunc, tagFunc, dataFunc, mime](const httplib::Request& req, httplib::Response& res) {
+            json j;
+            try {
+                j = json::parse(req.method == "GET" ? req.get_param_value("request") : req.body);
+            } catch (json::exception const& ex) {
+                res.status = 400;
+                res.set_content(ex.what(), "text/plain");
+                return;
+            }
+
+            T state;
+            js::ErrorStack er;
+            try {
+                parseFunc(j, er, state);
+            } catch (json::exception const& ex) {
+                res.status = 500;
+                res.set_content(string("parseFunc unexpectedly threw json error:\n") + ex.what(), "text/plain");
+                return;
+            }
+
+            if (!er.empty()) {
+                res.status = 400;
+                res.set_content(er.what(), "text/plain");
+                return;
+            }
+
+            const string tag = tagFunc(state);
+            if (!tag.empty()) {
+                res.set_header("ETag", tag);
+                res.set_header("Cache-Control", "no-cache");
+
+                if (req.has_header("If-None-Match") && MatchesETag(req.get_header_value("If-None-Match"), tag)) {
+                    res.status = 304;
+                    return;
+                }
+            }
+
+            std::shared_ptr<vector<uint8_t> const> const data = dataFunc(state, tag);
+
+            res.status = 200;
+            if (!data || data->empty()) {
+                res.set_content("", 0, mime.c_str());
+                return;
+            }
+
+            // Sent straight from the shared copy, which may be kept for other requests
+            res.set_content_provider(data->size(), mime.c_str(), [data](size_t offset, size_t length, httplib::DataSink& sink) {
+                return sink.write(reinterpret_cast<char const*>(data->data()) + offset, std::min(length, data->size() - offset));
+            });
+        };
+
+        svr.Post(path.c_str(), handler);
+        svr.Get(path.c_str(), handler);
+    }
+
+    // Writes a part of a streamed response, returns false once the client is gone
+    typedef std::function<bool(string const&)> StreamWriteFunc;
+
+    template<typename T>
+    using StreamPostFunc = std::function<void(T const&, StreamWriteFunc const&)>;
+
+    // Like AddJsonPost, but the response is sent in parts as streamFunc writes them
+    template<typename T>
+    void AddStreamPost(httplib::Server& svr, string const& path, string const& mime, ParseJsonFunc<T> const& parseFunc, StreamPostFunc<T> const& streamFunc) {
+        svr.Post(path.c_str(), [parseFunc, streamFunc, mime](const httplib::Request& req, httplib::Response& res) {
+            json j;
+            try {
+                j = json::parse(req.body);
+            } catch (json::exception const& ex) {
+                res.status = 400;
+                res.set_content(ex.what(), "text/plain");
+                return;
+            }
+
+            auto state = std::make_shared<T>();
+            js::ErrorStack er;
+            try {
+                parseFunc(j, er, *state);
+            } catch (json::exception const& ex) {
+                res.status = 500;
+                res.set_content(string("parseFunc unexpectedly threw json error:\n") + ex.what(), "text/plain");
+                return;
+            }
+
+            if (!er.empty()) {
+                res.status = 400;
+                res.set_content(er.what(), "text/plain");
+                return;
+            }
+
+            // The response is produced after the handler returns, so the state goes along with the provider
+            res.status = 200;
+            res.set_chunked_content_provider(mime.c_str(), [streamFunc, state](size_t, httplib::DataSink& sink) {
+                streamFunc(*state, [&sink](string const& part) { return sink.write(part.data(), part.size()); });
+                sink.done();
+                return true;
+            });
+        });
+    }
+
     #define EASY_POST(svr, path, T, parseBody, postBody)\
     AddJsonPost<T>(svr, path, [](json const& j, js::ErrorStack& er, T& state) parseBody, [](T const& state) -> json postBody)
 }
\ No newline at end of file
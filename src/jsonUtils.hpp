@@ -139,6 +139,13 @@ namespace HyperTiler {
 				LoadNamed<T>(data, er, stackLevel, name, val);
 			}
 
+			// Leaves val untouched if the parameter isn't present
+#define DestoreOptional(name) M_LoadNamedOptional<decltype(name)>(#name, name);
+			template<typename T>
+			inline void M_LoadNamedOptional(string const& name, T& val) {
+				if (data.find(name) != data.end()) LoadNamed<T>(data, er, stackLevel, name, val);
+			}
+
 			ParseContext(json const& data);
 		};
 